@@ -26,8 +26,9 @@
 #include "utils.h"
 
 /*
- * This won't be a fast implementation of Tiger. For now, I just want
- * to be done with it and have it somewhat portable.
+ * This isn't a particularly fast implementation of Tiger, but it is
+ * portable. TTH leaves are hashed several at a time, though (see
+ * tigerleaves()).
  */
 
 static unsigned long long table[];
@@ -107,6 +108,142 @@ static void doblock(struct tigerhash *th)
     th->offset = 0;
 }
 
+/*
+ * The following computes the Tiger hashes of four TTH leaves at a
+ * time. The leaves are independent of each other, so the rounds of
+ * the four hashes can be interleaved, which keeps the table lookups
+ * of one hash from stalling the others. It is plain C, so it should
+ * work everywhere.
+ */
+
+#define NLANES 4
+
+static void round4(unsigned long long *a, unsigned long long *b, unsigned long long *c, unsigned long long *x, int mul)
+{
+    int l;
+    
+    for(l = 0; l < NLANES; l++) {
+	c[l] ^= x[l];
+	a[l] -= table[((c[l] >> 0) & 0xff) + 0x0000] ^ table[((c[l] >> 16) & 0xff) + 0x0100] ^ table[((c[l] >> 32) & 0xff) + 0x0200] ^ table[((c[l] >> 48) & 0xff) + 0x0300];
+	b[l] += table[((c[l] >> 8) & 0xff) + 0x0300] ^ table[((c[l] >> 24) & 0xff) + 0x0200] ^ table[((c[l] >> 40) & 0xff) + 0x0100] ^ table[((c[l] >> 56) & 0xff) + 0x0000];
+	b[l] *= mul;
+    }
+}
+
+static void pass4(unsigned long long *a, unsigned long long *b, unsigned long long *c, unsigned long long x[8][NLANES], int mul)
+{
+    round4(a, b, c, x[0], mul);
+    round4(b, c, a, x[1], mul);
+    round4(c, a, b, x[2], mul);
+    round4(a, b, c, x[3], mul);
+    round4(b, c, a, x[4], mul);
+    round4(c, a, b, x[5], mul);
+    round4(a, b, c, x[6], mul);
+    round4(b, c, a, x[7], mul);
+}
+
+static void key_schedule4(unsigned long long x[8][NLANES])
+{
+    int l;
+    
+    for(l = 0; l < NLANES; l++) {
+	x[0][l] -= x[7][l] ^ 0xa5a5a5a5a5a5a5a5ULL;
+	x[1][l] ^= x[0][l];
+	x[2][l] += x[1][l];
+	x[3][l] -= x[2][l] ^ ((~x[1][l]) << 19);
+	x[4][l] ^= x[3][l];
+	x[5][l] += x[4][l];
+	x[6][l] -= x[5][l] ^ ((~x[4][l]) >> 23);
+	x[7][l] ^= x[6][l];
+	x[0][l] += x[7][l];
+	x[1][l] -= x[0][l] ^ ((~x[7][l]) << 19);
+	x[2][l] ^= x[1][l];
+	x[3][l] += x[2][l];
+	x[4][l] -= x[3][l] ^ ((~x[2][l]) >> 23);
+	x[5][l] ^= x[4][l];
+	x[6][l] += x[5][l];
+	x[7][l] -= x[6][l] ^ 0x0123456789abcdefULL;
+    }
+}
+
+static unsigned long long getle64(unsigned char *p)
+{
+    return(((unsigned long long)p[0] << 0) | ((unsigned long long)p[1] << 8) |
+	   ((unsigned long long)p[2] << 16) | ((unsigned long long)p[3] << 24) |
+	   ((unsigned long long)p[4] << 32) | ((unsigned long long)p[5] << 40) |
+	   ((unsigned long long)p[6] << 48) | ((unsigned long long)p[7] << 56));
+}
+
+/* blocks[l] points to the next 64-byte block of lane l. */
+static void doblock4(unsigned long long *a, unsigned long long *b, unsigned long long *c, unsigned char **blocks)
+{
+    int i, l;
+    unsigned long long x[8][NLANES], aa[NLANES], bb[NLANES], cc[NLANES];
+    
+    for(l = 0; l < NLANES; l++) {
+	for(i = 0; i < 8; i++)
+	    x[i][l] = getle64(blocks[l] + (i * 8));
+	aa[l] = a[l];
+	bb[l] = b[l];
+	cc[l] = c[l];
+    }
+    pass4(a, b, c, x, 5);
+    key_schedule4(x);
+    pass4(c, a, b, x, 7);
+    key_schedule4(x);
+    pass4(b, c, a, x, 9);
+    for(l = 0; l < NLANES; l++) {
+	a[l] ^= aa[l];
+	b[l] -= bb[l];
+	c[l] += cc[l];
+    }
+}
+
+/*
+ * Hashes the NLANES consecutive 1024-byte leaves in buf into res. A
+ * leaf hash covers a zero byte followed by the leaf, so every block
+ * but the first and the last can be read directly from buf.
+ */
+static void tigerleaves(unsigned char *buf, char res[NLANES][24])
+{
+    int i, k, l;
+    unsigned long long a[NLANES], b[NLANES], c[NLANES], v;
+    unsigned char first[NLANES][64], last[NLANES][64], *blocks[NLANES];
+    
+    for(l = 0; l < NLANES; l++) {
+	a[l] = 0x0123456789abcdefULL;
+	b[l] = 0xfedcba9876543210ULL;
+	c[l] = 0xf096a5b4c3b2e187ULL;
+	first[l][0] = 0;
+	memcpy(first[l] + 1, buf + (l * 1024), 63);
+	memset(last[l], 0, 64);
+	last[l][0] = buf[(l * 1024) + 1023];
+	last[l][1] = 1;
+	v = 1025 << 3;
+	for(i = 0; i < 8; i++) {
+	    last[l][56 + i] = v & 0xff;
+	    v >>= 8;
+	}
+	blocks[l] = first[l];
+    }
+    doblock4(a, b, c, blocks);
+    for(k = 1; k < 16; k++) {
+	for(l = 0; l < NLANES; l++)
+	    blocks[l] = buf + (l * 1024) + (k * 64) - 1;
+	doblock4(a, b, c, blocks);
+    }
+    for(l = 0; l < NLANES; l++)
+	blocks[l] = last[l];
+    doblock4(a, b, c, blocks);
+    for(l = 0; l < NLANES; l++) {
+	for(i = 0; i < 8; i++) {
+	    res[l][i] = (a[l] >> (i * 8)) & 0xff;
+	    res[l][i + 8] = (b[l] >> (i * 8)) & 0xff;
+	    res[l][i + 16] = (c[l] >> (i * 8)) & 0xff;
+	}
+    }
+}
+
 void dotiger(struct tigerhash *th, char *buf, size_t buflen)
 {
     int taken;
@@ -213,9 +350,19 @@ static void dotreeblock(struct tigertreehash *tth)
 
 void dotigertree(struct tigertreehash *tth, char *buf, size_t buflen)
 {
-    int taken;
+    int taken, i;
+    char res[NLANES][24];
     
     while(buflen > 0) {
+	if((tth->offset == 0) && (buflen >= NLANES * 1024)) {
+	    /* Whole leaves are hashed straight from the buffer. */
+	    tigerleaves((unsigned char *)buf, res);
+	    for(i = 0; i < NLANES; i++)
+		pushtigertree(tth, res[i]);
+	    buf += NLANES * 1024;
+	    buflen -= NLANES * 1024;
+	    continue;
+	}
 	taken = buflen;
 	if(taken > 1024 - tth->offset)
 	    taken = 1024 - tth->offset;
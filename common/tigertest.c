@@ -0,0 +1,163 @@
+/*
+ *  Dolda Connect - Modular multiuser Direct Connect-style client
+ *  Copyright (C) 2007 Fredrik Tolf <fredrik@dolda2000.com>
+ *  
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *  
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *  
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <utils.h>
+#include <tiger.h>
+
+static struct {
+    char c;
+    size_t len;
+    char *tth;
+} vectors[] = {
+    {0, 0, "LWPNACQDBZRYXW3VHJVCJ64QBZNGHOHHHZWCLNQ"},
+    {'A', 1024, "L66Q4YVNAFWVS23X2HJIRA5ZJ7WXR3F26RSASFA"},
+    {'A', 1025, "PZMRYHGY6LTBEH63ZWAHDORHSYTLO4LEFUIKHWY"},
+    {0, 0, NULL}
+};
+
+/* Chunk sizes that leave the tree hash with a partial block between
+ * calls, so that it has to fall back to buffering. */
+static size_t chunks[] = {1, 7, 1023, 1025, 4097, 0};
+
+static int fails = 0;
+
+static void tthbuf(char *buf, size_t len, size_t chunk, char *res)
+{
+    struct tigertreehash tth;
+    size_t n;
+
+    inittigertree(&tth);
+    while(len > 0) {
+	n = ((chunk == 0) || (chunk > len))?len:chunk;
+	dotigertree(&tth, buf, n);
+	buf += n;
+	len -= n;
+    }
+    synctigertree(&tth);
+    restigertree(&tth, res);
+}
+
+/*
+ * Computes the tree hash the slow way, with one plain Tiger hash per
+ * leaf and per interior node, to compare the real thing against.
+ */
+static void reftth(char *buf, size_t len, char *res)
+{
+    struct tigerhash th;
+    char (*level)[24];
+    char pfx;
+    size_t n, i, o;
+
+    n = (len + 1023) / 1024;
+    if(n == 0)
+	n = 1;
+    level = smalloc(sizeof(*level) * n);
+    for(i = 0; i < n; i++) {
+	inittiger(&th);
+	pfx = 0;
+	dotiger(&th, &pfx, 1);
+	o = i * 1024;
+	dotiger(&th, buf + o, ((len - o) > 1024)?1024:(len - o));
+	synctiger(&th);
+	restiger(&th, level[i]);
+    }
+    while(n > 1) {
+	for(i = 0; i < n / 2; i++) {
+	    inittiger(&th);
+	    pfx = 1;
+	    dotiger(&th, &pfx, 1);
+	    dotiger(&th, level[i * 2], 48);
+	    synctiger(&th);
+	    restiger(&th, level[i]);
+	}
+	if(n & 1)
+	    memcpy(level[i++], level[n - 1], 24);
+	n = i;
+    }
+    memcpy(res, level[0], 24);
+    free(level);
+}
+
+static void checkvectors(void)
+{
+    char *buf, *b32;
+    char res[24];
+    int i;
+
+    for(i = 0; vectors[i].tth != NULL; i++) {
+	buf = smalloc(vectors[i].len + 1);
+	memset(buf, vectors[i].c, vectors[i].len);
+	tthbuf(buf, vectors[i].len, 0, res);
+	b32 = base32encode(res, 24);
+	b32[39] = 0;
+	if(strcmp(b32, vectors[i].tth)) {
+	    fprintf(stderr, "tigertest: %zi bytes of %02x: got %s, expected %s\n", vectors[i].len, vectors[i].c, b32, vectors[i].tth);
+	    fails++;
+	}
+	free(b32);
+	free(buf);
+    }
+}
+
+static void checksizes(void)
+{
+    char *buf;
+    char ref[24], res[24];
+    size_t max, len, base;
+    unsigned int seed;
+    int i, o;
+
+    max = 16 * 1024 + 1;
+    buf = smalloc(max);
+    for(seed = 1, len = 0; len < max; len++) {
+	seed = seed * 1103515245 + 12345;
+	buf[len] = seed >> 16;
+    }
+    for(base = 0; base <= 16 * 1024; base += 4 * 1024) {
+	for(o = -1; o <= 1; o++) {
+	    if((base == 0) && (o < 0))
+		continue;
+	    len = base + o;
+	    reftth(buf, len, ref);
+	    for(i = -1; (i < 0) || (chunks[i] != 0); i++) {
+		tthbuf(buf, len, (i < 0)?0:chunks[i], res);
+		if(memcmp(res, ref, 24)) {
+		    fprintf(stderr, "tigertest: %zi bytes in chunks of %zi: tree hash differs\n", len, (i < 0)?len:chunks[i]);
+		    fails++;
+		}
+	    }
+	}
+    }
+    free(buf);
+}
+
+int main(int argc, char **argv)
+{
+    checkvectors();
+    checksizes();
+    if(fails) {
+	fprintf(stderr, "tigertest: %i failures\n", fails);
+	return(1);
+    }
+    return(0);
+}
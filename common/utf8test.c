@@ -0,0 +1,94 @@
+/*
+ *  Dolda Connect - Modular multiuser Direct Connect-style client
+ *  Copyright (C) 2007 Fredrik Tolf <fredrik@dolda2000.com>
+ *  
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *  
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *  
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <wchar.h>
+#include <errno.h>
+
+#include <utils.h>
+
+static struct {
+    char *mbs;
+    wchar_t *wcs;
+} cases[] = {
+    {"", L""},
+    {"abc", L"abc"},
+    {"\xc3\xa5\xc3\xa4\xc3\xb6", L"\x00e5\x00e4\x00f6"},
+    {"x\xe2\x82\xacy", L"x\x20acy"},
+    {"\xf0\x9f\x98\x80", L"\x1f600"},
+    {"\xf4\x8f\xbf\xbf", L"\x10ffff"},
+    /* Sequences cut short by the end of the string */
+    {"abc\xc3", NULL},
+    {"abc\xe2\x82", NULL},
+    {"\xf0\x9f\x98", NULL},
+    /* Sequences cut short by another character */
+    {"\xe2\x82y", NULL},
+    {"\xc3\xc3\xa5", NULL},
+    /* Stray continuation and invalid lead bytes */
+    {"\x80", NULL},
+    {"a\xbf" "b", NULL},
+    {"\xf8\x88\x80\x80\x80", NULL},
+    {"\xff", NULL},
+    /* Overlong forms, surrogates and characters beyond U+10FFFF */
+    {"\xc0\x80", NULL},
+    {"\xe0\x80\xaf", NULL},
+    {"\xed\xa0\x80", NULL},
+    {"\xf4\x90\x80\x80", NULL},
+    {NULL, NULL}
+};
+
+int main(int argc, char **argv)
+{
+    wchar_t *res;
+    int i, fails;
+
+    fails = 0;
+    for(i = 0; cases[i].mbs != NULL; i++) {
+	errno = 0;
+	res = utf8towcs(cases[i].mbs);
+	if(cases[i].wcs == NULL) {
+	    if(res != NULL) {
+		fprintf(stderr, "utf8test: case %i: invalid UTF-8 was accepted as \"%ls\"\n", i, res);
+		fails++;
+		free(res);
+	    } else if(errno != EILSEQ) {
+		fprintf(stderr, "utf8test: case %i: failed with %s instead of EILSEQ\n", i, strerror(errno));
+		fails++;
+	    }
+	} else {
+	    if(res == NULL) {
+		fprintf(stderr, "utf8test: case %i: valid UTF-8 was rejected: %s\n", i, strerror(errno));
+		fails++;
+	    } else {
+		if(wcscmp(res, cases[i].wcs)) {
+		    fprintf(stderr, "utf8test: case %i: decoded wrongly\n", i);
+		    fails++;
+		}
+		free(res);
+	    }
+	}
+    }
+    if(fails) {
+	fprintf(stderr, "utf8test: %i failures\n", fails);
+	return(1);
+    }
+    return(0);
+}
@@ -319,6 +319,120 @@ char *icswcstombs(wchar_t *wcs, char *charset, char *def)
     return(buf);
 }
 
+/*
+ * Converts from UTF-8 to a wide string without the overhead of
+ * setting up iconv, which matters when it is done for many short
+ * strings. Invalid UTF-8 fails with EILSEQ.
+ */
+wchar_t *utf8towcs(char *mbs)
+{
+#ifdef __STDC_ISO_10646__
+    static unsigned long min[] = {0, 0x80, 0x800, 0x10000};
+    wchar_t *buf, *p;
+    unsigned char *c;
+    unsigned long ucp;
+    int i, n, err;
+    
+    /* No character is shorter than one byte. */
+    if((buf = malloc((strlen(mbs) + 1) * sizeof(wchar_t))) == NULL)
+    {
+	LOGOOM((strlen(mbs) + 1) * sizeof(wchar_t));
+	return(NULL);
+    }
+    err = 0;
+    for(c = (unsigned char *)mbs, p = buf; *c != 0; p++)
+    {
+	if(*c < 0x80)
+	{
+	    ucp = *(c++);
+	    n = 0;
+	} else if((*c & 0xe0) == 0xc0) {
+	    ucp = *(c++) & 0x1f;
+	    n = 1;
+	} else if((*c & 0xf0) == 0xe0) {
+	    ucp = *(c++) & 0x0f;
+	    n = 2;
+	} else if((*c & 0xf8) == 0xf0) {
+	    ucp = *(c++) & 0x07;
+	    n = 3;
+	} else {
+	    err = 1;
+	    break;
+	}
+	for(i = 0; i < n; i++)
+	{
+	    if((*c & 0xc0) != 0x80)
+		break;
+	    ucp = (ucp << 6) | (*(c++) & 0x3f);
+	}
+	/* A sequence cut short by the end of the string also ends
+	 * up here, so *c cannot be relied on to tell. */
+	if((i < n) || (ucp < min[n]) || (ucp > 0x10ffff) || ((ucp >= 0xd800) && (ucp < 0xe000)))
+	{
+	    err = 1;
+	    break;
+	}
+	*p = ucp;
+    }
+    if(err)
+    {
+	free(buf);
+	errno = EILSEQ;
+	return(NULL);
+    }
+    *p = L'\0';
+    return(realloc(buf, (p - buf + 1) * sizeof(wchar_t)));
+#else
+    return(icmbstowcs(mbs, "UTF-8"));
+#endif
+}
+
+/*
+ * The converse of utf8towcs().
+ */
+char *wcstoutf8(wchar_t *wcs)
+{
+#ifdef __STDC_ISO_10646__
+    char *buf;
+    unsigned char *p;
+    unsigned long c;
+    
+    if((buf = malloc(wcslen(wcs) * 4 + 1)) == NULL)
+    {
+	LOGOOM(wcslen(wcs) * 4 + 1);
+	return(NULL);
+    }
+    for(p = (unsigned char *)buf; *wcs != L'\0'; wcs++)
+    {
+	c = *wcs;
+	if(c < 0x80)
+	{
+	    *(p++) = c;
+	} else if(c < 0x800) {
+	    *(p++) = 0xc0 | (c >> 6);
+	    *(p++) = 0x80 | (c & 0x3f);
+	} else if((c < 0x10000) && ((c < 0xd800) || (c >= 0xe000))) {
+	    *(p++) = 0xe0 | (c >> 12);
+	    *(p++) = 0x80 | ((c >> 6) & 0x3f);
+	    *(p++) = 0x80 | (c & 0x3f);
+	} else if((c >= 0x10000) && (c <= 0x10ffff)) {
+	    *(p++) = 0xf0 | (c >> 18);
+	    *(p++) = 0x80 | ((c >> 12) & 0x3f);
+	    *(p++) = 0x80 | ((c >> 6) & 0x3f);
+	    *(p++) = 0x80 | (c & 0x3f);
+	} else {
+	    free(buf);
+	    errno = EILSEQ;
+	    return(NULL);
+	}
+    }
+    *p = 0;
+    return(realloc(buf, (char *)p - buf + 1));
+#else
+    return(icwcstombs(wcs, "UTF-8"));
+#endif
+}
+
 wchar_t *wcstolower(wchar_t *wcs)
 {
     wchar_t *p;
@@ -21,13 +21,18 @@
  * copying and pasting is very ugly, but it doesn't *really*
  * matter. */
 
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <string.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
 #include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/file.h>
 
 #ifdef HAVE_CONFIG_H
 #include <config.h>
@@ -35,7 +40,62 @@
 #include <tiger.h>
 #include <utils.h>
 
+/* Files are read with this size, aligned for O_DIRECT */
+#define READSIZE (1 << 20)
+#define READALIGN 4096
+/* The amount of data hashed by each thread per kernel in benchmarks */
+#define BENCHSIZE (256 << 20)
+
+/* These are copied from the daemon's hash cache journal format,
+ * which is also used for the files imported from here. */
+#define HCJMAGIC "DCHCJRNL"
+#define HCVERSION 2
+
+struct hcfilehead
+{
+    char magic[8];
+    int version;
+    int recsize;
+    unsigned long long count;
+};
+
+struct hcfilerec
+{
+    unsigned long long dev, inode;
+    long long mtime;
+    char tth[24];
+    unsigned long long tthloff, tthlcount;
+};
+
+struct hcjournalrec
+{
+    struct hcfilerec r;
+    unsigned long long sum;
+};
+
+struct file
+{
+    char *name;
+    int done, err;
+    struct stat sb;
+    char res[24];
+};
+
 char buf[32768];
+static struct file *files;
+static int nfiles, nextfile, nextout;
+static int output = 4, progress = 0, direct = 0, bench = 0;
+static char *cachename = NULL;
+static int cachefd = -1;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct option longopts[] = {
+    {"jobs", 1, NULL, 'j'},
+    {"direct", 0, NULL, 'd'},
+    {"bench", 0, NULL, 'b'},
+    {"cache", 1, NULL, 'c'},
+    {NULL}
+};
 
 static char *base64enc2(char *data, size_t datalen)
 {
@@ -57,27 +117,298 @@ static char *base64dec2(char *data, size_t *datalen)
     return(res);
 }
 
+static double dtime(void)
+{
+    struct timeval tv;
+    
+    gettimeofday(&tv, NULL);
+    return((double)tv.tv_sec + ((double)tv.tv_usec / 1000000.0));
+}
+
+static char *encres(char *res)
+{
+    if(output == 5)
+	return(base32encode(res, 24));
+    else if(output == 6)
+	return(base64encode(res, 24));
+    return(hexencode(res, 24));
+}
+
+static unsigned long long hcjsum(struct hcfilerec *rec)
+{
+    unsigned long long sum;
+    unsigned char *p;
+    int i;
+    
+    sum = 0xcbf29ce484222325ULL;
+    for(p = (unsigned char *)rec, i = 0; i < sizeof(*rec); i++)
+	sum = (sum ^ p[i]) * 0x100000001b3ULL;
+    return(sum);
+}
+
+/*
+ * Records a hashed file for the daemon's hash cache. The daemon's own
+ * journal is rotated and removed under its feet, so the records go
+ * into an import file of this process' own, which the daemon takes in
+ * when it starts or is sent SIGHUP. The file is locked for as long as
+ * this process runs, and only gets its final name once its header is
+ * written, so that the daemon never sees it half-made.
+ */
+static void cachefile(struct file *f)
+{
+    struct hcfilehead head;
+    struct hcjournalrec rec;
+    char *name, *tmpname;
+    
+    if(!S_ISREG(f->sb.st_mode))
+	return;
+    if(cachefd < 0) {
+	name = sprintf2("%s.import.%i", cachename, (int)getpid());
+	tmpname = sprintf2("%s.new", name);
+	if(((cachefd = open(tmpname, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) || flock(cachefd, LOCK_EX)) {
+	    fprintf(stderr, "tigersum: %s: %s\n", tmpname, strerror(errno));
+	    exit(1);
+	}
+	memset(&head, 0, sizeof(head));
+	memcpy(head.magic, HCJMAGIC, 8);
+	head.version = HCVERSION;
+	head.recsize = sizeof(rec);
+	if((write(cachefd, &head, sizeof(head)) != sizeof(head)) || rename(tmpname, name)) {
+	    fprintf(stderr, "tigersum: %s: %s\n", name, strerror(errno));
+	    unlink(tmpname);
+	    exit(1);
+	}
+	free(tmpname);
+	free(name);
+    }
+    memset(&rec, 0, sizeof(rec));
+    rec.r.dev = f->sb.st_dev;
+    rec.r.inode = f->sb.st_ino;
+    rec.r.mtime = f->sb.st_mtime;
+    memcpy(rec.r.tth, f->res, 24);
+    rec.sum = hcjsum(&rec.r);
+    if(write(cachefd, &rec, sizeof(rec)) != sizeof(rec)) {
+	fprintf(stderr, "tigersum: %s.import.%i: %s\n", cachename, (int)getpid(), strerror(errno));
+	exit(1);
+    }
+}
+
+/* Prints the results of all files done so far, in order. */
+static void flushout(void)
+{
+    struct file *f;
+    char *enc;
+    
+    for(; (nextout < nfiles) && files[nextout].done; nextout++) {
+	f = &files[nextout];
+	if(f->err) {
+	    fprintf(stderr, "tigersum: %s: %s\n", f->name, strerror(f->err));
+	    exit(1);
+	}
+	if(bench)
+	    continue;
+	enc = encres(f->res);
+	if(nfiles > 1)
+	    printf("%s %s\n", enc, f->name);
+	else
+	    printf("%s\n", enc);
+	free(enc);
+	fflush(stdout);
+	if(cachename != NULL)
+	    cachefile(f);
+    }
+}
+
+static int openfile(char *name)
+{
+    int fd;
+    
+    if(!strcmp(name, "-"))
+	return(0);
+#ifdef O_DIRECT
+    /* Not all file systems support O_DIRECT. */
+    if(direct && ((fd = open(name, O_RDONLY | O_DIRECT)) >= 0))
+	return(fd);
+#endif
+    return(open(name, O_RDONLY));
+}
+
+static ssize_t readfile(int fd, char *buf, size_t len)
+{
+    ssize_t ret;
+    
+    ret = read(fd, buf, len);
+#ifdef O_DIRECT
+    if((ret < 0) && (errno == EINVAL) && (fcntl(fd, F_GETFL) & O_DIRECT)) {
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_DIRECT);
+	ret = read(fd, buf, len);
+    }
+#endif
+    return(ret);
+}
+
+static void hashfile(struct file *f, char *rbuf, off_t *bytes)
+{
+    int fd, ret;
+    off_t done;
+    struct tigertreehash tth;
+    
+    if((fd = openfile(f->name)) < 0) {
+	f->err = errno;
+	return;
+    }
+    fstat(fd, &f->sb);
+    inittigertree(&tth);
+    done = 0;
+    while((ret = readfile(fd, rbuf, READSIZE)) > 0) {
+	dotigertree(&tth, rbuf, ret);
+	if(progress && ((done & ~0xFFFFF) != ((done + ret) & ~0xFFFFF))) {
+	    fprintf(stderr, "\033[1G");
+	    if(nfiles > 1)
+		fprintf(stderr, "%s: ", f->name);
+	    if(!S_ISREG(f->sb.st_mode))
+		fprintf(stderr, "%lli", (long long)(done + ret));
+	    else
+		fprintf(stderr, "%i%%", (int)(((float)(done + ret) / (float)f->sb.st_size) * 100.0));
+	    fprintf(stderr, "\033[K");
+	    fflush(stderr);
+	}
+	done += ret;
+    }
+    if(ret < 0)
+	f->err = errno;
+    if(progress)
+	fprintf(stderr, "\n");
+    synctigertree(&tth);
+    restigertree(&tth, f->res);
+    if(fd != 0)
+	close(fd);
+    *bytes += done;
+}
+
+static void *worker(void *arg)
+{
+    int i;
+    char *rbuf;
+    off_t bytes;
+    double start;
+    
+    if(posix_memalign((void **)&rbuf, READALIGN, READSIZE)) {
+	perror("tigersum: posix_memalign");
+	exit(1);
+    }
+    bytes = 0;
+    start = dtime();
+    pthread_mutex_lock(&lock);
+    while(nextfile < nfiles) {
+	i = nextfile++;
+	pthread_mutex_unlock(&lock);
+	hashfile(&files[i], rbuf, &bytes);
+	pthread_mutex_lock(&lock);
+	files[i].done = 1;
+	flushout();
+    }
+    pthread_mutex_unlock(&lock);
+    if(bench) {
+	fprintf(stderr, "thread %li: %lli bytes, %.1f MB/s\n", (long)arg, (long long)bytes, bytes / (dtime() - start) / 1048576);
+    }
+    free(rbuf);
+    return(NULL);
+}
+
+struct benchjob
+{
+    char *data;
+    int kernel;
+    double rate;
+};
+
+static void *benchworker(void *arg)
+{
+    struct benchjob *job;
+    struct tigertreehash tth;
+    char res[24];
+    size_t off, o;
+    double start;
+    
+    job = arg;
+    start = dtime();
+    inittigertree(&tth);
+    for(off = 0; off < BENCHSIZE; off += READSIZE) {
+	if(job->kernel == 0) {
+	    /* Whole leaves passed one at a time are hashed with the
+	     * plain Tiger kernel. */
+	    for(o = 0; o < READSIZE; o += 1024)
+		dotigertree(&tth, job->data + off % (READSIZE * 4) + o, 1024);
+	} else {
+	    dotigertree(&tth, job->data + off % (READSIZE * 4), READSIZE);
+	}
+    }
+    synctigertree(&tth);
+    restigertree(&tth, res);
+    job->rate = BENCHSIZE / (dtime() - start) / 1048576;
+    return(NULL);
+}
+
+/*
+ * Measures the hashing rate of each Tiger kernel in memory, in each
+ * of nthreads threads running at once.
+ */
+static void benchkernels(int nthreads)
+{
+    static char *names[] = {"tiger", "tiger4"};
+    struct benchjob *jobs;
+    pthread_t *threads;
+    char *data;
+    int i, k;
+    double total;
+    
+    data = smalloc(READSIZE * 4);
+    for(i = 0; i < READSIZE * 4; i++)
+	data[i] = i * 2654435761U >> 24;
+    jobs = smalloc(sizeof(*jobs) * nthreads);
+    threads = smalloc(sizeof(*threads) * nthreads);
+    for(k = 0; k < 2; k++) {
+	for(i = 0; i < nthreads; i++) {
+	    jobs[i].data = data;
+	    jobs[i].kernel = k;
+	    if(pthread_create(&threads[i], NULL, benchworker, &jobs[i])) {
+		perror("tigersum: pthread_create");
+		exit(1);
+	    }
+	}
+	total = 0;
+	for(i = 0; i < nthreads; i++) {
+	    pthread_join(threads[i], NULL);
+	    printf("%s: thread %i: %.1f MB/s\n", names[k], i, jobs[i].rate);
+	    total += jobs[i].rate;
+	}
+	printf("%s: total: %.1f MB/s\n", names[k], total);
+    }
+    free(threads);
+    free(jobs);
+    free(data);
+}
+
 int main(int argc, char **argv)
 {
     int i, ret;
     size_t size;
-    int c, fd, outfd;
+    int c, outfd;
     int len, len2;
-    int filter, output;
+    int filter, nthreads;
     struct tigertreehash tth;
     char *dec, *enc;
     char res[24];
     char *statefile;
     FILE *state;
-    int progress, bytes;
-    struct stat sb;
+    pthread_t *threads;
     
     filter = 0;
-    output = 4;
     outfd = 3;
-    progress = 0;
+    nthreads = 1;
     statefile = NULL;
-    while((c = getopt(argc, argv, "phf456F:s:")) != -1) {
+    while((c = getopt_long(argc, argv, "phf456F:s:j:dbc:", longopts, NULL)) != -1) {
 	switch(c) {
 	case '4':
 	case '5':
@@ -96,12 +427,26 @@ int main(int argc, char **argv)
 	case 's':
 	    statefile = optarg;
 	    break;
+	case 'j':
+	    if((nthreads = atoi(optarg)) < 1)
+		nthreads = 1;
+	    break;
+	case 'd':
+	    direct = 1;
+	    break;
+	case 'b':
+	    bench = 1;
+	    break;
+	case 'c':
+	    cachename = optarg;
+	    break;
 	case 'h':
 	case ':':
 	case '?':
 	default:
-	    fprintf(stderr, "usage: tigersum [-h456] FILE...\n");
+	    fprintf(stderr, "usage: tigersum [-hpd456] [-j THREADS] [-c HASHCACHE] FILE...\n");
 	    fprintf(stderr, "       tigersum [-h456] [-F OUTFD] [-s STATEFILE] -f\n");
+	    fprintf(stderr, "       tigersum [-d] [-j THREADS] -b [FILE...]\n");
 	    exit((c == 'h')?0:1);
 	}
     }
@@ -205,68 +550,35 @@ int main(int argc, char **argv)
 	}
 	free(enc);
 	write(outfd, "\n", 1);
+    } else if(bench && (optind == argc)) {
+	benchkernels(nthreads);
     } else {
-	for(i = optind; i < argc; i++) {
-	    if(!strcmp(argv[i], "-")) {
-		fd = 0;
-	    } else {
-		if((fd = open(argv[i], O_RDONLY)) < 0) {
-		    fprintf(stderr, "tigersum: %s: %s\n", argv[i], strerror(errno));
-		    exit(1);
-		}
-	    }
-	    if(progress) {
-		fstat(fd, &sb);
-		if(!S_ISREG(sb.st_mode))
-		    sb.st_size = -1;
-		bytes = 0;
-	    }
-	    inittigertree(&tth);
-	    while(1) {
-		ret = read(fd, buf, sizeof(buf));
-		if(ret < 0) {
-		    perror("tigersum: read");
+	nfiles = argc - optind;
+	files = smalloc(sizeof(*files) * nfiles);
+	memset(files, 0, sizeof(*files) * nfiles);
+	for(i = 0; i < nfiles; i++)
+	    files[i].name = argv[optind + i];
+	/* Progress reports from several threads would be garbled. */
+	if(nthreads > 1)
+	    progress = 0;
+	if(nthreads > nfiles)
+	    nthreads = nfiles;
+	if(nthreads <= 1) {
+	    worker((void *)0);
+	} else {
+	    threads = smalloc(sizeof(*threads) * nthreads);
+	    for(i = 0; i < nthreads; i++) {
+		if(pthread_create(&threads[i], NULL, worker, (void *)(long)i)) {
+		    perror("tigersum: pthread_create");
 		    exit(1);
 		}
-		if(progress) {
-		    if((bytes == 0) || ((bytes & ~0xFFFFF) != ((bytes + ret) & ~0xFFFFF))) {
-			bytes += ret;
-			fprintf(stderr, "\033[1G");
-			if(argc - optind > 1)
-			    fprintf(stderr, "%s: ", argv[i]);
-			if(sb.st_size < 0) {
-			    fprintf(stderr, "%i", bytes);
-			} else {
-			    fprintf(stderr, "%i%%", (int)(((float)bytes / (float)sb.st_size) * 100.0));
-			}
-			fprintf(stderr, "\033[K");
-			fflush(stderr);
-		    } else {
-			bytes += ret;
-		    }
-		}
-		if(ret == 0)
-		    break;
-		dotigertree(&tth, buf, ret);
 	    }
-	    if(progress)
-		fprintf(stderr, "\n");
-	    synctigertree(&tth);
-	    restigertree(&tth, res);
-	    if(output == 4)
-		enc = hexencode(res, 24);
-	    else if(output == 5)
-		enc = base32encode(res, 24);
-	    else if(output == 6)
-		enc = base64encode(res, 24);
-	    if(argc - optind > 1)
-		printf("%s %s\n", enc, argv[i]);
-	    else
-		printf("%s\n", enc);
-	    free(enc);
-	    fflush(stdout);
-	    close(fd);
+	    for(i = 0; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+	    free(threads);
 	}
+	if(cachefd >= 0)
+	    close(cachefd);
     }
     return(0);
 }
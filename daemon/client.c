@@ -23,13 +23,23 @@
 #include <errno.h>
 #include <dirent.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/file.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <signal.h>
+#include <pthread.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <iconv.h>
+#include <langinfo.h>
 
 #ifdef HAVE_CONFIG_H
 #include <config.h>
 #endif
+#ifdef HAVE_INOTIFY
+#include <sys/inotify.h>
+#endif
 #include "client.h"
 #include "conf.h"
 #include "log.h"
@@ -37,8 +47,22 @@
 #include "module.h"
 #include "net.h"
 #include "sysevents.h"
+#include "transfer.h"
 #include <tiger.h>
 
+/* The part of a share tree node that only directories need. Records
+ * that are not in use are linked through their nchildren. */
+struct scdir
+{
+    unsigned int *cindex;
+    unsigned int nchildren, cindexsize;
+    /* The inotify watch descriptor of a watched directory, or
+     * zero. */
+    int wd;
+    /* The filesystem path of a top-level directory */
+    char *path;
+};
+
 struct scanstate
 {
     struct scanstate *next;
@@ -52,10 +76,164 @@ struct scanqueue
     struct scanstate *state;
 };
 
+struct scanent
+{
+    char *name;
+    int type;
+    off_t size;
+    time_t mtime;
+    dev_t dev;
+    ino_t inode;
+};
+
+/* A directory being read by the scanning threads. The node is only
+ * touched by the main thread, which clears it if the node is freed
+ * before the results have been merged. */
+struct dirscan
+{
+    struct dirscan *next, *lnext;
+    struct sharecache *node;
+    char *path;
+    int dmask, fmask;
+    int err;
+    struct scanent *ents;
+    size_t entssize, entsdata;
+};
+
+/* A file being hashed by the hashing threads. The path and the
+ * node's dev/inode are set by the main thread; the rest is filled in
+ * by the thread that hashes the file. */
+struct hashjob
+{
+    struct hashjob *next, *lnext;
+    char *path;
+    /* The node that the job was queued for, and what it looked like
+     * then, so that it can be found again if it is still there. */
+    unsigned int node;
+    dev_t ndev;
+    ino_t ninode;
+    time_t nmtime;
+    int err;
+    dev_t dev;
+    ino_t inode;
+    time_t mtime;
+    off_t size;
+    char tth[24];
+    int tthlshift;
+    char (*tthl)[24];
+    size_t tthlsize, tthldata;
+    char *ckptpath;
+    off_t ckptint;
+};
+
+/* The hash cache file consists of a header followed by count
+ * records, in native byte order. */
+#define HCMAGIC "DCHCACHE"
+#define HCVERSION 2
+/* Version 1 records lacked the TTHL fields */
+#define HCV1RECSIZE 48
+
+/* The share snapshot has the same kind of header as the hash cache
+ * file, but the SNAPMAGIC magic, followed by one of these for each
+ * node in depth-first order. Each record is followed by the node's
+ * name and, for the shares themselves, by their paths. */
+#define SNAPMAGIC "DCSHTREE"
+#define SNAPVERSION 1
+struct snaprec
+{
+    unsigned long long dev, inode, size;
+    long long mtime;
+    char tth[24];
+    unsigned int depth, namelen, pathlen;
+    unsigned char type, hastth;
+};
+
+struct trigram
+{
+    unsigned long long key;
+    unsigned int *names;
+    size_t namessize, namesdata;
+};
+
+struct hcfilehead
+{
+    char magic[8];
+    int version;
+    int recsize;
+    unsigned long long count;
+};
+
+struct hcfilerec
+{
+    unsigned long long dev, inode;
+    long long mtime;
+    char tth[24];
+    unsigned long long tthloff, tthlcount;
+};
+
+/* Hashes are first appended to a journal of these, with the same
+ * kind of header as the hash cache file, but the HCJMAGIC magic. */
+#define HCJMAGIC "DCHCJRNL"
+struct hcjournalrec
+{
+    struct hcfilerec r;
+    unsigned long long sum;
+};
+
+/* The maximum number of journal records to buffer before writing */
+#define HCJBATCH 256
+
+/* The TTH leaves of hashed files are kept in a file next to the hash
+ * cache, with the same kind of header but the TTHLMAGIC magic,
+ * followed by one of these and count leaves for each file. Trees are
+ * only appended to it, and the file is compacted at startup once
+ * most of it is garbage. */
+#define TTHLMAGIC "DCHCTTHL"
+struct tthlhead
+{
+    char tth[24];
+    unsigned int count, shift;
+};
+
+/* Very large files get coarser leaves, to keep their trees within
+ * this many leaves. */
+#define TTHLMAXLEAVES 16384
+
+/* Checkpoints of large files being hashed consist of one of these,
+ * followed by the state of the tree of the whole file and of the
+ * current leaf, and the leaves finished so far. */
+#define CKPTMAGIC "DCHCCKPT"
+struct ckpthead
+{
+    char magic[8];
+    int version, treesize;
+    unsigned long long dev, inode;
+    long long mtime, size, off;
+    int tthlshift;
+    unsigned long long ntthl;
+};
+
+/* The size of the reads made by the hashing threads */
+#define HASHREADSIZE (1 << 20)
+/* Directories get a child index once they have this many children */
+#define CINDEXMIN 32
+
+/* The period, in seconds, over which the hashing rate is measured */
+#define HASHRATEWIN 10
+/* The interval, in seconds, at which the hashing rate limit is
+ * adapted to the transfer activity */
+#define HASHLOADINT 2
+/* The transfer rate, in bytes per second, over which the daemon is
+ * considered busy even with no transfers in their main phase */
+#define HASHBUSYRATE 65536
+
 static int conf_share(int argc, wchar_t **argv);
 static void freecache(struct sharecache *node);
 static void checkhashes(void);
+static void setnodetth(struct sharecache *node, char *tth);
 static void writehashcache(int now);
+static void flushjournal(void);
+static void journalhash(struct hashcache *hc);
 
 static struct configvar myvars[] =
 {
@@ -74,17 +252,66 @@ static struct configvar myvars[] =
     /** The filename to use for the hash cache (see the FILES section
      * for more information). */
     {CONF_VAR_STRING, "hashcache", {.str = L"dc-hashcache"}},
-    /** Writes of the hash cache and file lists are delayed for an
-     * amount of time, in order to minimize the time spent on I/O wait
-     * while hashing many small files. This variable sets the amount
-     * of time, in seconds. */
+    /** New hashes are appended to a journal next to the hash cache
+     * as they are completed, and writes of the full hash cache and
+     * file lists are delayed for an amount of time, in order to
+     * minimize the time spent on I/O wait while hashing many small
+     * files. This variable sets the amount of time, in seconds. */
     {CONF_VAR_INT, "hashwritedelay", {.num = 300}},
+    /** The granularity, in bytes, of the TTH leaves that are stored
+     * for hashed files and sent to peers asking for them. It is
+     * rounded down to a power of two, and no less than 1024. Very
+     * large files get coarser leaves, so that no file has more than
+     * 16384 of them. Set to zero to only store the root hashes. */
+    {CONF_VAR_INT, "tthlsize", {.num = 65536}},
+    /** While hashing files larger than this many megabytes, the
+     * hashing state is saved every time this much has been hashed,
+     * and when the daemon exits, so that hashing can be resumed from
+     * there instead of from the beginning of the file. Set to zero
+     * to disable checkpoints. */
+    {CONF_VAR_INT, "hashcheckpoint", {.num = 1024}},
+    /** The number of threads to hash files with. If zero (the
+     * default), one thread is started for each CPU. This setting is
+     * only read at startup. */
+    {CONF_VAR_INT, "hashthreads", {.num = 0}},
+    /** The number of threads to read directories with when scanning
+     * the shares. If zero (the default), one is started for each
+     * CPU, up to eight, except on single-CPU machines. If no threads
+     * are used, the shares are scanned from the main loop, a few
+     * entries at a time. Set to a negative number to always do
+     * so. This setting is only read at startup. */
+    {CONF_VAR_INT, "scanthreads", {.num = 0}},
+    /** The maximum rate, in megabytes per second, at which files are
+     * read for hashing while no files are being transferred. Set to
+     * zero (the default) for no limit. */
+    {CONF_VAR_INT, "hashidlerate", {.num = 0}},
+    /** The maximum rate, in megabytes per second, at which files are
+     * read for hashing while files are being transferred, so that
+     * uploads served from the same disks are not starved. Set to zero
+     * for no limit. */
+    {CONF_VAR_INT, "hashbusyrate", {.num = 4}},
     /** The amount of time, in seconds, to wait before automatically
      * rescanning the shared directories for changes. Set to zero (the
      * default) to disable automatic rescanning. (Broken shares are
      * always rescanned upon detection, regardless of this
-     * setting.) */
+     * setting.) While watchshares is in effect, rescanning is only
+     * needed for changes that cannot be watched, such as on network
+     * filesystems. */
     {CONF_VAR_INT, "rescandelay", {.num = 0}},
+    /** If true (the default), the shared directories are watched
+     * with inotify where supported, so that changes to them are
+     * picked up as they happen instead of by rescanning. Turning
+     * this on at runtime triggers a rescan of all shares. */
+    {CONF_VAR_BOOL, "watchshares", {.num = 1}},
+    /** The filename to save a snapshot of the share tree to, so that
+     * it can be served right away when the daemon is started again,
+     * while the shares are being rescanned. Set to the empty string
+     * to disable it. */
+    {CONF_VAR_STRING, "sharesnapshot", {.str = L"dc-sharetree"}},
+    /** The amount of time, in seconds, after the shares have changed
+     * before the snapshot is saved. It is also saved when the daemon
+     * exits. */
+    {CONF_VAR_INT, "snapshotdelay", {.num = 600}},
     {CONF_VAR_END}
 };
 
@@ -97,15 +324,112 @@ static struct configcmd mycmds[] =
 static struct scanstate *scanjob = NULL;
 static struct scanqueue *scanqueue = NULL;
 static struct sharepoint *shares = NULL;
+/* The hash cache is an open-addressing hash table, keyed by device
+ * and inode, with linear probing. */
 static struct hashcache *hashcache = NULL;
+static size_t hashcachesize = 0, hashcachedata = 0;
+static int hcjournal = -1;
+static struct hcjournalrec *hcjbuf = NULL;
+static size_t hcjbufsize = 0, hcjbufdata = 0;
+static struct timer *hcjtimer = NULL;
+static pid_t hccompactor = 0;
+static struct sockfile *tthlfile = NULL;
+static off_t tthlend;
+static int tthldirty = 0;
+/* Whether there may be checkpoints of files that are no longer being
+ * hashed. */
+static int ckptsdirty = 1;
+/* The node where checkhashes() continues its walk of the share tree,
+ * or zero to start a new pass from the top. */
+static unsigned int hashcursor = 0;
 static struct timer *hashwritetimer = NULL;
-/* Set initially to -1, but changed to 0 the first time run() is
- * called. This is to avoid forking a hash job before daemonizing,
- * since that would make the daemon unable to wait() for the hash
- * job. */
-static pid_t hashjob = -1;
+/* The hashing threads are started the first time run() is called,
+ * since they would not survive daemonizing. Until then, numhashers
+ * is zero. */
+static pthread_t *hashers;
+static int numhashers = 0;
+/* hashpending, hashdone and hashquit are shared with the hashing
+ * threads and protected by hashlock. hashjobs lists all jobs that
+ * have not yet been returned to the main thread. */
+static pthread_mutex_t hashlock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t hashcond = PTHREAD_COND_INITIALIZER;
+static struct hashjob *hashpending = NULL, *hashpendingl = NULL, *hashdone = NULL;
+static volatile int hashquit = 0;
+/* Reads for hashing are paced to hashlimit bytes per second, if it is
+ * non-zero, by giving each read a time slot starting at hashnext.
+ * Threads waiting for their slot wait on hashthrcond. */
+static pthread_cond_t hashthrcond = PTHREAD_COND_INITIALIZER;
+static double hashlimit = 0, hashnext = 0;
+static struct hashjob *hashjobs = NULL;
+static int hashpipe[2];
+static struct socket *hashsk = NULL;
+static double hashwinstart = 0, hashrate = 0;
+static off_t hashwinbytes = 0;
+static struct timer *hashloadtimer = NULL;
+/* The TTH index is a chained hash table of all hashed files, keyed
+ * by their TTH and linked through their tthnext pointers. */
+static unsigned int *tthindex = NULL;
+static size_t tthindexsize = 0, tthindexdata = 0;
+static double lastload;
+static unsigned long long lastloadbytes;
+int numhashjobs = 0;
 struct sharecache *shareroot = NULL;
+struct sharecache **scchunks = NULL;
+static unsigned int numscchunks = 0, scnodeend = 1, scfree = 0;
+static size_t numscnodes = 0, cindexmem = 0;
+/* Directory records are kept in a plain array, since they are far
+ * fewer than nodes, and so may move whenever one is added. */
+static struct scdir *scdirs = NULL;
+static unsigned int scdirssize = 0, scdirsend = 1, scdirfree = 0;
+#define scdir(n) (((n)->dir)?(scdirs + (n)->dir):NULL)
+/* Every name in the name arena is preceded by the first node with
+ * that name and its reference count, and padded to keep them
+ * aligned. nametab is an open-addressing hash table of all the names,
+ * for finding them by content. */
+char **scnames = NULL;
+static unsigned int numnamechunks = 0, namechunkend = 0;
+static unsigned int *nametab = NULL;
+static size_t nametabsize = 0, nametabdata = 0, namegarbage = 0;
+/* The name index is an open-addressing hash table of the trigrams
+ * of all lower-cased names, each with a sorted list of the names it
+ * is found in. Names are only removed from the lists when the name
+ * arena is compacted, so lookups must skip those no longer in use. */
+static struct trigram *trigrams = NULL;
+static size_t trigramssize = 0, trigramsdata = 0, trigrammem = 0;
+/* scdirty is set whenever the share tree changes, and cleared when
+ * the snapshot of it is written. */
+static int scdirty = 0;
+static struct timer *snapwritetimer = NULL;
+static pid_t snapwriter = 0;
+static int fromsnapshot = 0;
 static struct timer *scantimer = NULL;
+/* When there are scanning threads, doscan() hands the queued
+ * directories to them through scanpending, and merges the results
+ * they leave in scandone into the share tree. scanpending, scandone
+ * and scanquit are protected by scanlock. dirscans lists all
+ * directories that have not yet been merged. */
+static pthread_t *scanners;
+static int numscanners = 0;
+static pthread_mutex_t scanlock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t scancond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t scandonecond = PTHREAD_COND_INITIALIZER;
+static struct dirscan *scanpending = NULL, *scanpendingl = NULL, *scandone = NULL;
+static volatile int scanquit = 0;
+static struct dirscan *dirscans = NULL;
+static int numdirscans = 0;
+static int scanpipe[2];
+static struct socket *scansk = NULL;
+static int scanbusy = 0;
+#ifdef HAVE_INOTIFY
+/* Scanned directories are watched through watchfd. watches maps
+ * watch descriptors to directories, as an open-addressing hash table
+ * with linear probing. */
+static int watchfd = -1;
+static struct socket *watchsk = NULL;
+static struct sharecache **watches = NULL;
+static size_t watchessize = 0, watchesdata = 0;
+static int watchesfull = 0;
+#endif
 int sharedfiles = 0;
 unsigned long long sharesize = 0;
 GCBCHAIN(sharechangecb, unsigned long long);
@@ -150,13 +474,13 @@ static void dumpsharecache(struct sharecache *node, int l)
 {
     int i;
     
-    for(; node != NULL; node = node->next)
+    for(; node != NULL; node = scnext(node))
     {
 	for(i = 0; i < l; i++)
 	    putc('\t', stdout);
-	printf("%ls\n", node->name);
+	printf("%s\n", scname(node));
 	if(node->f.b.type == FILE_DIR)
-	    dumpsharecache(node->child, l + 1);
+	    dumpsharecache(scchild(node), l + 1);
     }
 }
 
@@ -242,69 +566,145 @@ int hashcmp(struct hash *h1, struct hash *h2)
     return(1);
 }
 
-static struct hashcache *newhashcache(void)
+static size_t hchash(dev_t dev, ino_t inode)
 {
-    struct hashcache *new;
+    unsigned long long h;
     
-    new = smalloc(sizeof(*new));
-    memset(new, 0, sizeof(*new));
-    new->next = hashcache;
-    new->prev = NULL;
-    if(hashcache != NULL)
-	hashcache->prev = new;
-    hashcache = new;
-    return(new);
+    h = ((unsigned long long)inode * 0x9e3779b97f4a7c15ULL) ^ ((unsigned long long)dev * 0xc2b2ae3d27d4eb4fULL);
+    return((size_t)(h ^ (h >> 29)));
+}
+
+static void growhashcache(void)
+{
+    struct hashcache *old;
+    size_t oldsize, i, o, mask;
+    
+    old = hashcache;
+    oldsize = hashcachesize;
+    hashcachesize = (oldsize == 0)?1024:(oldsize * 2);
+    mask = hashcachesize - 1;
+    hashcache = memset(smalloc(sizeof(*hashcache) * hashcachesize), 0, sizeof(*hashcache) * hashcachesize);
+    for(i = 0; i < oldsize; i++)
+    {
+	if(!old[i].used)
+	    continue;
+	for(o = hchash(old[i].dev, old[i].inode) & mask; hashcache[o].used; o = (o + 1) & mask);
+	hashcache[o] = old[i];
+    }
+    if(old != NULL)
+	free(old);
+}
+
+/*
+ * The returned entry is only valid until the hash cache is next
+ * modified. The caller must make sure that there is no entry for the
+ * same file already.
+ */
+static struct hashcache *newhashcache(dev_t dev, ino_t inode)
+{
+    size_t i, mask;
+    
+    if((hashcachedata + 1) * 2 > hashcachesize)
+	growhashcache();
+    mask = hashcachesize - 1;
+    for(i = hchash(dev, inode) & mask; hashcache[i].used; i = (i + 1) & mask);
+    memset(&hashcache[i], 0, sizeof(hashcache[i]));
+    hashcache[i].used = 1;
+    hashcache[i].dev = dev;
+    hashcache[i].inode = inode;
+    hashcachedata++;
+    return(&hashcache[i]);
 }
 
 static void freehashcache(struct hashcache *hc)
 {
-    if(hc->next != NULL)
-	hc->next->prev = hc->prev;
-    if(hc->prev != NULL)
-	hc->prev->next = hc->next;
-    if(hc == hashcache)
-	hashcache = hc->next;
-    free(hc);
+    size_t i, o, h, mask;
+    
+    mask = hashcachesize - 1;
+    i = hc - hashcache;
+    hashcache[i].used = 0;
+    hashcachedata--;
+    /* Move following entries back into the hole, unless that would
+     * put them before their home slot. */
+    for(o = (i + 1) & mask; hashcache[o].used; o = (o + 1) & mask)
+    {
+	h = hchash(hashcache[o].dev, hashcache[o].inode) & mask;
+	if(((o - h) & mask) >= ((o - i) & mask))
+	{
+	    hashcache[i] = hashcache[o];
+	    hashcache[o].used = 0;
+	    i = o;
+	}
+    }
 }
 
 static struct hashcache *findhashcache(dev_t dev, ino_t inode)
 {
-    struct hashcache *hc;
+    size_t i, mask;
     
-    for(hc = hashcache; hc != NULL; hc = hc->next)
+    if(hashcachesize == 0)
+	return(NULL);
+    mask = hashcachesize - 1;
+    for(i = hchash(dev, inode) & mask; hashcache[i].used; i = (i + 1) & mask)
     {
-	if((hc->dev == dev) && (hc->inode == inode))
-	    return(hc);
+	if((hashcache[i].dev == dev) && (hashcache[i].inode == inode))
+	    return(&hashcache[i]);
     }
     return(NULL);
 }
 
-static void readhashcache(void)
+static void clearhashcache(void)
 {
-    int i, wc, line;
-    char *hcname;
-    FILE *stream;
+    if(hashcache != NULL)
+	free(hashcache);
+    hashcache = NULL;
+    hashcachesize = hashcachedata = 0;
+}
+
+static struct hashcache *sethashcache(dev_t dev, ino_t inode, time_t mtime, char *tth)
+{
+    struct hashcache *hc;
+    
+    if((hc = findhashcache(dev, inode)) == NULL)
+	hc = newhashcache(dev, inode);
+    hc->mtime = mtime;
+    memcpy(hc->tth, tth, 24);
+    hc->tthloff = 0;
+    hc->tthlcount = 0;
+    return(hc);
+}
+
+static struct hashcache *recsethashcache(struct hcfilerec *rec)
+{
+    struct hashcache *hc;
+    
+    hc = sethashcache(rec->dev, rec->inode, rec->mtime, rec->tth);
+    hc->tthloff = rec->tthloff;
+    hc->tthlcount = rec->tthlcount;
+    return(hc);
+}
+
+static void hashcacherec(struct hashcache *hc, struct hcfilerec *rec)
+{
+    memset(rec, 0, sizeof(*rec));
+    rec->dev = hc->dev;
+    rec->inode = hc->inode;
+    rec->mtime = hc->mtime;
+    memcpy(rec->tth, hc->tth, 24);
+    rec->tthloff = hc->tthloff;
+    rec->tthlcount = hc->tthlcount;
+}
+
+/* Imports a hash cache in the old text format. */
+static void readtexthashcache(FILE *stream)
+{
+    int i, wc;
     char linebuf[256];
     char *p, *p2, *wv[32], *hash;
-    struct hashcache *hc;
     size_t len;
     
-    if((hcname = findfile(icswcstombs(confgetstr("cli", "hashcache"), NULL, NULL), NULL, 0)) == NULL)
-	return;
-    if((stream = fopen(hcname, "r")) == NULL)
-    {
-	flog(LOG_WARNING, "could not open hash cache %s: %s", hcname, strerror(errno));
-	free(hcname);
-	return;
-    }
-    free(hcname);
-    while(hashcache != NULL)
-	freehashcache(hashcache);
-    line = 0;
-    while(!feof(stream))
+    while(fgets(linebuf, sizeof(linebuf), stream) != NULL)
     {
-	fgets(linebuf, sizeof(linebuf), stream);
-	line++;
 	for(p = linebuf; *p; p++)
 	{
 	    if(*p == '\n')
@@ -321,10 +721,6 @@ static void readhashcache(void)
 	}
 	if(wc < 3)
 	    continue;
-	hc = newhashcache();
-	hc->dev = strtoll(wv[0], NULL, 10);
-	hc->inode = strtoll(wv[1], NULL, 10);
-	hc->mtime = strtoll(wv[2], NULL, 10);
 	for(i = 3; i < wc; i++)
 	{
 	    if(!strcmp(wv[i], "tth"))
@@ -332,309 +728,2041 @@ static void readhashcache(void)
 		if(++i >= wc)
 		    continue;
 		hash = base64decode(wv[i], &len);
-		if(len != 24)
-		{
-		    free(hash);
-		    continue;
-		}
-		memcpy(hc->tth, hash, 24);
+		if(len == 24)
+		    sethashcache(strtoll(wv[0], NULL, 10), strtoll(wv[1], NULL, 10), strtoll(wv[2], NULL, 10), hash);
 		free(hash);
 	    }
 	}
     }
-    fclose(stream);
 }
 
-static void hashtimercb(int cancelled, void *uudata)
+static char *hcfilename(char *suffix)
 {
-    hashwritetimer = NULL;
-    if(!cancelled)
-	writehashcache(1);
+    char *hcname, *ret;
+    
+    hcname = findfile(icswcstombs(confgetstr("cli", "hashcache"), NULL, NULL), NULL, 1);
+    if(suffix == NULL)
+	return(hcname);
+    ret = sprintf2("%s%s", hcname, suffix);
+    free(hcname);
+    return(ret);
 }
 
-static void writehashcache(int now)
+static unsigned long long hcjsum(struct hcfilerec *rec)
 {
-    char *buf;
-    char *hcname;
-    FILE *stream;
-    struct hashcache *hc;
+    unsigned long long sum;
+    unsigned char *p;
+    int i;
     
-    if(!now)
-    {
-	if(hashwritetimer == NULL)
-	    hashwritetimer = timercallback(ntime() + confgetint("cli", "hashwritedelay"), (void (*)(int, void *))hashtimercb, NULL);
-	return;
-    }
-    if(hashwritetimer != NULL)
-	canceltimer(hashwritetimer);
-    hcname = findfile(icswcstombs(confgetstr("cli", "hashcache"), NULL, NULL), NULL, 1);
-    if((stream = fopen(hcname, "w")) == NULL)
-    {
-	flog(LOG_WARNING, "could not write hash cache %s: %s", hcname, strerror(errno));
-	free(hcname);
-	return;
-    }
-    free(hcname);
-    fprintf(stream, "# Dolda Connect hash cache file\n");
-    fprintf(stream, "# Generated automatically, do not edit\n");
-    fprintf(stream, "# Format: DEVICE INODE MTIME [HASH...]\n");
-    fprintf(stream, "# HASH := HASHTYPE HASHVAL\n");
-    fprintf(stream, "# HASHTYPE can currently only be `tth'\n");
-    for(hc = hashcache; hc != NULL; hc = hc->next)
-    {
-	buf = base64encode(hc->tth, 24);
-	fprintf(stream, "%lli %lli %li tth %s\n", (long long)hc->dev, (long long)hc->inode, hc->mtime, buf);
-	free(buf);
-    }
-    fclose(stream);
+    sum = 0xcbf29ce484222325ULL;
+    for(p = (unsigned char *)rec, i = 0; i < sizeof(*rec); i++)
+	sum = (sum ^ p[i]) * 0x100000001b3ULL;
+    return(sum);
 }
 
-static void hashread(struct socket *sk, void *uudata)
+/*
+ * Replays the records of a hash cache journal into the hash cache,
+ * and returns the number of records read. Replay stops at the first
+ * damaged record, which would be the result of a crash in the middle
+ * of a write, and the journal is truncated there so that new records
+ * can be appended after it. If import is nonzero, the records are
+ * also written to the current journal.
+ */
+static int replayjournal(char *name, int import)
 {
-    static char *hashbuf;
-    static size_t hashbufsize = 0, hashbufdata = 0;
-    char *buf, *p, *p2, *lp;
-    size_t bufsize;
-    char *wv[32];
-    int wc;
-    dev_t dev;
-    ino_t inode;
-    time_t mtime;
-    struct hashcache *hc;
+    FILE *stream;
+    struct hcfilehead head;
+    struct hcjournalrec rec;
+    struct stat sb;
+    int n;
     
-    if((buf = sockgetinbuf(sk, &bufsize)) == NULL)
-	return;
-    bufcat(hashbuf, buf, bufsize);
-    free(buf);
-    while((lp = memchr(hashbuf, '\n', hashbufdata)) != NULL)
+    if((stream = fopen(name, "r")) == NULL)
+    {
+	if(errno != ENOENT)
+	    flog(LOG_WARNING, "could not open hash cache journal %s: %s", name, strerror(errno));
+	return(0);
+    }
+    n = 0;
+    if((fread(&head, sizeof(head), 1, stream) != 1) || memcmp(head.magic, HCJMAGIC, 8) || (head.version != HCVERSION) || (head.recsize != sizeof(rec)))
     {
-	*(lp++) = 0;
-	wc = 0;
-	p = hashbuf;
-	while(1)
+	flog(LOG_WARNING, "hash cache journal %s is invalid, removing it", name);
+	unlink(name);
+    } else {
+	while(fread(&rec, sizeof(rec), 1, stream) == 1)
 	{
-	    while((p2 = strchr(p, ' ')) == p)
-		p++;
-	    wv[wc++] = p;
-	    if(p2 == NULL)
+	    if(rec.sum != hcjsum(&rec.r))
 	    {
+		flog(LOG_WARNING, "hash cache journal %s is damaged after %i records", name, n);
 		break;
-	    } else {
-		*p2 = 0;
-		p = p2 + 1;
 	    }
+	    if(import)
+		journalhash(recsethashcache(&rec.r));
+	    else
+		recsethashcache(&rec.r);
+	    n++;
 	}
-	if(wc != 4)
+	if(!fstat(fileno(stream), &sb) && (sb.st_size > sizeof(head) + n * sizeof(rec)))
 	{
-	    flog(LOG_ERR, "BUG: unexpected number of words (%i) arrived from hashing process", wc);
-	} else {
-	    dev = strtoll(wv[0], NULL, 10);
-	    inode = strtoll(wv[1], NULL, 10);
-	    mtime = strtol(wv[2], NULL, 10);
-	    if((hc = findhashcache(dev, inode)) == NULL)
-	    {
-		hc = newhashcache();
-		hc->dev = dev;
-		hc->inode = inode;
-	    }
-	    hc->mtime = mtime;
-	    buf = base64decode(wv[3], NULL);
-	    memcpy(hc->tth, buf, 24);
-	    free(buf);
-	    writehashcache(0);
+	    if(truncate(name, sizeof(head) + n * sizeof(rec)))
+		flog(LOG_WARNING, "could not truncate hash cache journal %s: %s", name, strerror(errno));
 	}
-	memmove(hashbuf, lp, hashbufdata -= (lp - hashbuf));
     }
+    fclose(stream);
+    return(n);
 }
 
-static void hashexit(pid_t pid, int status, struct socket *outsock)
+static int writeall(int fd, void *buf, size_t len, off_t off)
 {
-    if(pid != hashjob)
-	flog(LOG_ERR, "BUG: hashing process changed PID?! old: %i new %i", hashjob, pid);
-    if(status)
-	flog(LOG_WARNING, "hashing process exited with non-zero status: %i", status);
-    hashjob = 0;
-    checkhashes();
-    putsock(outsock);
+    ssize_t ret;
+    
+    while(len > 0)
+    {
+	if((ret = pwrite(fd, buf, len, off)) < 0)
+	    return(-1);
+	buf = ((char *)buf) + ret;
+	len -= ret;
+	off += ret;
+    }
+    return(0);
 }
 
-static int hashfile(char *path)
+static int opentthl(void)
 {
-    int i, ret;
+    char *name;
     int fd;
-    int pfd[2];
-    char buf[4096];
     struct stat sb;
-    struct tigertreehash tth;
-    char digest[24];
-    struct socket *outsock;
+    struct hcfilehead head;
     
-    if((fd = open(path, O_RDONLY)) < 0)
+    if(tthlfile != NULL)
+	return(0);
+    name = hcfilename(".tthl");
+    if((fd = open(name, O_RDWR | O_CREAT, 0644)) < 0)
     {
-	flog(LOG_WARNING, "could not open %s for hashing: %s", path, strerror(errno));
-	return(1);
+	flog(LOG_WARNING, "could not open TTHL file %s: %s", name, strerror(errno));
+	free(name);
+	return(-1);
     }
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
     if(fstat(fd, &sb) < 0)
+	sb.st_size = 0;
+    if((sb.st_size < sizeof(head)) || (pread(fd, &head, sizeof(head), 0) != sizeof(head)) || memcmp(head.magic, TTHLMAGIC, 8) || (head.version != HCVERSION))
     {
-	flog(LOG_WARNING, "could not stat %s while hashing: %s", path, strerror(errno));
-	close(fd);
-	return(1);
-    }
-    if(pipe(pfd) < 0)
-    {
-	flog(LOG_WARNING, "could not create pipe(!): %s", strerror(errno));
-	close(fd);
-	return(1);
-    }
-    hashjob = fork();
-    if(hashjob < 0)
-    {
-	flog(LOG_WARNING, "could not fork(!) hashing process: %s", strerror(errno));
-	close(fd);
-	close(pfd[0]);
-	close(pfd[1]);
-	return(1);
-    }
-    if(hashjob == 0)
-    {
-	nice(10);
-	signal(SIGHUP, SIG_DFL);
-	fd = dup2(fd, 4);
-	pfd[1] = dup2(pfd[1], 3);
-	dup2(fd, 0);
-	dup2(pfd[1], 1);
-	for(i = 3; i < FD_SETSIZE; i++)
-	    close(i);
-	initlog();
-	inittigertree(&tth);
-	while((ret = read(0, buf, 4096)) > 0)
-	    dotigertree(&tth, buf, ret);
-	if(ret < 0)
-	{
-	    flog(LOG_WARNING, "could not read from %s while hashing: %s", path, strerror(errno));
-	    exit(1);
-	}
-	synctigertree(&tth);
-	restigertree(&tth, digest);
-	ret = snprintf(buf, sizeof(buf), "%lli %lli %li %s\n", (long long)sb.st_dev, (long long)sb.st_ino, sb.st_mtime, base64encode(digest, 24));
-	write(1, buf, ret);
-	exit(0);
+	if(sb.st_size > 0)
+	    flog(LOG_WARNING, "TTHL file %s is invalid, truncating it", name);
+	memset(&head, 0, sizeof(head));
+	memcpy(head.magic, TTHLMAGIC, 8);
+	head.version = HCVERSION;
+	head.recsize = sizeof(struct tthlhead);
+	if(ftruncate(fd, 0) || writeall(fd, &head, sizeof(head), 0))
+	{
+	    flog(LOG_WARNING, "could not write TTHL file %s: %s", name, strerror(errno));
+	    close(fd);
+	    free(name);
+	    return(-1);
+	}
+	sb.st_size = sizeof(head);
     }
-    close(fd);
-    close(pfd[1]);
-    outsock = wrapsock(pfd[0]);
-    outsock->readcb = hashread;
-    childcallback(hashjob, (void (*)(pid_t, int, void *))hashexit, outsock);
+    tthlfile = newsockfile(fd);
+    tthlend = sb.st_size;
+    free(name);
     return(0);
 }
 
+static void closetthl(void)
+{
+    if(tthlfile != NULL)
+	putsockfile(tthlfile);
+    tthlfile = NULL;
+}
+
 /*
- * Call only when hashjob == 0
+ * Appends the leaves of a newly hashed file to the TTHL file, and
+ * remembers where they were put. They are synced along with the
+ * journal record that refers to them.
  */
-static void checkhashes(void)
+static void storetthl(struct hashcache *hc, struct hashjob *job)
 {
-    struct sharecache *node, *next;
-    struct hashcache *hc;
-    char *path;
+    struct tthlhead head;
     
-    node = shareroot->child;
-    for(node = shareroot->child; node != NULL; node = next)
+    if(opentthl())
+	return;
+    memset(&head, 0, sizeof(head));
+    memcpy(head.tth, job->tth, 24);
+    head.count = job->tthldata;
+    head.shift = job->tthlshift;
+    if(writeall(tthlfile->fd, &head, sizeof(head), tthlend) || writeall(tthlfile->fd, job->tthl, job->tthldata * 24, tthlend + sizeof(head)))
     {
-	next = nextscnode(node);
-	if(node->f.b.type != FILE_REG)
-	    continue;
-	if(!node->f.b.hastth)
-	{
-	    if(((hc = findhashcache(node->dev, node->inode)) != NULL) && (hc->mtime == node->mtime))
-	    {
-		memcpy(node->hashtth, hc->tth, 24);
-		node->f.b.hastth = 1;
-		GCBCHAINDOCB(sharechangecb, sharesize);
-	    } else {
-		path = getfspath(node);
-		if(hashfile(path))
-		{
-		    flog(LOG_WARNING, "could not hash %s, unsharing it", path);
-		    freecache(node);
-		    free(path);
-		    flog(LOG_INFO, "sharing %lli bytes", sharesize);
-		    continue;
-		}
-		free(path);
-		return;
-	    }
-	}
+	flog(LOG_WARNING, "could not write TTHL file: %s", strerror(errno));
+	return;
     }
+    hc->tthloff = tthlend;
+    hc->tthlcount = job->tthldata;
+    tthlend += sizeof(head) + job->tthldata * 24;
+    tthldirty = 1;
 }
 
-struct sharecache *nextscnode(struct sharecache *node)
+/*
+ * Returns the file that the TTH leaves of a shared file are stored
+ * in, or NULL if there are none, in which case the root hash is all
+ * that is known. The reference returned must be released with
+ * putsockfile().
+ */
+struct sockfile *gettthl(struct sharecache *node, off_t *off, size_t *len)
 {
-    if(node->child != NULL)
-	return(node->child);
-    while(node->next == NULL)
+    struct hashcache *hc;
+    struct tthlhead head;
+    
+    if(!node->f.b.hastth || (tthlfile == NULL))
+	return(NULL);
+    if(((hc = findhashcache(node->dev, node->inode)) == NULL) || (hc->tthloff == 0) || memcmp(hc->tth, node->hashtth, 24))
+	return(NULL);
+    /* The TTHL file may have been compacted without the cache being
+     * written, if the daemon crashed in between. */
+    if((pread(tthlfile->fd, &head, sizeof(head), hc->tthloff) != sizeof(head)) || memcmp(head.tth, hc->tth, 24) || (head.count != hc->tthlcount))
     {
-	node = node->parent;
-	if(node == shareroot)
-	    return(NULL);
+	hc->tthloff = 0;
+	hc->tthlcount = 0;
+	return(NULL);
     }
-    return(node->next);
+    *off = hc->tthloff + sizeof(head);
+    *len = head.count * 24;
+    getsockfile(tthlfile);
+    return(tthlfile);
 }
 
-static void freescan(struct scanstate *job)
-{
-    if(job->dd != NULL)
-	closedir(job->dd);
-    free(job);
-}
-
-/* No need for optimization; lookup isn't really that common */
-struct sharecache *findcache(struct sharecache *parent, wchar_t *name)
+/*
+ * Rewrites the TTHL file without the trees that are no longer
+ * referred to by the hash cache, if they make up most of it. Returns
+ * non-zero if it did, in which case the hash cache has to be written
+ * with the new offsets.
+ */
+static int compacttthl(void)
 {
-    struct sharecache *node;
+    char *name, *tmpname, *buf;
+    int fd;
+    size_t i, len;
+    off_t live, off, *newoff;
+    struct hcfilehead head;
     
-    for(node = parent->child; node != NULL; node = node->next)
+    if(opentthl())
+	return(0);
+    live = sizeof(head);
+    for(i = 0; i < hashcachesize; i++)
     {
-	if(!wcscmp(node->name, name))
-	    return(node);
+	if(hashcache[i].used && (hashcache[i].tthloff != 0))
+	    live += sizeof(struct tthlhead) + hashcache[i].tthlcount * 24;
     }
-    return(NULL);
+    if(tthlend - live < live + (1 << 20))
+	return(0);
+    name = hcfilename(".tthl");
+    tmpname = sprintf2("%s.new", name);
+    if((fd = open(tmpname, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0)
+    {
+	flog(LOG_WARNING, "could not create %s: %s", tmpname, strerror(errno));
+	free(tmpname);
+	free(name);
+	return(0);
+    }
+    flog(LOG_INFO, "compacting TTHL file %s", name);
+    buf = NULL;
+    newoff = smalloc(sizeof(*newoff) * hashcachesize);
+    memset(&head, 0, sizeof(head));
+    memcpy(head.magic, TTHLMAGIC, 8);
+    head.version = HCVERSION;
+    head.recsize = sizeof(struct tthlhead);
+    if(writeall(fd, &head, sizeof(head), 0))
+	goto err;
+    off = sizeof(head);
+    for(i = 0; i < hashcachesize; i++)
+    {
+	newoff[i] = 0;
+	if(!hashcache[i].used || (hashcache[i].tthloff == 0))
+	    continue;
+	len = sizeof(struct tthlhead) + hashcache[i].tthlcount * 24;
+	buf = srealloc(buf, len);
+	/* A tree that cannot be read is dropped, rather than failing
+	 * the compaction. */
+	if(pread(tthlfile->fd, buf, len, hashcache[i].tthloff) != len)
+	    continue;
+	if(writeall(fd, buf, len, off))
+	    goto err;
+	newoff[i] = off;
+	off += len;
+    }
+    if(fsync(fd) || rename(tmpname, name))
+	goto err;
+    for(i = 0; i < hashcachesize; i++)
+    {
+	if(hashcache[i].used && ((hashcache[i].tthloff = newoff[i]) == 0))
+	    hashcache[i].tthlcount = 0;
+    }
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    closetthl();
+    tthlfile = newsockfile(fd);
+    tthlend = off;
+    if(buf != NULL)
+	free(buf);
+    free(newoff);
+    free(tmpname);
+    free(name);
+    return(1);
+    
+ err:
+    flog(LOG_WARNING, "could not compact TTHL file %s: %s", name, strerror(errno));
+    close(fd);
+    unlink(tmpname);
+    if(buf != NULL)
+	free(buf);
+    free(newoff);
+    free(tmpname);
+    free(name);
+    return(0);
 }
 
-static void attachcache(struct sharecache *parent, struct sharecache *node)
+/*
+ * Takes in the files of hashes that tthsum -c leaves next to the hash
+ * cache, as <hashcache>.import.<pid>. Each one is removed only once
+ * its records are safely in the journal, and one that is still
+ * locked belongs to a tthsum that is still running, and is left for
+ * the next time.
+ */
+static int importhashes(void)
 {
-    node->parent = parent;
-    node->next = parent->child;
-    if(parent->child != NULL)
-	parent->child->prev = node;
-    parent->child = node;
-}
-
+    DIR *dd;
+    struct dirent *de;
+    char *hcname, *dir, *base, *name, *p;
+    size_t blen;
+    int fd, n, ret;
+    
+    hcname = hcfilename(NULL);
+    if((base = strrchr(hcname, '/')) == NULL)
+    {
+	dir = ".";
+	base = hcname;
+    } else {
+	*(base++) = 0;
+	dir = (*hcname == 0)?"/":hcname;
+    }
+    if((dd = opendir(dir)) == NULL)
+    {
+	free(hcname);
+	return(0);
+    }
+    blen = strlen(base);
+    n = 0;
+    while((de = readdir(dd)) != NULL)
+    {
+	if(strncmp(de->d_name, base, blen) || strncmp(de->d_name + blen, ".import.", 8))
+	    continue;
+	/* tthsum writes the header under a temporary name first. */
+	for(p = de->d_name + blen + 8; (*p >= '0') && (*p <= '9'); p++);
+	if((p == de->d_name + blen + 8) || (*p != 0))
+	    continue;
+	name = sprintf2("%s/%s", dir, de->d_name);
+	if((fd = open(name, O_RDONLY)) < 0)
+	{
+	    flog(LOG_WARNING, "could not open hash import file %s: %s", name, strerror(errno));
+	} else {
+	    if(!flock(fd, LOCK_EX | LOCK_NB))
+	    {
+		ret = replayjournal(name, 1);
+		flushjournal();
+		if((ret == 0) || (hcjournal >= 0))
+		    unlink(name);
+		n += ret;
+	    }
+	    close(fd);
+	}
+	free(name);
+    }
+    closedir(dd);
+    free(hcname);
+    return(n);
+}
+
+static void readhashcache(void)
+{
+    int fd;
+    char *hcname, *jname;
+    FILE *stream;
+    struct stat sb;
+    void *map;
+    struct hcfilehead *head;
+    struct hcfilerec *rec;
+    struct hashcache *hc;
+    unsigned long long i;
+    char *p;
+    int replayed, recsize;
+    
+    flushjournal();
+    clearhashcache();
+    hcname = hcfilename(NULL);
+    if((fd = open(hcname, O_RDONLY)) < 0)
+    {
+	if(errno != ENOENT)
+	    flog(LOG_WARNING, "could not open hash cache %s: %s", hcname, strerror(errno));
+    } else if(fstat(fd, &sb) < 0) {
+	flog(LOG_WARNING, "could not stat hash cache %s: %s", hcname, strerror(errno));
+	close(fd);
+    } else {
+	map = MAP_FAILED;
+	if(sb.st_size >= sizeof(*head))
+	    map = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if((map != MAP_FAILED) && !memcmp(((struct hcfilehead *)map)->magic, HCMAGIC, 8))
+	{
+	    head = map;
+	    recsize = (head->version == 1)?HCV1RECSIZE:sizeof(*rec);
+	    if((head->version < 1) || (head->version > HCVERSION) || (head->recsize != recsize) || (head->count > (sb.st_size - sizeof(*head)) / recsize))
+	    {
+		flog(LOG_WARNING, "hash cache %s is of an unsupported version or truncated, ignoring it", hcname);
+	    } else {
+		while(hashcachesize < head->count * 2)
+		    growhashcache();
+		p = (char *)(head + 1);
+		for(i = 0; i < head->count; i++, p += recsize)
+		{
+		    rec = (struct hcfilerec *)p;
+		    hc = sethashcache(rec->dev, rec->inode, rec->mtime, rec->tth);
+		    if(head->version >= 2)
+		    {
+			hc->tthloff = rec->tthloff;
+			hc->tthlcount = rec->tthlcount;
+		    }
+		}
+	    }
+	    munmap(map, sb.st_size);
+	    close(fd);
+	} else {
+	    if(map != MAP_FAILED)
+		munmap(map, sb.st_size);
+	    stream = fdopen(fd, "r");
+	    readtexthashcache(stream);
+	    fclose(stream);
+	    if(hashcachedata > 0)
+	    {
+		flog(LOG_NOTICE, "converting hash cache %s to the binary format", hcname);
+		writehashcache(0);
+	    }
+	}
+    }
+    free(hcname);
+    /* A journal that was rotated away by an unfinished compaction is
+     * older than the current one. */
+    jname = hcfilename(".journal.old");
+    replayed = replayjournal(jname, 0);
+    free(jname);
+    jname = hcfilename(".journal");
+    replayed += replayjournal(jname, 0);
+    free(jname);
+    replayed += importhashes();
+    closetthl();
+    if(compacttthl())
+	writehashcache(1);
+    else if(replayed > 0)
+	writehashcache(0);
+}
+
+static int openjournal(void)
+{
+    char *jname;
+    struct stat sb;
+    struct hcfilehead head;
+    
+    if(hcjournal >= 0)
+	return(0);
+    jname = hcfilename(".journal");
+    if((hcjournal = open(jname, O_WRONLY | O_CREAT | O_APPEND, 0644)) < 0)
+    {
+	flog(LOG_WARNING, "could not open hash cache journal %s: %s", jname, strerror(errno));
+	free(jname);
+	return(-1);
+    }
+    fcntl(hcjournal, F_SETFD, FD_CLOEXEC);
+    if(!fstat(hcjournal, &sb) && (sb.st_size == 0))
+    {
+	memset(&head, 0, sizeof(head));
+	memcpy(head.magic, HCJMAGIC, 8);
+	head.version = HCVERSION;
+	head.recsize = sizeof(struct hcjournalrec);
+	if(write(hcjournal, &head, sizeof(head)) != sizeof(head))
+	{
+	    flog(LOG_WARNING, "could not write hash cache journal %s: %s", jname, strerror(errno));
+	    close(hcjournal);
+	    hcjournal = -1;
+	    free(jname);
+	    return(-1);
+	}
+    }
+    free(jname);
+    return(0);
+}
+
+static void closejournal(void)
+{
+    if(hcjournal >= 0)
+	close(hcjournal);
+    hcjournal = -1;
+}
+
+static void flushjournal(void)
+{
+    ssize_t ret;
+    size_t off, len;
+    
+    if(hcjtimer != NULL)
+    {
+	canceltimer(hcjtimer);
+	hcjtimer = NULL;
+    }
+    if(hcjbufdata == 0)
+	return;
+    /* The trees must be on disk before the records referring to
+     * them. */
+    if(tthldirty && (tthlfile != NULL))
+	fdatasync(tthlfile->fd);
+    tthldirty = 0;
+    if(openjournal())
+    {
+	/* The hashes will still be saved by the next compaction. */
+	hcjbufdata = 0;
+	return;
+    }
+    len = hcjbufdata * sizeof(*hcjbuf);
+    for(off = 0; off < len; off += ret)
+    {
+	if((ret = write(hcjournal, ((char *)hcjbuf) + off, len - off)) < 0)
+	{
+	    flog(LOG_WARNING, "could not write hash cache journal: %s", strerror(errno));
+	    closejournal();
+	    break;
+	}
+    }
+    if(hcjournal >= 0)
+	fdatasync(hcjournal);
+    hcjbufdata = 0;
+}
+
+static void hcjtimercb(int cancelled, void *uudata)
+{
+    hcjtimer = NULL;
+    if(!cancelled)
+	flushjournal();
+}
+
+/*
+ * Records a new hash in the journal. Records are written in batches,
+ * so that a burst of small files does not cost one fdatasync() per
+ * file.
+ */
+static void journalhash(struct hashcache *hc)
+{
+    struct hcjournalrec rec;
+    
+    memset(&rec, 0, sizeof(rec));
+    hashcacherec(hc, &rec.r);
+    rec.sum = hcjsum(&rec.r);
+    addtobuf(hcjbuf, rec);
+    if(hcjbufdata >= HCJBATCH)
+	flushjournal();
+    else if(hcjtimer == NULL)
+	hcjtimer = timercallback(ntime() + 1, (void (*)(int, void *))hcjtimercb, NULL);
+}
+
+static int writehcfile(char *hcname)
+{
+    char *tmpname;
+    FILE *stream;
+    struct hcfilehead head;
+    struct hcfilerec rec;
+    size_t i;
+    int ret;
+    
+    tmpname = sprintf2("%s.new", hcname);
+    if((stream = fopen(tmpname, "w")) == NULL)
+    {
+	flog(LOG_WARNING, "could not write hash cache %s: %s", tmpname, strerror(errno));
+	free(tmpname);
+	return(-1);
+    }
+    memset(&head, 0, sizeof(head));
+    memcpy(head.magic, HCMAGIC, 8);
+    head.version = HCVERSION;
+    head.recsize = sizeof(rec);
+    head.count = hashcachedata;
+    fwrite(&head, sizeof(head), 1, stream);
+    for(i = 0; i < hashcachesize; i++)
+    {
+	if(!hashcache[i].used)
+	    continue;
+	hashcacherec(&hashcache[i], &rec);
+	fwrite(&rec, sizeof(rec), 1, stream);
+    }
+    ret = -1;
+    if((fflush(stream) == 0) && !ferror(stream) && !fsync(fileno(stream)) && !fclose(stream))
+    {
+	stream = NULL;
+	if(rename(tmpname, hcname))
+	    flog(LOG_WARNING, "could not rename %s to %s: %s", tmpname, hcname, strerror(errno));
+	else
+	    ret = 0;
+    } else {
+	flog(LOG_WARNING, "could not write hash cache %s: %s", tmpname, strerror(errno));
+    }
+    if(stream != NULL)
+	fclose(stream);
+    if(ret)
+	unlink(tmpname);
+    free(tmpname);
+    return(ret);
+}
+
+static void compactdone(pid_t pid, int status, void *uudata)
+{
+    char *oldname;
+    
+    hccompactor = 0;
+    if(status)
+    {
+	flog(LOG_WARNING, "hash cache compaction failed with status %i", status);
+	writehashcache(0);
+	return;
+    }
+    oldname = hcfilename(".journal.old");
+    unlink(oldname);
+    free(oldname);
+}
+
+static void hashtimercb(int cancelled, void *uudata)
+{
+    hashwritetimer = NULL;
+    if(!cancelled)
+	writehashcache(1);
+}
+
+/*
+ * Folds the journal into the hash cache file. If now is zero, that is
+ * only scheduled to happen after hashwritedelay seconds. The file is
+ * written by a child process, so that the main loop need not wait for
+ * it. The journal is moved aside first; new hashes go into a new
+ * journal, and the old one is removed once the new file is in place.
+ */
+static void writehashcache(int now)
+{
+    char *hcname, *jname, *oldname;
+    pid_t pid;
+    
+    if(!now)
+    {
+	if(hashwritetimer == NULL)
+	    hashwritetimer = timercallback(ntime() + confgetint("cli", "hashwritedelay"), (void (*)(int, void *))hashtimercb, NULL);
+	return;
+    }
+    if(hashwritetimer != NULL)
+	canceltimer(hashwritetimer);
+    if(hccompactor != 0)
+    {
+	writehashcache(0);
+	return;
+    }
+    flushjournal();
+    closejournal();
+    hcname = hcfilename(NULL);
+    jname = hcfilename(".journal");
+    oldname = hcfilename(".journal.old");
+    /* If an old journal is still around, a previous compaction has
+     * failed. The current journal is then kept as well, since the
+     * old one must not be overwritten until the records in it have
+     * been saved. */
+    if(access(oldname, F_OK) && rename(jname, oldname) && (errno != ENOENT))
+	flog(LOG_WARNING, "could not rename %s to %s: %s", jname, oldname, strerror(errno));
+    if((pid = fork()) < 0)
+    {
+	flog(LOG_WARNING, "could not fork(!) to compact the hash cache: %s", strerror(errno));
+	if(!writehcfile(hcname))
+	    unlink(oldname);
+    } else if(pid == 0) {
+	_exit(writehcfile(hcname)?1:0);
+    } else {
+	hccompactor = pid;
+	childcallback(pid, compactdone, NULL);
+    }
+    free(oldname);
+    free(jname);
+    free(hcname);
+}
+
+/*
+ * Saves the hashing state of a file. This is called from the hashing
+ * threads.
+ */
+static int saveckpt(struct hashjob *job, struct stat *sb, struct tigertreehash *tth, struct tigertreehash *seg, off_t off)
+{
+    char *tmpname;
+    int fd, ret;
+    struct ckpthead head;
+    
+    memset(&head, 0, sizeof(head));
+    memcpy(head.magic, CKPTMAGIC, 8);
+    head.version = HCVERSION;
+    head.treesize = sizeof(*tth);
+    head.dev = sb->st_dev;
+    head.inode = sb->st_ino;
+    head.mtime = sb->st_mtime;
+    head.size = sb->st_size;
+    head.off = off;
+    head.tthlshift = job->tthlshift;
+    head.ntthl = job->tthldata;
+    tmpname = sprintf2("%s.new", job->ckptpath);
+    if((fd = open(tmpname, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)
+    {
+	free(tmpname);
+	return(-1);
+    }
+    ret = -1;
+    if(!writeall(fd, &head, sizeof(head), 0) &&
+       !writeall(fd, tth, sizeof(*tth), sizeof(head)) &&
+       !writeall(fd, seg, sizeof(*seg), sizeof(head) + sizeof(*tth)) &&
+       !writeall(fd, job->tthl, job->tthldata * 24, sizeof(head) + sizeof(*tth) * 2) &&
+       !fdatasync(fd))
+	ret = 0;
+    close(fd);
+    if(!ret && rename(tmpname, job->ckptpath))
+	ret = -1;
+    if(ret)
+	unlink(tmpname);
+    free(tmpname);
+    return(ret);
+}
+
+/*
+ * Restores the hashing state of a file from its checkpoint, if there
+ * is one that matches the file as it is now. A checkpoint that does
+ * not match is removed.
+ */
+static int loadckpt(struct hashjob *job, int fd, struct stat *sb, struct tigertreehash *tth, struct tigertreehash *seg, off_t *off)
+{
+    int cfd;
+    struct ckpthead head;
+    
+    if((cfd = open(job->ckptpath, O_RDONLY)) < 0)
+	return(-1);
+    if((read(cfd, &head, sizeof(head)) != sizeof(head)) ||
+       memcmp(head.magic, CKPTMAGIC, 8) || (head.version != HCVERSION) || (head.treesize != sizeof(*tth)) ||
+       (head.dev != sb->st_dev) || (head.inode != sb->st_ino) || (head.mtime != sb->st_mtime) || (head.size != sb->st_size) ||
+       (head.tthlshift != job->tthlshift) || (head.off > sb->st_size) || (head.ntthl != (head.off >> head.tthlshift)))
+	goto stale;
+    sizebuf2(job->tthl, head.ntthl, 1);
+    if((read(cfd, tth, sizeof(*tth)) != sizeof(*tth)) ||
+       (read(cfd, seg, sizeof(*seg)) != sizeof(*seg)) ||
+       (read(cfd, job->tthl, head.ntthl * 24) != head.ntthl * 24) ||
+       (lseek(fd, head.off, SEEK_SET) != head.off))
+	goto stale;
+    close(cfd);
+    job->tthldata = head.ntthl;
+    *off = head.off;
+    return(0);
+    
+ stale:
+    close(cfd);
+    unlink(job->ckptpath);
+    inittigertree(tth);
+    inittigertree(seg);
+    return(-1);
+}
+
+/*
+ * Waits until the hashing threads may read more, after len bytes have
+ * been read. This is called from the hashing threads.
+ */
+static void throttlehash(size_t len)
+{
+    double now, slot;
+    struct timespec ts;
+    
+    pthread_mutex_lock(&hashlock);
+    if(hashlimit > 0)
+    {
+	now = ntime();
+	/* Do not let an idle period be made up for with a burst. */
+	if(hashnext < now - 0.1)
+	    hashnext = now - 0.1;
+	slot = hashnext;
+	hashnext += len / hashlimit;
+	while(!hashquit && (hashlimit > 0) && (slot > now))
+	{
+	    ts.tv_sec = (time_t)slot;
+	    ts.tv_nsec = (long)((slot - ts.tv_sec) * 1000000000.0);
+	    pthread_cond_timedwait(&hashthrcond, &hashlock, &ts);
+	    now = ntime();
+	}
+    }
+    pthread_mutex_unlock(&hashlock);
+}
+
+/*
+ * Finishes a TTHL leaf, that is the tree hash of one segment of a
+ * file, and adds it to the tree of the whole file.
+ */
+static void pushtthl(struct hashjob *job, struct tigertreehash *tth, struct tigertreehash *seg)
+{
+    synctigertree(seg);
+    sizebuf2(job->tthl, job->tthldata + 1, 1);
+    restigertree(seg, job->tthl[job->tthldata]);
+    pushtigertree(tth, job->tthl[job->tthldata++]);
+    inittigertree(seg);
+}
+
+static void *hashthread(void *uudata)
+{
+    struct hashjob *job;
+    char *buf, *p;
+    int fd, ret, wake, ckpted;
+    off_t off, segsize, segoff, lastckpt;
+    size_t n;
+    struct stat sb;
+    struct tigertreehash tth, seg;
+    
+#ifdef SYS_gettid
+    /* On Linux, this only lowers the priority of the calling
+     * thread. */
+    setpriority(PRIO_PROCESS, syscall(SYS_gettid), 10);
+#ifdef SYS_ioprio_set
+    /* Likewise, give the thread the lowest best-effort I/O priority
+     * (IOPRIO_WHO_PROCESS is 1, and IOPRIO_CLASS_BE is 2). */
+    syscall(SYS_ioprio_set, 1, syscall(SYS_gettid), (2 << 13) | 7);
+#endif
+#endif
+    buf = smalloc(HASHREADSIZE);
+    pthread_mutex_lock(&hashlock);
+    while(1)
+    {
+	while(!hashquit && (hashpending == NULL))
+	    pthread_cond_wait(&hashcond, &hashlock);
+	if(hashquit)
+	    break;
+	job = hashpending;
+	if((hashpending = job->next) == NULL)
+	    hashpendingl = NULL;
+	pthread_mutex_unlock(&hashlock);
+	job->err = 0;
+	if((fd = open(job->path, O_RDONLY)) < 0)
+	{
+	    job->err = errno;
+	} else if(fstat(fd, &sb) < 0) {
+	    job->err = errno;
+	    close(fd);
+	} else {
+#ifdef POSIX_FADV_SEQUENTIAL
+	    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+	    inittigertree(&tth);
+	    inittigertree(&seg);
+	    segsize = (off_t)1 << job->tthlshift;
+	    off = 0;
+	    ckpted = (job->ckptpath != NULL) && !loadckpt(job, fd, &sb, &tth, &seg, &off);
+	    segoff = off & (segsize - 1);
+	    lastckpt = off;
+	    ret = 0;
+	    while(!hashquit && ((ret = read(fd, buf, HASHREADSIZE)) > 0))
+	    {
+		for(p = buf; p < buf + ret; p += n)
+		{
+		    n = buf + ret - p;
+		    if(n > segsize - segoff)
+			n = segsize - segoff;
+		    dotigertree(&seg, p, n);
+		    if((segoff += n) == segsize)
+		    {
+			pushtthl(job, &tth, &seg);
+			segoff = 0;
+		    }
+		}
+#ifdef POSIX_FADV_DONTNEED
+		/* Hashing should not push more useful data out of the
+		 * page cache. */
+		posix_fadvise(fd, off, ret, POSIX_FADV_DONTNEED);
+#endif
+		off += ret;
+		throttlehash(ret);
+		if((job->ckptpath != NULL) && (off - lastckpt >= job->ckptint))
+		{
+		    if(!saveckpt(job, &sb, &tth, &seg, off))
+			ckpted = 1;
+		    lastckpt = off;
+		}
+	    }
+	    if(ret < 0)
+		job->err = errno;
+	    else if(hashquit)
+		job->err = EINTR;
+	    if(job->ckptpath != NULL)
+	    {
+		if(job->err == EINTR)
+		{
+		    if((off > lastckpt) && !saveckpt(job, &sb, &tth, &seg, off))
+			ckpted = 1;
+		} else if(ckpted) {
+		    unlink(job->ckptpath);
+		}
+	    }
+	    close(fd);
+	    if((segoff > 0) || (job->tthldata == 0))
+		pushtthl(job, &tth, &seg);
+	    synctigertree(&tth);
+	    restigertree(&tth, job->tth);
+	    job->dev = sb.st_dev;
+	    job->inode = sb.st_ino;
+	    job->mtime = sb.st_mtime;
+	    job->size = off;
+	}
+	pthread_mutex_lock(&hashlock);
+	wake = hashdone == NULL;
+	job->next = hashdone;
+	hashdone = job;
+	if(wake)
+	    write(hashpipe[1], "", 1);
+    }
+    pthread_mutex_unlock(&hashlock);
+    free(buf);
+    return(NULL);
+}
+
+static void freehashjob(struct hashjob *job)
+{
+    free(job->path);
+    if(job->tthl != NULL)
+	free(job->tthl);
+    if(job->ckptpath != NULL)
+	free(job->ckptpath);
+    free(job);
+}
+
+/*
+ * Returns the node that a hash job was queued for, or NULL if it has
+ * since been freed or changed.
+ */
+static struct sharecache *hashjobnode(struct hashjob *job)
+{
+    struct sharecache *node;
+    
+    if(job->node >= scnodeend)
+	return(NULL);
+    node = scnode(job->node);
+    if((node == NULL) || (node->name == 0) || (node->f.b.type != FILE_REG))
+	return(NULL);
+    if((node->dev != job->ndev) || (node->inode != job->ninode) || (node->mtime != job->nmtime))
+	return(NULL);
+    return(node);
+}
+
+static void hashunshare(struct hashjob *job)
+{
+    struct sharecache *node;
+    
+    if((node = hashjobnode(job)) == NULL)
+	return;
+    flog(LOG_WARNING, "could not hash %s (%s), unsharing it", job->path, strerror(job->err));
+    freecache(node);
+    flog(LOG_INFO, "sharing %lli bytes", sharesize);
+}
+
+static void hashread(struct socket *sk, void *uudata)
+{
+    void *buf;
+    size_t bufsize;
+    struct hashjob *job, *next, **jp;
+    struct hashcache *hc;
+    struct sharecache *node;
+    double now;
+    
+    if((buf = sockgetinbuf(sk, &bufsize)) != NULL)
+	free(buf);
+    pthread_mutex_lock(&hashlock);
+    job = hashdone;
+    hashdone = NULL;
+    pthread_mutex_unlock(&hashlock);
+    for(; job != NULL; job = next)
+    {
+	next = job->next;
+	for(jp = &hashjobs; *jp != NULL; jp = &(*jp)->lnext)
+	{
+	    if(*jp == job)
+	    {
+		*jp = job->lnext;
+		break;
+	    }
+	}
+	numhashjobs--;
+	if(job->err == 0)
+	{
+	    hc = sethashcache(job->dev, job->inode, job->mtime, job->tth);
+	    if(job->tthldata > 1)
+		storetthl(hc, job);
+	    journalhash(hc);
+	    writehashcache(0);
+	    hashwinbytes += job->size;
+	    if(((node = hashjobnode(job)) != NULL) && (node->mtime == job->mtime))
+	    {
+		setnodetth(node, job->tth);
+		GCBCHAINDOCB(sharechangecb, sharesize);
+	    }
+	} else if(job->err != EINTR) {
+	    hashunshare(job);
+	}
+	freehashjob(job);
+    }
+    now = ntime();
+    if(now - hashwinstart >= HASHRATEWIN)
+    {
+	hashrate = hashwinbytes / (now - hashwinstart);
+	hashwinstart = now;
+	hashwinbytes = 0;
+    }
+    /* Refill the queue only once it has been half drained, since
+     * checkhashes() has to walk the share tree. */
+    if(numhashjobs <= numhashers)
+	checkhashes();
+}
+
+static char *ckptpath(dev_t dev, ino_t inode)
+{
+    char *dir, *ret;
+    
+    dir = hcfilename(".ckpt");
+    if(mkdir(dir, 0755) && (errno != EEXIST))
+	flog(LOG_WARNING, "could not create %s: %s", dir, strerror(errno));
+    ret = sprintf2("%s/%llx.%llx", dir, (unsigned long long)dev, (unsigned long long)inode);
+    free(dir);
+    return(ret);
+}
+
+/*
+ * Removes all hashing checkpoints. This is done once every shared
+ * file has been hashed, since they can only be stale then.
+ */
+static void clearckpts(void)
+{
+    char *dir, *path;
+    DIR *dd;
+    struct dirent *de;
+    
+    dir = hcfilename(".ckpt");
+    if((dd = opendir(dir)) != NULL)
+    {
+	while((de = readdir(dd)) != NULL)
+	{
+	    if(de->d_name[0] == '.')
+		continue;
+	    path = sprintf2("%s/%s", dir, de->d_name);
+	    unlink(path);
+	    free(path);
+	}
+	closedir(dd);
+	rmdir(dir);
+    }
+    free(dir);
+}
+
+/*
+ * Returns the base-2 logarithm of the TTHL leaf size to use for a
+ * file of the given size.
+ */
+static int tthlshift(off_t size)
+{
+    int shift, leafsize;
+    
+    /* A single leaf is never stored. */
+    if((leafsize = confgetint("cli", "tthlsize")) <= 0)
+	return(62);
+    for(shift = 10; ((off_t)2 << shift) <= leafsize; shift++);
+    while((size > 0) && (((size - 1) >> shift) >= TTHLMAXLEAVES))
+	shift++;
+    return(shift);
+}
+
+static void queuehash(struct sharecache *node)
+{
+    struct hashjob *job;
+    
+    job = memset(smalloc(sizeof(*job)), 0, sizeof(*job));
+    job->path = getfspath(node);
+    job->node = node->idx;
+    job->ndev = node->dev;
+    job->ninode = node->inode;
+    job->nmtime = node->mtime;
+    job->tthlshift = tthlshift(node->size);
+    job->ckptint = (off_t)confgetint("cli", "hashcheckpoint") << 20;
+    if((job->ckptint > 0) && (node->size > job->ckptint))
+    {
+	job->ckptpath = ckptpath(node->dev, node->inode);
+	ckptsdirty = 1;
+    }
+    job->lnext = hashjobs;
+    hashjobs = job;
+    if((numhashjobs++ == 0) && (ntime() - hashwinstart >= HASHRATEWIN))
+    {
+	hashwinstart = ntime();
+	hashwinbytes = 0;
+    }
+    pthread_mutex_lock(&hashlock);
+    if(hashpendingl == NULL)
+	hashpending = job;
+    else
+	hashpendingl->next = job;
+    hashpendingl = job;
+    pthread_cond_signal(&hashcond);
+    pthread_mutex_unlock(&hashlock);
+}
+
+static int hashqueued(struct sharecache *node)
+{
+    struct hashjob *job;
+    
+    for(job = hashjobs; job != NULL; job = job->lnext)
+    {
+	if((job->ndev == node->dev) && (job->ninode == node->inode))
+	    return(1);
+    }
+    return(0);
+}
+
+/*
+ * Sets the hashing rate limit according to how busy the daemon is
+ * with transfers.
+ */
+static void hashloadcb(int cancelled, void *uudata)
+{
+    struct transfer *transfer;
+    int busy, rate;
+    double now, limit;
+    unsigned long long bytes;
+    
+    hashloadtimer = NULL;
+    if(cancelled)
+	return;
+    now = ntime();
+    bytes = bytesupload + bytesdownload;
+    busy = (bytes - lastloadbytes) > (now - lastload) * HASHBUSYRATE;
+    for(transfer = transfers; !busy && (transfer != NULL); transfer = transfer->next)
+    {
+	if(transfer->state == TRNS_MAIN)
+	    busy = 1;
+    }
+    lastload = now;
+    lastloadbytes = bytes;
+    rate = confgetint("cli", busy?"hashbusyrate":"hashidlerate");
+    limit = (rate > 0)?((double)rate * 1048576):0;
+    pthread_mutex_lock(&hashlock);
+    if(limit != hashlimit)
+    {
+	hashlimit = limit;
+	hashnext = now;
+	pthread_cond_broadcast(&hashthrcond);
+    }
+    pthread_mutex_unlock(&hashlock);
+    hashloadtimer = timercallback(now + HASHLOADINT, (void (*)(int, void *))hashloadcb, NULL);
+}
+
+static void starthashers(void)
+{
+    int i, n;
+    pthread_attr_t attr;
+    
+    if((n = confgetint("cli", "hashthreads")) <= 0)
+    {
+	if((n = sysconf(_SC_NPROCESSORS_ONLN)) <= 0)
+	    n = 1;
+    }
+    if(pipe(hashpipe) < 0)
+    {
+	flog(LOG_CRIT, "could not create pipe(!): %s", strerror(errno));
+	exit(1);
+    }
+    fcntl(hashpipe[1], F_SETFL, fcntl(hashpipe[1], F_GETFL) | O_NONBLOCK);
+    hashsk = wrapsock(hashpipe[0]);
+    hashsk->readcb = hashread;
+    hashquit = 0;
+    hashers = smalloc(sizeof(*hashers) * n);
+    pthread_attr_init(&attr);
+    for(i = 0; i < n; i++)
+    {
+	if((errno = pthread_create(&hashers[i], &attr, hashthread, NULL)) != 0)
+	{
+	    flog(LOG_WARNING, "could not create hashing thread: %s", strerror(errno));
+	    break;
+	}
+    }
+    pthread_attr_destroy(&attr);
+    if((numhashers = i) == 0)
+    {
+	flog(LOG_CRIT, "could not start any hashing threads");
+	exit(1);
+    }
+    lastload = ntime();
+    lastloadbytes = bytesupload + bytesdownload;
+    hashloadcb(0, NULL);
+}
+
+static void stophashers(void)
+{
+    int i;
+    struct hashjob *job;
+    
+    if(numhashers == 0)
+	return;
+    pthread_mutex_lock(&hashlock);
+    hashquit = 1;
+    pthread_cond_broadcast(&hashcond);
+    pthread_cond_broadcast(&hashthrcond);
+    pthread_mutex_unlock(&hashlock);
+    if(hashloadtimer != NULL)
+	canceltimer(hashloadtimer);
+    for(i = 0; i < numhashers; i++)
+	pthread_join(hashers[i], NULL);
+    free(hashers);
+    numhashers = 0;
+    while((job = hashjobs) != NULL)
+    {
+	hashjobs = job->lnext;
+	freehashjob(job);
+    }
+    hashpending = hashpendingl = hashdone = NULL;
+    numhashjobs = 0;
+    close(hashpipe[1]);
+    closesock(hashsk);
+    putsock(hashsk);
+    hashsk = NULL;
+}
+
+static size_t tthhash(char *tth)
+{
+    size_t h;
+    
+    /* The TTH is as good a hash as any. */
+    memcpy(&h, tth, sizeof(h));
+    return(h);
+}
+
+static void growtthindex(void)
+{
+    unsigned int *old, next;
+    struct sharecache *node;
+    size_t i, oldsize;
+    
+    old = tthindex;
+    oldsize = tthindexsize;
+    tthindexsize = (oldsize == 0)?1024:(oldsize * 2);
+    tthindex = memset(smalloc(sizeof(*tthindex) * tthindexsize), 0, sizeof(*tthindex) * tthindexsize);
+    for(i = 0; i < oldsize; i++)
+    {
+	for(node = scnode(old[i]); node != NULL; node = scnode(next))
+	{
+	    next = node->tthnext;
+	    node->tthnext = tthindex[tthhash(node->hashtth) & (tthindexsize - 1)];
+	    tthindex[tthhash(node->hashtth) & (tthindexsize - 1)] = node->idx;
+	}
+    }
+    if(old != NULL)
+	free(old);
+}
+
+static void unindextth(struct sharecache *node)
+{
+    unsigned int *np;
+    
+    if(!node->f.b.hastth)
+	return;
+    for(np = &tthindex[tthhash(node->hashtth) & (tthindexsize - 1)]; *np != 0; np = &scnode(*np)->tthnext)
+    {
+	if(*np == node->idx)
+	{
+	    *np = node->tthnext;
+	    tthindexdata--;
+	    break;
+	}
+    }
+    node->tthnext = 0;
+    node->f.b.hastth = 0;
+}
+
+/*
+ * Sets the TTH of a shared file, keeping it in the TTH index.
+ */
+static void setnodetth(struct sharecache *node, char *tth)
+{
+    unsigned int *bucket;
+    
+    unindextth(node);
+    memcpy(node->hashtth, tth, 24);
+    node->f.b.hastth = 1;
+    if(tthindexdata >= tthindexsize)
+	growtthindex();
+    bucket = &tthindex[tthhash(tth) & (tthindexsize - 1)];
+    node->tthnext = *bucket;
+    *bucket = node->idx;
+    tthindexdata++;
+    scdirty = 1;
+}
+
+/*
+ * Returns the first shared file with the given TTH, or NULL if there
+ * is none. Any others are found with nexttth().
+ */
+struct sharecache *findtth(char *tth)
+{
+    struct sharecache *node;
+    
+    if(tthindexsize == 0)
+	return(NULL);
+    for(node = scnode(tthindex[tthhash(tth) & (tthindexsize - 1)]); node != NULL; node = scnode(node->tthnext))
+    {
+	if(!memcmp(node->hashtth, tth, 24))
+	    return(node);
+    }
+    return(NULL);
+}
+
+struct sharecache *nexttth(struct sharecache *node)
+{
+    struct sharecache *n;
+    
+    for(n = scnode(node->tthnext); n != NULL; n = scnode(n->tthnext))
+    {
+	if(!memcmp(n->hashtth, node->hashtth, 24))
+	    return(n);
+    }
+    return(NULL);
+}
+
+/*
+ * Queues files that need hashing until the queue is full. Each call
+ * continues where the last one left off, and a pass that did not
+ * start from the top wraps around to it once it reaches the end, so
+ * that nodes added behind it are seen as well.
+ */
+static void checkhashes(void)
+{
+    struct sharecache *node, *next;
+    struct hashcache *hc;
+    int wrapped;
+    
+    if((node = scnode(hashcursor)) == NULL)
+	node = scchild(shareroot);
+    wrapped = (hashcursor == 0);
+    for(; numhashjobs < numhashers * 2; node = next)
+    {
+	if(node == NULL)
+	{
+	    if(wrapped)
+		break;
+	    wrapped = 1;
+	    next = scchild(shareroot);
+	    continue;
+	}
+	next = nextscnode(node);
+	if(node->f.b.type != FILE_REG)
+	    continue;
+	if(!node->f.b.hastth)
+	{
+	    if(((hc = findhashcache(node->dev, node->inode)) != NULL) && (hc->mtime == node->mtime))
+	    {
+		setnodetth(node, hc->tth);
+		GCBCHAINDOCB(sharechangecb, sharesize);
+	    } else if(!hashqueued(node)) {
+		queuehash(node);
+	    }
+	}
+    }
+    hashcursor = (node == NULL)?0:node->idx;
+    if(ckptsdirty && (node == NULL) && (numhashjobs == 0) && (scanjob == NULL) && (scanqueue == NULL) && (numdirscans == 0))
+    {
+	clearckpts();
+	ckptsdirty = 0;
+    }
+}
+
+double gethashrate(void)
+{
+    if((numhashjobs == 0) && (ntime() - hashwinstart >= HASHRATEWIN * 2))
+	return(0);
+    return(hashrate);
+}
+
+struct sharecache *nextscnode(struct sharecache *node)
+{
+    if(node->child != 0)
+	return(scchild(node));
+    while(node->next == 0)
+    {
+	node = scparent(node);
+	if(node == shareroot)
+	    return(NULL);
+    }
+    return(scnext(node));
+}
+
+static void freescan(struct scanstate *job)
+{
+    if(job->dd != NULL)
+	closedir(job->dd);
+    free(job);
+}
+
+#define namestr(o) (scnames[(o) >> SCNAMEBITS] + ((o) & ((1 << SCNAMEBITS) - 1)))
+#define namerefs(o) (((unsigned int *)namestr(o)) - 1)
+#define namenodes(o) (((unsigned int *)namestr(o)) - 2)
+#define namesize(len) ((2 * sizeof(unsigned int)) + (((len) + sizeof(unsigned int)) & ~(sizeof(unsigned int) - 1)))
+
+static unsigned int strhash(char *s)
+{
+    unsigned int h;
+    
+    for(h = 2166136261U; *s != 0; s++)
+	h = (h ^ (unsigned char)*s) * 16777619U;
+    return(h);
+}
+
+static void grownametab(void)
+{
+    unsigned int *old;
+    size_t oldsize, i, o, mask;
+    
+    old = nametab;
+    oldsize = nametabsize;
+    nametabsize = (oldsize == 0)?1024:(oldsize * 2);
+    mask = nametabsize - 1;
+    nametab = memset(smalloc(sizeof(*nametab) * nametabsize), 0, sizeof(*nametab) * nametabsize);
+    for(i = 0; i < oldsize; i++)
+    {
+	if(old[i] == 0)
+	    continue;
+	for(o = strhash(namestr(old[i])) & mask; nametab[o] != 0; o = (o + 1) & mask);
+	nametab[o] = old[i];
+    }
+    if(old != NULL)
+	free(old);
+}
+
+static unsigned int findname(char *name)
+{
+    size_t i, mask;
+    
+    if(nametabsize == 0)
+	return(0);
+    mask = nametabsize - 1;
+    for(i = strhash(name) & mask; nametab[i] != 0; i = (i + 1) & mask)
+    {
+	if(!strcmp(namestr(nametab[i]), name))
+	    return(nametab[i]);
+    }
+    return(0);
+}
+
+/* Allocates room for a name of the given length in the name arena. */
+static unsigned int allocname(size_t len)
+{
+    unsigned int ret;
+    
+    if((numnamechunks == 0) || (namechunkend + namesize(len) > (1 << SCNAMEBITS)))
+    {
+	scnames = srealloc(scnames, sizeof(*scnames) * (numnamechunks + 1));
+	scnames[numnamechunks++] = smalloc(1 << SCNAMEBITS);
+	namechunkend = 0;
+    }
+    ret = ((numnamechunks - 1) << SCNAMEBITS) + namechunkend + (2 * sizeof(unsigned int));
+    namechunkend += namesize(len);
+    return(ret);
+}
+
+static size_t trigramhash(unsigned long long key)
+{
+    return((size_t)((key * 0x9e3779b97f4a7c15ULL) >> 32));
+}
+
+static unsigned long long trigramkey(wchar_t *s)
+{
+    return(((unsigned long long)(s[0] & 0x1fffff) << 42) | ((unsigned long long)(s[1] & 0x1fffff) << 21) | (s[2] & 0x1fffff));
+}
+
+static void growtrigrams(void)
+{
+    struct trigram *old;
+    size_t oldsize, i, o, mask;
+    
+    old = trigrams;
+    oldsize = trigramssize;
+    trigramssize = (oldsize == 0)?4096:(oldsize * 2);
+    mask = trigramssize - 1;
+    trigrams = memset(smalloc(sizeof(*trigrams) * trigramssize), 0, sizeof(*trigrams) * trigramssize);
+    for(i = 0; i < oldsize; i++)
+    {
+	if(old[i].key == 0)
+	    continue;
+	for(o = trigramhash(old[i].key) & mask; trigrams[o].key != 0; o = (o + 1) & mask);
+	trigrams[o] = old[i];
+    }
+    trigrammem += (trigramssize - oldsize) * sizeof(*trigrams);
+    if(old != NULL)
+	free(old);
+}
+
+static struct trigram *findtrigram(unsigned long long key, int create)
+{
+    size_t i, mask;
+    
+    if(create && ((trigramsdata + 1) * 2 > trigramssize))
+	growtrigrams();
+    if(trigramssize == 0)
+	return(NULL);
+    mask = trigramssize - 1;
+    for(i = trigramhash(key) & mask; trigrams[i].key != 0; i = (i + 1) & mask)
+    {
+	if(trigrams[i].key == key)
+	    return(&trigrams[i]);
+    }
+    if(!create)
+	return(NULL);
+    trigrams[i].key = key;
+    trigramsdata++;
+    return(&trigrams[i]);
+}
+
+/* Names are only ever added with a higher reference than any before
+ * them, so the lists of the name index stay sorted. */
+static void indexname(unsigned int name)
+{
+    wchar_t *lname;
+    size_t i, len;
+    struct trigram *t;
+    
+    if((lname = utf8towcs(namestr(name))) == NULL)
+	return;
+    wcslower(lname);
+    len = wcslen(lname);
+    for(i = 0; i + 3 <= len; i++)
+    {
+	t = findtrigram(trigramkey(lname + i), 1);
+	if((t->namesdata > 0) && (t->names[t->namesdata - 1] == name))
+	    continue;
+	trigrammem -= t->namessize * sizeof(*t->names);
+	addtobuf(t->names, name);
+	trigrammem += t->namessize * sizeof(*t->names);
+    }
+    free(lname);
+}
+
+static int namecmp(const void *a, const void *b)
+{
+    unsigned int n1, n2;
+    
+    n1 = *(unsigned int *)a;
+    n2 = *(unsigned int *)b;
+    return((n1 < n2)?-1:((n1 > n2)?1:0));
+}
+
+static int tgsizecmp(const void *a, const void *b)
+{
+    size_t n1, n2;
+    
+    n1 = (*(struct trigram **)a)->namesdata;
+    n2 = (*(struct trigram **)b)->namesdata;
+    return((n1 < n2)?-1:((n1 > n2)?1:0));
+}
+
+/*
+ * Finds the names whose lower-cased forms contain the given
+ * lower-case string, by means of the name index. A sorted array of
+ * them is returned in *names, which the caller should free, and
+ * their number in *num. Returns -1 if the string is too short to be
+ * looked up that way.
+ */
+int findnames(wchar_t *str, unsigned int **names, size_t *num)
+{
+    struct trigram **tg;
+    size_t ntg, len, i, o, bufsize, bufdata;
+    unsigned int name, *buf;
+    wchar_t *lname;
+    int found;
+    
+    if((len = wcslen(str)) < 3)
+	return(-1);
+    *names = NULL;
+    *num = 0;
+    tg = smalloc(sizeof(*tg) * (len - 2));
+    for(i = ntg = 0; i + 3 <= len; i++)
+    {
+	if((tg[ntg++] = findtrigram(trigramkey(str + i), 0)) == NULL)
+	{
+	    free(tg);
+	    return(0);
+	}
+    }
+    qsort(tg, ntg, sizeof(*tg), tgsizecmp);
+    buf = NULL;
+    bufsize = bufdata = 0;
+    for(i = 0; i < tg[0]->namesdata; i++)
+    {
+	name = tg[0]->names[i];
+	if(*namerefs(name) == 0)
+	    continue;
+	for(o = 1, found = 1; found && (o < ntg); o++)
+	    found = bsearch(&name, tg[o]->names, tg[o]->namesdata, sizeof(name), namecmp) != NULL;
+	if(!found)
+	    continue;
+	/* Having all the trigrams of the string does not mean having
+	 * the string itself. */
+	if((lname = utf8towcs(namestr(name))) == NULL)
+	    continue;
+	if(wcsstr(wcslower(lname), str) != NULL)
+	    addtobuf(buf, name);
+	free(lname);
+    }
+    free(tg);
+    *names = buf;
+    *num = bufdata;
+    return(0);
+}
+
+/*
+ * Returns a reference to a name in the name arena, adding the name if
+ * it is not there already. Returns zero if the name is too long to be
+ * stored.
+ */
+static unsigned int internname(char *name)
+{
+    unsigned int ret;
+    size_t len, i, mask;
+    
+    if((ret = findname(name)) != 0)
+    {
+	(*namerefs(ret))++;
+	return(ret);
+    }
+    if(namesize(len = strlen(name)) > (1 << SCNAMEBITS))
+	return(0);
+    ret = allocname(len);
+    *namerefs(ret) = 1;
+    *namenodes(ret) = 0;
+    memcpy(namestr(ret), name, len + 1);
+    if((nametabdata + 1) * 2 > nametabsize)
+	grownametab();
+    mask = nametabsize - 1;
+    for(i = strhash(name) & mask; nametab[i] != 0; i = (i + 1) & mask);
+    nametab[i] = ret;
+    nametabdata++;
+    indexname(ret);
+    return(ret);
+}
+
+static void releasename(unsigned int name)
+{
+    size_t i, o, h, mask;
+    
+    if(--*namerefs(name) > 0)
+	return;
+    namegarbage += namesize(strlen(namestr(name)));
+    mask = nametabsize - 1;
+    for(i = strhash(namestr(name)) & mask; nametab[i] != name; i = (i + 1) & mask);
+    nametab[i] = 0;
+    nametabdata--;
+    for(o = (i + 1) & mask; nametab[o] != 0; o = (o + 1) & mask)
+    {
+	h = strhash(namestr(nametab[o])) & mask;
+	if(((o - h) & mask) >= ((o - i) & mask))
+	{
+	    nametab[i] = nametab[o];
+	    nametab[o] = 0;
+	    i = o;
+	}
+    }
+}
+
+wchar_t *scwname(struct sharecache *node)
+{
+    wchar_t *ret;
+    
+    /* All names were valid UTF-8 when they were stored. */
+    if((ret = utf8towcs(scname(node))) == NULL)
+    {
+	flog(LOG_CRIT, "could not decode share name %s: %s", scname(node), strerror(errno));
+	abort();
+    }
+    return(ret);
+}
+
+/* Interned names are compared by reference, so the reference is as
+ * good a key as any. */
+static unsigned int namehash(unsigned int name)
+{
+    name *= 0x9e3779b1U;
+    return(name ^ (name >> 16));
+}
+
+/*
+ * Returns the directory record of a node, giving it one first if it
+ * has none.
+ */
+static struct scdir *getscdir(struct sharecache *node)
+{
+    unsigned int idx;
+    
+    if(node->dir != 0)
+	return(scdir(node));
+    if(scdirfree != 0)
+    {
+	idx = scdirfree;
+	scdirfree = scdirs[idx].nchildren;
+    } else {
+	if(scdirsend >= scdirssize)
+	{
+	    scdirssize = (scdirssize == 0)?64:(scdirssize * 2);
+	    scdirs = srealloc(scdirs, sizeof(*scdirs) * scdirssize);
+	}
+	idx = scdirsend++;
+    }
+    memset(&scdirs[idx], 0, sizeof(*scdirs));
+    node->dir = idx;
+    return(&scdirs[idx]);
+}
+
+static void freescdir(struct sharecache *node)
+{
+    struct scdir *dir;
+    
+    if((dir = scdir(node)) == NULL)
+	return;
+    if(dir->cindex != NULL)
+    {
+	free(dir->cindex);
+	cindexmem -= sizeof(*dir->cindex) * dir->cindexsize;
+    }
+    if(dir->path != NULL)
+	free(dir->path);
+    memset(dir, 0, sizeof(*dir));
+    dir->nchildren = scdirfree;
+    scdirfree = node->dir;
+    node->dir = 0;
+}
+
+static void cindexadd(struct scdir *dir, struct sharecache *node)
+{
+    unsigned int *bucket;
+    
+    bucket = &dir->cindex[namehash(node->name) & (dir->cindexsize - 1)];
+    node->cinext = *bucket;
+    *bucket = node->idx;
+}
+
+/*
+ * (Re)builds the child index of a directory, with room for at least
+ * as many entries as it has children.
+ */
+static void buildcindex(struct sharecache *parent)
+{
+    struct sharecache *node;
+    struct scdir *dir;
+    
+    dir = getscdir(parent);
+    if(dir->cindex != NULL)
+    {
+	free(dir->cindex);
+	cindexmem -= sizeof(*dir->cindex) * dir->cindexsize;
+    }
+    for(dir->cindexsize = 64; dir->cindexsize < dir->nchildren; dir->cindexsize <<= 1);
+    dir->cindex = memset(smalloc(sizeof(*dir->cindex) * dir->cindexsize), 0, sizeof(*dir->cindex) * dir->cindexsize);
+    cindexmem += sizeof(*dir->cindex) * dir->cindexsize;
+    for(node = scchild(parent); node != NULL; node = scnext(node))
+	cindexadd(dir, node);
+}
+
+/*
+ * Moves the names still in use into a fresh arena once most of the
+ * old one is garbage. Since that changes all name references, it must
+ * only be done while nobody holds on to any.
+ */
+static void compactnames(void)
+{
+    char **old, *p;
+    unsigned int oldnum, name, i;
+    size_t o, j, k, len;
+    struct sharecache *node;
+    struct trigram *t;
+    
+    if((namegarbage < (1 << 20)) || (namegarbage * 2 < ((size_t)numnamechunks << SCNAMEBITS)))
+	return;
+    old = scnames;
+    oldnum = numnamechunks;
+    scnames = NULL;
+    numnamechunks = namechunkend = 0;
+    /* The positions in nametab depend only on the contents of the
+     * names, so it is updated in place. The old reference counts are
+     * overwritten with the new references, for the nodes to find. */
+    for(o = 0; o < nametabsize; o++)
+    {
+	if((name = nametab[o]) == 0)
+	    continue;
+	p = old[name >> SCNAMEBITS] + (name & ((1 << SCNAMEBITS) - 1));
+	len = strlen(p);
+	nametab[o] = allocname(len);
+	memcpy(namestr(nametab[o]), p, len + 1);
+	*namerefs(nametab[o]) = ((unsigned int *)p)[-1];
+	*namenodes(nametab[o]) = ((unsigned int *)p)[-2];
+	((unsigned int *)p)[-1] = nametab[o];
+    }
+    for(i = 1; i < scnodeend; i++)
+    {
+	node = scnode(i);
+	if(node->name == 0)
+	    continue;
+	p = old[node->name >> SCNAMEBITS] + (node->name & ((1 << SCNAMEBITS) - 1));
+	node->name = ((unsigned int *)p)[-1];
+    }
+    /* The names that are no longer used, and so are dropped from the
+     * name index, are those still with a zero reference count. */
+    for(o = 0; o < trigramssize; o++)
+    {
+	t = &trigrams[o];
+	for(j = k = 0; j < t->namesdata; j++)
+	{
+	    p = old[t->names[j] >> SCNAMEBITS] + (t->names[j] & ((1 << SCNAMEBITS) - 1));
+	    if(((unsigned int *)p)[-1] != 0)
+		t->names[k++] = ((unsigned int *)p)[-1];
+	}
+	t->namesdata = k;
+	qsort(t->names, k, sizeof(*t->names), namecmp);
+    }
+    for(i = 0; i < oldnum; i++)
+	free(old[i]);
+    free(old);
+    namegarbage = 0;
+    for(i = 1; i < scnodeend; i++)
+    {
+	node = scnode(i);
+	if((node->name != 0) && (node->dir != 0) && (scdir(node)->cindex != NULL))
+	    buildcindex(node);
+    }
+}
+
+static struct sharecache *findchild(struct sharecache *parent, unsigned int name)
+{
+    struct sharecache *node;
+    struct scdir *dir;
+    
+    if(((dir = scdir(parent)) != NULL) && (dir->cindex != NULL))
+    {
+	for(node = scnode(dir->cindex[namehash(name) & (dir->cindexsize - 1)]); node != NULL; node = scnode(node->cinext))
+	{
+	    if(node->name == name)
+		return(node);
+	}
+	return(NULL);
+    }
+    for(node = scchild(parent); node != NULL; node = scnext(node))
+    {
+	if(node->name == name)
+	    return(node);
+    }
+    return(NULL);
+}
+
+/* Like findcache(), but takes the name in UTF-8. */
+static struct sharecache *findcache8(struct sharecache *parent, char *name)
+{
+    unsigned int ref;
+    
+    if((ref = findname(name)) == 0)
+	return(NULL);
+    return(findchild(parent, ref));
+}
+
+struct sharecache *findcache(struct sharecache *parent, wchar_t *name)
+{
+    char *buf;
+    struct sharecache *ret;
+    
+    if((buf = wcstoutf8(name)) == NULL)
+	return(NULL);
+    ret = findcache8(parent, buf);
+    free(buf);
+    return(ret);
+}
+
+static void attachcache(struct sharecache *parent, struct sharecache *node)
+{
+    struct scdir *dir;
+    
+    scdirty = 1;
+    node->parent = parent->idx;
+    node->next = parent->child;
+    if(parent->child != 0)
+	scchild(parent)->prev = node->idx;
+    parent->child = node->idx;
+    dir = getscdir(parent);
+    dir->nchildren++;
+    if(dir->cindex != NULL)
+    {
+	if(dir->nchildren > dir->cindexsize)
+	    buildcindex(parent);
+	else
+	    cindexadd(dir, node);
+    } else if(dir->nchildren >= CINDEXMIN) {
+	buildcindex(parent);
+    }
+}
+
 static void detachcache(struct sharecache *node)
 {
-    if(node->next != NULL)
-	node->next->prev = node->prev;
-    if(node->prev != NULL)
-	node->prev->next = node->next;
-    if((node->parent != NULL) && (node->parent->child == node))
-	node->parent->child = node->next;
-    node->parent = NULL;
-    node->next = NULL;
-    node->prev = NULL;
+    struct sharecache *parent;
+    struct scdir *dir;
+    unsigned int *np;
+    
+    if((parent = scparent(node)) != NULL)
+    {
+	scdirty = 1;
+	dir = scdir(parent);
+	if(dir->cindex != NULL)
+	{
+	    for(np = &dir->cindex[namehash(node->name) & (dir->cindexsize - 1)]; *np != 0; np = &scnode(*np)->cinext)
+	    {
+		if(*np == node->idx)
+		{
+		    *np = node->cinext;
+		    break;
+		}
+	    }
+	}
+	dir->nchildren--;
+	if(parent->child == node->idx)
+	    parent->child = node->next;
+    }
+    node->cinext = 0;
+    if(node->next != 0)
+	scnext(node)->prev = node->prev;
+    if(node->prev != 0)
+	scprev(node)->next = node->next;
+    node->parent = 0;
+    node->next = 0;
+    node->prev = 0;
+}
+
+#ifdef HAVE_INOTIFY
+#define WATCHMASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_CLOSE_WRITE | IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR | IN_EXCL_UNLINK)
+
+static struct sharecache *findwatch(int wd)
+{
+    size_t i, mask;
+    
+    if(watchessize == 0)
+	return(NULL);
+    mask = watchessize - 1;
+    for(i = wd & mask; watches[i] != NULL; i = (i + 1) & mask)
+    {
+	if(scdir(watches[i])->wd == wd)
+	    return(watches[i]);
+    }
+    return(NULL);
+}
+
+static void growwatches(void)
+{
+    struct sharecache **old;
+    size_t oldsize, i, o, mask;
+    
+    old = watches;
+    oldsize = watchessize;
+    watchessize = (oldsize == 0)?256:(oldsize * 2);
+    mask = watchessize - 1;
+    watches = memset(smalloc(sizeof(*watches) * watchessize), 0, sizeof(*watches) * watchessize);
+    for(i = 0; i < oldsize; i++)
+    {
+	if(old[i] == NULL)
+	    continue;
+	for(o = scdir(old[i])->wd & mask; watches[o] != NULL; o = (o + 1) & mask);
+	watches[o] = old[i];
+    }
+    if(old != NULL)
+	free(old);
+}
+
+static void addwatch(struct sharecache *node, char *path)
+{
+    int wd;
+    size_t i, mask;
+    
+    if((watchfd < 0) || ((node->dir != 0) && (scdir(node)->wd != 0)))
+	return;
+    if((wd = inotify_add_watch(watchfd, path, WATCHMASK)) < 0)
+    {
+	if(errno != ENOSPC)
+	    flog(LOG_WARNING, "could not watch %s: %s", path, strerror(errno));
+	else if(!watchesfull)
+	    flog(LOG_WARNING, "ran out of inotify watches at %s; changes to unwatched directories will only be found by rescanning (see fs.inotify.max_user_watches)", path);
+	watchesfull = 1;
+	return;
+    }
+    /* The same directory may be reachable through more than one
+     * node, in which case only the first is kept up to date. */
+    if(findwatch(wd) != NULL)
+	return;
+    if((watchesdata + 1) * 2 > watchessize)
+	growwatches();
+    mask = watchessize - 1;
+    for(i = wd & mask; watches[i] != NULL; i = (i + 1) & mask);
+    watches[i] = node;
+    getscdir(node)->wd = wd;
+    watchesdata++;
+}
+
+/*
+ * Forgets the watch on a directory, also removing it from inotify if
+ * rm is non-zero.
+ */
+static void unwatch(struct sharecache *node, int rm)
+{
+    size_t i, o, h, mask;
+    struct scdir *dir;
+    
+    dir = scdir(node);
+    mask = watchessize - 1;
+    for(i = dir->wd & mask; watches[i] != node; i = (i + 1) & mask);
+    watches[i] = NULL;
+    watchesdata--;
+    for(o = (i + 1) & mask; watches[o] != NULL; o = (o + 1) & mask)
+    {
+	h = scdir(watches[o])->wd & mask;
+	if(((o - h) & mask) >= ((o - i) & mask))
+	{
+	    watches[i] = watches[o];
+	    watches[o] = NULL;
+	    i = o;
+	}
+    }
+    if(rm)
+	inotify_rm_watch(watchfd, dir->wd);
+    dir->wd = 0;
 }
+#endif
 
 static void freecache(struct sharecache *node)
 {
     struct sharecache *cur, *next;
     struct scanqueue *q, *nq, **fq;
+    struct dirscan *ds;
+    unsigned int idx;
     
     detachcache(node);
+    for(ds = dirscans; ds != NULL; ds = ds->lnext)
+    {
+	if(ds->node == node)
+	    ds->node = NULL;
+    }
     fq = &scanqueue;
     for(q = scanqueue; q != NULL; q = nq)
     {
 	nq = q->next;
 	if(q->state->node == node)
 	{
-	    flog(LOG_DEBUG, "freed node %ls cancelled queued scan", node->name);
+	    flog(LOG_DEBUG, "freed node %s cancelled queued scan", scname(node));
 	    freescan(q->state);
 	    *fq = q->next;
 	    free(q);
@@ -642,24 +2770,36 @@ static void freecache(struct sharecache *node)
 	}
 	fq = &q->next;
     }
-    if(node->child != NULL)
+    for(cur = scchild(node); cur != NULL; cur = next)
     {
-	for(cur = node->child; cur != NULL; cur = next)
-	{
-	    next = cur->next;
-	    freecache(cur);
-	}
+	next = scnext(cur);
+	freecache(cur);
     }
-    CBCHAINDOCB(node, share_delete, node);
-    CBCHAINFREE(node, share_delete);
+    unindextth(node);
+#ifdef HAVE_INOTIFY
+    if((node->dir != 0) && (scdir(node)->wd != 0))
+	unwatch(node, 1);
+#endif
+    freescdir(node);
     sharesize -= node->size;
     if(node->f.b.type == FILE_REG)
 	sharedfiles--;
-    if(node->path != NULL)
-	free(node->path);
-    if(node->name != NULL)
-	free(node->name);
-    free(node);
+    if(node->nameprev != 0)
+	scnode(node->nameprev)->namenext = node->namenext;
+    else
+	*namenodes(node->name) = node->namenext;
+    if(node->namenext != 0)
+	scnode(node->namenext)->nameprev = node->nameprev;
+    releasename(node->name);
+    if(node->idx == hashcursor)
+	hashcursor = 0;
+    /* Free nodes are those without a name. */
+    idx = node->idx;
+    memset(node, 0, sizeof(*node));
+    node->idx = idx;
+    node->next = scfree;
+    scfree = idx;
+    numscnodes--;
 }
 
 static void freesharepoint(struct sharepoint *share)
@@ -679,36 +2819,113 @@ static void freesharepoint(struct sharepoint *share)
     free(share);
 }
 
-static struct sharecache *newcache(void)
+/*
+ * Allocates a node with the given name, in UTF-8. Returns NULL if the
+ * name cannot be stored.
+ */
+static struct sharecache *newcache(char *name)
 {
     struct sharecache *new;
+    unsigned int idx, ref;
     
-    new = smalloc(sizeof(*new));
+    if((ref = internname(name)) == 0)
+    {
+	flog(LOG_WARNING, "file name %s is too long to share", name);
+	return(NULL);
+    }
+    if(scfree != 0)
+    {
+	idx = scfree;
+	scfree = scnode(idx)->next;
+    } else {
+	if((scnodeend >> SCCHUNKBITS) >= numscchunks)
+	{
+	    scchunks = srealloc(scchunks, sizeof(*scchunks) * (numscchunks + 1));
+	    scchunks[numscchunks++] = smalloc(sizeof(**scchunks) << SCCHUNKBITS);
+	}
+	idx = scnodeend++;
+    }
+    new = scnode(idx);
     memset(new, 0, sizeof(*new));
-    CBCHAININIT(new, share_delete);
+    new->idx = idx;
+    new->name = ref;
+    if((new->namenext = *namenodes(ref)) != 0)
+	scnode(new->namenext)->nameprev = idx;
+    *namenodes(ref) = idx;
+    numscnodes++;
     return(new);
 }
 
+/*
+ * Returns the first node with the given name, or NULL if there is
+ * none. Any others are found with nextnamed().
+ */
+struct sharecache *findnamed(unsigned int name)
+{
+    return(scnode(*namenodes(name)));
+}
+
+struct sharecache *nextnamed(struct sharecache *node)
+{
+    return(scnode(node->namenext));
+}
+
+void getsharestats(size_t *nodes, size_t *treemem, size_t *names, size_t *namemem, size_t *indexmem)
+{
+    *nodes = numscnodes;
+    *treemem = ((size_t)numscchunks << SCCHUNKBITS) * sizeof(**scchunks) + scdirssize * sizeof(*scdirs) + cindexmem + tthindexsize * sizeof(*tthindex);
+    *names = nametabdata;
+    *namemem = ((size_t)numnamechunks << SCNAMEBITS) + nametabsize * sizeof(*nametab);
+    *indexmem = trigrammem;
+}
+
+/* Converts a file name from the filesystem charset into UTF-8. */
+static char *utf8name(char *name)
+{
+    wchar_t *wcs;
+    char *ret;
+    
+    if((wcs = icmbstowcs(name, NULL)) == NULL)
+	return(NULL);
+    ret = wcstoutf8(wcs);
+    free(wcs);
+    return(ret);
+}
+
+/* Converts the name of a node into the filesystem charset. */
+static char *fsname(struct sharecache *node)
+{
+    wchar_t *wcs;
+    char *ret;
+    
+    if(!strcmp(nl_langinfo(CODESET), "UTF-8"))
+	return(sstrdup(scname(node)));
+    wcs = scwname(node);
+    ret = icwcstombs(wcs, NULL);
+    free(wcs);
+    return(ret);
+}
+
 char *getfspath(struct sharecache *node)
 {
-    char *buf, *mbsname;
+    char *buf, *mbsname, *path;
     size_t bufsize;
     
     buf = smalloc(bufsize = 64);
     *buf = 0;
     while(node != NULL)
     {
-	if(node->path != NULL)
+	if((node->dir != 0) && ((path = scdir(node)->path) != NULL))
 	{
-	    if(bufsize < strlen(node->path) + strlen(buf) + 1)
-		buf = srealloc(buf, strlen(node->path) + strlen(buf) + 1);
-	    memmove(buf + strlen(node->path), buf, strlen(buf) + 1);
-	    memcpy(buf, node->path, strlen(node->path));
+	    if(bufsize < strlen(path) + strlen(buf) + 1)
+		buf = srealloc(buf, strlen(path) + strlen(buf) + 1);
+	    memmove(buf + strlen(path), buf, strlen(buf) + 1);
+	    memcpy(buf, path, strlen(path));
 	    return(buf);
 	}
-	if((mbsname = icwcstombs(node->name, NULL)) == NULL)
+	if((mbsname = fsname(node)) == NULL)
 	{
-	    flog(LOG_WARNING, "could not map unicode share name (%ls) into filesystem charset: %s", node->name, strerror(errno));
+	    flog(LOG_WARNING, "could not map unicode share name (%s) into filesystem charset: %s", scname(node), strerror(errno));
 	    free(buf);
 	    return(NULL);
 	}
@@ -718,7 +2935,7 @@ char *getfspath(struct sharecache *node)
 	memcpy(buf + 1, mbsname, strlen(mbsname));
 	*buf = '/';
 	free(mbsname);
-	node = node->parent;
+	node = scparent(node);
     }
     buf = srealloc(buf, strlen(buf) + 1);
     return(buf);
@@ -729,19 +2946,21 @@ static int checknode(struct sharecache *node)
     char *path;
     struct stat sb;
     
-    if(node->parent == NULL)
+    if(node->parent == 0)
     {
 	return(1);
     } else {
-	if(!checknode(node->parent))
+	if(!checknode(scparent(node)))
 	    return(0);
 	path = getfspath(node);
 	if(stat(path, &sb) < 0)
 	{
 	    flog(LOG_INFO, "%s was found to be broken (%s); scheduling rescan of parent", path, strerror(errno));
-	    queuescan(node->parent);
+	    queuescan(scparent(node));
+	    free(path);
 	    return(0);
 	} else {
+	    free(path);
 	    return(1);
 	}
     }
@@ -791,40 +3010,455 @@ static void removestale(struct sharecache *node)
 {
     struct sharecache *cur, *next;
     
-    for(cur = node->child; cur != NULL; cur = next)
+    for(cur = scchild(node); cur != NULL; cur = next)
+    {
+	next = scnext(cur);
+	if(!cur->f.b.found)
+	    freecache(cur);
+    }
+}
+
+/* For internal use in doscan() */
+static void jobdone(void)
+{
+    struct scanstate *jbuf;
+    
+    jbuf = scanjob;
+    scanjob = jbuf->next;
+    freescan(jbuf);
+    if(scanjob != NULL)
+	fchdir(dirfd(scanjob->dd));
+}
+
+/*
+ * Returns the type that a file is shared as, or -1 if it is not to be
+ * shared.
+ */
+static int sharetype(struct stat *sb, int dmask, int fmask)
+{
+    if(S_ISDIR(sb->st_mode))
+    {
+	if(~sb->st_mode & dmask)
+	    return(-1);
+	return(FILE_DIR);
+    } else if(S_ISREG(sb->st_mode)) {
+	if(~sb->st_mode & fmask)
+	    return(-1);
+	return(FILE_REG);
+    } else {
+	flog(LOG_WARNING, "unhandled file type: 0%o", sb->st_mode);
+	return(-1);
+    }
+}
+
+/*
+ * Merges a scanned directory entry into the share tree, and returns
+ * its node, or NULL if it could not be added. n is the node of the
+ * same name already in the directory, if any. The entry's name is
+ * consumed.
+ */
+static struct sharecache *mergeentry(struct sharecache *dir, struct sharecache *n, struct scanent *ent)
+{
+    struct hashcache *hc;
+    
+    if(n != NULL)
+    {
+	if((n->f.b.type != ent->type) || (n->mtime != ent->mtime) || ((ent->type == FILE_REG) && (n->size != ent->size)))
+	{
+	    freecache(n);
+	    n = NULL;
+	}
+    }
+    if(n == NULL)
+    {
+	n = newcache(ent->name);
+	free(ent->name);
+	ent->name = NULL;
+	if(n == NULL)
+	    return(NULL);
+	if(ent->type == FILE_REG)
+	{
+	    sharesize += (n->size = ent->size);
+	    sharedfiles++;
+	} else {
+	    n->size = 0;
+	}
+	n->mtime = ent->mtime;
+	n->dev = ent->dev;
+	n->inode = ent->inode;
+	n->f.b.type = ent->type;
+	attachcache(dir, n);
+    } else {
+	free(ent->name);
+    }
+    ent->name = NULL;
+    n->f.b.found = 1;
+    if((n->f.b.type == FILE_REG) && !n->f.b.hastth)
+    {
+	if((hc = findhashcache(ent->dev, ent->inode)) != NULL)
+	{
+	    if(hc->mtime == n->mtime)
+		setnodetth(n, hc->tth);
+	    else
+		freehashcache(hc);
+	}
+    }
+    return(n);
+}
+
+/*
+ * Converts a file name into UTF-8 with the scanning thread's own
+ * iconv descriptor, rather than opening a new one for every name.
+ */
+static char *scanname(iconv_t cd, char *name)
+{
+    char *in, *out, *buf;
+    size_t inleft, outleft;
+    
+    inleft = strlen(name);
+    /* No character takes more than four bytes in UTF-8, and none
+     * takes less than one byte in any charset. */
+    outleft = inleft * 4;
+    buf = smalloc(outleft + 1);
+    in = name;
+    out = buf;
+    if(iconv(cd, &in, &inleft, &out, &outleft) == (size_t)-1)
+    {
+	iconv(cd, NULL, NULL, NULL, NULL);
+	free(buf);
+	return(NULL);
+    }
+    *out = 0;
+    return(srealloc(buf, out - buf + 1));
+}
+
+/* Run in the scanning threads. */
+static void readdirscan(struct dirscan *job, iconv_t cd)
+{
+    int fd, type;
+    DIR *dd;
+    struct dirent *de;
+    struct stat sb;
+    struct scanent *ent;
+    char *name;
+    
+    if((fd = open(job->path, O_RDONLY | O_DIRECTORY)) < 0)
+    {
+	job->err = errno;
+	return;
+    }
+    if((dd = fdopendir(fd)) == NULL)
+    {
+	job->err = errno;
+	close(fd);
+	return;
+    }
+    /* On Linux, readdir() fetches the entries with getdents64() in
+     * large blocks, and the names are then stat()ed relative to the
+     * directory, without ever changing into it. */
+    while((de = readdir(dd)) != NULL)
+    {
+	if(*de->d_name == '.')
+	    continue;
+	if(fstatat(fd, de->d_name, &sb, 0) < 0)
+	{
+	    flog(LOG_WARNING, "could not stat %s/%s: %s", job->path, de->d_name, strerror(errno));
+	    continue;
+	}
+	if((type = sharetype(&sb, job->dmask, job->fmask)) < 0)
+	    continue;
+	if((name = scanname(cd, de->d_name)) == NULL)
+	{
+	    flog(LOG_WARNING, "file name %s cannot be converted to UTF-8: %s", de->d_name, strerror(errno));
+	    continue;
+	}
+	sizebuf2(job->ents, job->entsdata + 1, 1);
+	ent = &job->ents[job->entsdata++];
+	ent->name = name;
+	ent->type = type;
+	ent->size = sb.st_size;
+	ent->mtime = sb.st_mtime;
+	ent->dev = sb.st_dev;
+	ent->inode = sb.st_ino;
+    }
+    closedir(dd);
+}
+
+static void *scanthread(void *uudata)
+{
+    struct dirscan *job;
+    iconv_t cd;
+    int wake;
+    
+    if((cd = iconv_open("UTF-8", nl_langinfo(CODESET))) == (iconv_t)-1)
+    {
+	flog(LOG_CRIT, "could not open iconv structure for %s: %s", nl_langinfo(CODESET), strerror(errno));
+	exit(1);
+    }
+    pthread_mutex_lock(&scanlock);
+    while(1)
+    {
+	while(!scanquit && (scanpending == NULL))
+	    pthread_cond_wait(&scancond, &scanlock);
+	if(scanquit)
+	    break;
+	job = scanpending;
+	if((scanpending = job->next) == NULL)
+	    scanpendingl = NULL;
+	pthread_mutex_unlock(&scanlock);
+	readdirscan(job, cd);
+	pthread_mutex_lock(&scanlock);
+	wake = scandone == NULL;
+	job->next = scandone;
+	scandone = job;
+	pthread_cond_signal(&scandonecond);
+	if(wake)
+	    write(scanpipe[1], "", 1);
+    }
+    pthread_mutex_unlock(&scanlock);
+    iconv_close(cd);
+    return(NULL);
+}
+
+static void freedirscan(struct dirscan *job)
+{
+    struct dirscan **jp;
+    size_t i;
+    
+    for(jp = &dirscans; *jp != NULL; jp = &(*jp)->lnext)
+    {
+	if(*jp == job)
+	{
+	    *jp = job->lnext;
+	    break;
+	}
+    }
+    numdirscans--;
+    for(i = 0; i < job->entsdata; i++)
+    {
+	if(job->ents[i].name != NULL)
+	    free(job->ents[i].name);
+    }
+    if(job->ents != NULL)
+	free(job->ents);
+    free(job->path);
+    free(job);
+}
+
+static void mergedirscan(struct dirscan *job)
+{
+    struct sharecache *dir, *n;
+    struct scanent *ent;
+    size_t i;
+    
+    if((dir = job->node) == NULL)
+	return;
+    if(job->err != 0)
+    {
+	flog(LOG_WARNING, "cannot open directory %s for scanning: %s, deleting from share", job->path, strerror(job->err));
+	freecache(dir);
+	return;
+    }
+    for(i = 0; i < job->entsdata; i++)
+    {
+	ent = &job->ents[i];
+	n = mergeentry(dir, findcache8(dir, ent->name), ent);
+	if((n != NULL) && (n->f.b.type == FILE_DIR))
+	    queuescan(n);
+    }
+    removestale(dir);
+}
+
+/*
+ * The threaded counterpart of doscan(), which merges up to quantum
+ * scanned directories and hands out the queued ones to the scanning
+ * threads.
+ */
+static int threadscan(int quantum)
+{
+    struct dirscan *job;
+    struct scanqueue *qbuf;
+    struct sharecache *node, *n;
+    int more;
+    
+    for(; quantum > 0; quantum--)
+    {
+	pthread_mutex_lock(&scanlock);
+	if((job = scandone) != NULL)
+	    scandone = job->next;
+	pthread_mutex_unlock(&scanlock);
+	if(job == NULL)
+	    break;
+	mergedirscan(job);
+	freedirscan(job);
+    }
+    /* Keep the number of directories in flight bounded, so that their
+     * results do not pile up faster than they are merged. */
+    while((scanqueue != NULL) && (numdirscans < numscanners * 4))
+    {
+	qbuf = scanqueue;
+	scanqueue = qbuf->next;
+	node = qbuf->state->node;
+	freescan(qbuf->state);
+	free(qbuf);
+	job = smalloc(sizeof(*job));
+	memset(job, 0, sizeof(*job));
+	if((job->path = getfspath(node)) == NULL)
+	{
+	    free(job);
+	    freecache(node);
+	    continue;
+	}
+#ifdef HAVE_INOTIFY
+	addwatch(node, job->path);
+#endif
+	/* Cleared here rather than when merging, so that entries
+	 * added in the meantime are not taken to be stale. */
+	for(n = scchild(node); n != NULL; n = scnext(n))
+	    n->f.b.found = 0;
+	job->node = node;
+	job->dmask = confgetint("cli", "scandirmask");
+	job->fmask = confgetint("cli", "scanfilemask");
+	job->lnext = dirscans;
+	dirscans = job;
+	numdirscans++;
+	pthread_mutex_lock(&scanlock);
+	if(scanpendingl == NULL)
+	    scanpending = job;
+	else
+	    scanpendingl->next = job;
+	scanpendingl = job;
+	pthread_cond_signal(&scancond);
+	pthread_mutex_unlock(&scanlock);
+    }
+    if((numdirscans == 0) && (scanqueue == NULL))
+    {
+	if(scanbusy)
+	{
+	    flog(LOG_INFO, "sharing %lli bytes", sharesize);
+	    scanbusy = 0;
+	    GCBCHAINDOCB(sharechangecb, sharesize);
+	    if(numhashers > 0)
+		checkhashes();
+	}
+	return(0);
+    }
+    scanbusy = 1;
+    pthread_mutex_lock(&scanlock);
+    more = scandone != NULL;
+    pthread_mutex_unlock(&scanlock);
+    return(more);
+}
+
+/*
+ * Waits for the scanning threads to finish a directory. Returns zero
+ * if there are none being scanned.
+ */
+static int waitscans(void)
+{
+    if(numdirscans == 0)
+	return(0);
+    pthread_mutex_lock(&scanlock);
+    while(scandone == NULL)
+	pthread_cond_wait(&scandonecond, &scanlock);
+    pthread_mutex_unlock(&scanlock);
+    return(1);
+}
+
+static void scanread(struct socket *sk, void *uudata)
+{
+    void *buf;
+    size_t bufsize;
+    
+    /* This only serves to wake up the main loop, which will call
+     * doscan(). */
+    if((buf = sockgetinbuf(sk, &bufsize)) != NULL)
+	free(buf);
+}
+
+static void startscanners(void)
+{
+    int i, n;
+    pthread_attr_t attr;
+    
+    if((n = confgetint("cli", "scanthreads")) < 0)
+	return;
+    if(n == 0)
     {
-	next = cur->next;
-	if(!cur->f.b.found)
-	    freecache(cur);
+	if((n = sysconf(_SC_NPROCESSORS_ONLN)) <= 1)
+	    return;
+	if(n > 8)
+	    n = 8;
+    }
+    if(pipe(scanpipe) < 0)
+    {
+	flog(LOG_CRIT, "could not create pipe(!): %s", strerror(errno));
+	exit(1);
+    }
+    fcntl(scanpipe[1], F_SETFL, fcntl(scanpipe[1], F_GETFL) | O_NONBLOCK);
+    scansk = wrapsock(scanpipe[0]);
+    scansk->readcb = scanread;
+    scanquit = 0;
+    scanners = smalloc(sizeof(*scanners) * n);
+    pthread_attr_init(&attr);
+    for(i = 0; i < n; i++)
+    {
+	if((errno = pthread_create(&scanners[i], &attr, scanthread, NULL)) != 0)
+	{
+	    flog(LOG_WARNING, "could not create scanning thread: %s", strerror(errno));
+	    break;
+	}
+    }
+    pthread_attr_destroy(&attr);
+    if((numscanners = i) == 0)
+    {
+	flog(LOG_WARNING, "could not start any scanning threads, scanning from the main loop instead");
+	free(scanners);
+	close(scanpipe[1]);
+	closesock(scansk);
+	putsock(scansk);
+	scansk = NULL;
     }
 }
 
-/* For internal use in doscan() */
-static void jobdone(void)
+static void stopscanners(void)
 {
-    struct scanstate *jbuf;
+    int i;
     
-    jbuf = scanjob;
-    scanjob = jbuf->next;
-    freescan(jbuf);
-    if(scanjob != NULL)
-	fchdir(dirfd(scanjob->dd));
+    if(numscanners == 0)
+	return;
+    pthread_mutex_lock(&scanlock);
+    scanquit = 1;
+    pthread_cond_broadcast(&scancond);
+    pthread_mutex_unlock(&scanlock);
+    for(i = 0; i < numscanners; i++)
+	pthread_join(scanners[i], NULL);
+    free(scanners);
+    numscanners = 0;
+    while(dirscans != NULL)
+	freedirscan(dirscans);
+    scanpending = scanpendingl = scandone = NULL;
+    close(scanpipe[1]);
+    closesock(scansk);
+    putsock(scansk);
+    scansk = NULL;
 }
 
 int doscan(int quantum)
 {
-    char *path;
-    wchar_t *wcs;
+    char *path, *name;
     int type;
     struct sharecache *n;
     struct scanstate *jbuf;
     struct scanqueue *qbuf;
     struct dirent *de;
     struct stat sb;
-    struct hashcache *hc;
+    struct scanent ent;
     int dmask, fmask;
-    static int busybefore = 0;
     
+    compactnames();
+    if(numscanners > 0)
+	return(threadscan(quantum));
     dmask = confgetint("cli", "scandirmask");
     fmask = confgetint("cli", "scanfilemask");
     if((scanjob != NULL) && (scanjob->dd != NULL))
@@ -840,28 +3474,28 @@ int doscan(int quantum)
     {
 	if(scanjob != NULL)
 	{
-	    busybefore = 1;
+	    scanbusy = 1;
 	} else {
 	    while(scanjob == NULL)
 	    {
 		if(scanqueue == NULL)
 		{
-		    if(busybefore)
+		    if(scanbusy)
 		    {
 			flog(LOG_INFO, "sharing %lli bytes", sharesize);
-			busybefore = 0;
+			scanbusy = 0;
 			GCBCHAINDOCB(sharechangecb, sharesize);
-			if(hashjob == 0)
+			if(numhashers > 0)
 			    checkhashes();
 		    }
 		    return(0);
 		}
-		busybefore = 1;
+		scanbusy = 1;
 		scanjob = scanqueue->state;
 		qbuf = scanqueue;
 		scanqueue = qbuf->next;
 		free(qbuf);
-		for(n = scanjob->node->child; n != NULL; n = n->next)
+		for(n = scchild(scanjob->node); n != NULL; n = scnext(n))
 		    n->f.b.found = 0;
 	    }
 	}
@@ -876,6 +3510,9 @@ int doscan(int quantum)
 		jobdone();
 		continue;
 	    }
+#ifdef HAVE_INOTIFY
+	    addwatch(scanjob->node, path);
+#endif
 	    free(path);
 	    if(fchdir(dirfd(scanjob->dd)) < 0)
 	    {
@@ -892,15 +3529,15 @@ int doscan(int quantum)
 	}
 	if(*de->d_name == '.')
 	    continue;
-	if((wcs = icmbstowcs(de->d_name, NULL)) == NULL)
+	if((name = utf8name(de->d_name)) == NULL)
 	{
-	    flog(LOG_WARNING, "file name %s has cannot be converted to wchar: %s", de->d_name, strerror(errno));
+	    flog(LOG_WARNING, "file name %s cannot be converted to UTF-8: %s", de->d_name, strerror(errno));
 	    continue;
 	}
-	n = findcache(scanjob->node, wcs);
+	n = findcache8(scanjob->node, name);
 	if(stat(de->d_name, &sb) < 0)
 	{
-	    free(wcs);
+	    free(name);
 	    if(n != NULL)
 	    {
 		flog(LOG_WARNING, "could not stat %s: %s, deleting from share", de->d_name, strerror(errno));
@@ -910,80 +3547,229 @@ int doscan(int quantum)
 	    }
 	    continue;
 	}
-	if(S_ISDIR(sb.st_mode))
+	if((type = sharetype(&sb, dmask, fmask)) < 0)
 	{
-	    if(~sb.st_mode & dmask)
-	    {
-		free(wcs);
-		continue;
-	    }
-	    type = FILE_DIR;
-	} else if(S_ISREG(sb.st_mode)) {
-	    if(~sb.st_mode & fmask)
-	    {
-		free(wcs);
-		continue;
-	    }
-	    type = FILE_REG;
-	} else {
-	    flog(LOG_WARNING, "unhandled file type: 0%o", sb.st_mode);
-	    free(wcs);
+	    free(name);
 	    continue;
 	}
-	if(n != NULL)
-	{
-	    if((n->f.b.type != type) || (n->mtime != sb.st_mtime) || ((type == FILE_REG) && (n->size != sb.st_size)))
-	    {
-		freecache(n);
-		n = NULL;
-	    }
-	}
-	if(n == NULL)
-	{
-	    n = newcache();
-	    n->name = wcs;
-	    if(S_ISREG(sb.st_mode))
-	    {
-		sharesize += (n->size = sb.st_size);
-		sharedfiles++;
-	    } else {
-		n->size = 0;
-	    }
-	    n->mtime = sb.st_mtime;
-	    n->dev = sb.st_dev;
-	    n->inode = sb.st_ino;
-	    n->f.b.type = type;
-	    attachcache(scanjob->node, n);
-	} else {
-	    free(wcs);
-	}
-	n->f.b.found = 1;
+	ent.name = name;
+	ent.type = type;
+	ent.size = sb.st_size;
+	ent.mtime = sb.st_mtime;
+	ent.dev = sb.st_dev;
+	ent.inode = sb.st_ino;
+	if((n = mergeentry(scanjob->node, n, &ent)) == NULL)
+	    continue;
 	if(n->f.b.type == FILE_DIR)
 	{
 	    jbuf = newscan(n);
 	    jbuf->next = scanjob;
 	    scanjob = jbuf;
-	} else if(n->f.b.type == FILE_REG) {
-	    if(n->f.b.hastth && (n->mtime != sb.st_mtime))
-		n->f.b.hastth = 0;
-	    if(!n->f.b.hastth)
-	    {
-		if((hc = findhashcache(sb.st_dev, sb.st_ino)) != NULL)
-		{
-		    if(hc->mtime == n->mtime)
-		    {
-			n->f.b.hastth = 1;
-			memcpy(n->hashtth, hc->tth, 24);
-		    } else {
-			freehashcache(hc);
-		    }
-		}
-	    }
 	}
     }
     return(1);
 }
 
+#ifdef HAVE_INOTIFY
+/* Whether the node or anything below it is being scanned, in which
+ * case it must not be freed. */
+static int scanning(struct sharecache *node)
+{
+    struct scanstate *st;
+    struct sharecache *n;
+    
+    for(st = scanjob; st != NULL; st = st->next)
+    {
+	for(n = st->node; n != NULL; n = scparent(n))
+	{
+	    if(n == node)
+		return(1);
+	}
+    }
+    return(0);
+}
+
+/*
+ * Brings the entry called name in the watched directory dir up to
+ * date. Returns non-zero if the share was changed.
+ */
+static int watchentry(struct sharecache *dir, char *name)
+{
+    char *path, *fpath, *uname;
+    int type;
+    struct sharecache *n;
+    struct stat sb;
+    struct hashcache *hc;
+    
+    if(*name == '.')
+	return(0);
+    if((uname = utf8name(name)) == NULL)
+    {
+	flog(LOG_WARNING, "file name %s cannot be converted to UTF-8: %s", name, strerror(errno));
+	return(0);
+    }
+    n = findcache8(dir, uname);
+    if((n != NULL) && scanning(n))
+    {
+	free(uname);
+	queuescan(dir);
+	return(0);
+    }
+    if((path = getfspath(dir)) == NULL)
+    {
+	free(uname);
+	return(0);
+    }
+    /* Keep the directory's own mtime current, lest the next rescan
+     * think it changed. */
+    if(!stat(path, &sb))
+	dir->mtime = sb.st_mtime;
+    fpath = sprintf2("%s/%s", path, name);
+    free(path);
+    if(stat(fpath, &sb) < 0)
+	type = -1;
+    else
+	type = sharetype(&sb, confgetint("cli", "scandirmask"), confgetint("cli", "scanfilemask"));
+    free(fpath);
+    if(n != NULL)
+    {
+	if((type < 0) || (n->f.b.type != type) || (n->dev != sb.st_dev) || (n->inode != sb.st_ino) ||
+	   ((type == FILE_REG) && ((n->mtime != sb.st_mtime) || (n->size != sb.st_size))))
+	{
+	    freecache(n);
+	    n = NULL;
+	} else {
+	    /* Changes within subdirectories are seen through their own
+	     * watches. */
+	    free(uname);
+	    n->mtime = sb.st_mtime;
+	    return(0);
+	}
+    }
+    if(type < 0)
+    {
+	free(uname);
+	return(1);
+    }
+    n = newcache(uname);
+    free(uname);
+    if(n == NULL)
+	return(1);
+    if(type == FILE_REG)
+    {
+	sharesize += (n->size = sb.st_size);
+	sharedfiles++;
+    }
+    n->mtime = sb.st_mtime;
+    n->dev = sb.st_dev;
+    n->inode = sb.st_ino;
+    n->f.b.type = type;
+    n->f.b.found = 1;
+    attachcache(dir, n);
+    if(type == FILE_DIR)
+    {
+	queuescan(n);
+    } else if((hc = findhashcache(sb.st_dev, sb.st_ino)) != NULL) {
+	if(hc->mtime == n->mtime)
+	    setnodetth(n, hc->tth);
+	else
+	    freehashcache(hc);
+    }
+    return(1);
+}
+
+static void watchread(struct socket *sk, void *uudata)
+{
+    char *buf;
+    size_t bufsize, off;
+    struct inotify_event *ev;
+    struct sharecache *node;
+    int changed;
+    
+    if((buf = sockgetinbuf(sk, &bufsize)) == NULL)
+	return;
+    changed = 0;
+    for(off = 0; off + sizeof(*ev) <= bufsize; off += sizeof(*ev) + ev->len)
+    {
+	ev = (struct inotify_event *)(buf + off);
+	if(ev->mask & IN_Q_OVERFLOW)
+	{
+	    flog(LOG_WARNING, "inotify queue overflowed, rescanning all shares");
+	    scanshares();
+	    continue;
+	}
+	if((node = findwatch(ev->wd)) == NULL)
+	    continue;
+	if(ev->mask & IN_IGNORED)
+	{
+	    unwatch(node, 0);
+	} else if(ev->len == 0) {
+	    /* Only the share roots have no watched parent to report
+	     * their moving or deletion. */
+	    if((ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) && (scparent(node) == shareroot))
+		queuescan(node);
+	} else {
+	    if(watchentry(node, ev->name))
+		changed = 1;
+	}
+    }
+    free(buf);
+    if(changed)
+    {
+	GCBCHAINDOCB(sharechangecb, sharesize);
+	if(numhashers > 0)
+	    checkhashes();
+    }
+}
+
+static void startwatching(void)
+{
+    if((watchfd >= 0) || !confgetint("cli", "watchshares"))
+	return;
+    if((watchfd = inotify_init1(IN_CLOEXEC)) < 0)
+    {
+	flog(LOG_WARNING, "could not initialize inotify, shares will not be watched: %s", strerror(errno));
+	return;
+    }
+    watchsk = wrapsock(watchfd);
+    watchsk->readcb = watchread;
+    watchesfull = 0;
+}
+
+static void stopwatching(void)
+{
+    size_t i;
+    
+    if(watchfd < 0)
+	return;
+    for(i = 0; i < watchessize; i++)
+    {
+	if(watches[i] != NULL)
+	    scdir(watches[i])->wd = 0;
+    }
+    if(watches != NULL)
+	free(watches);
+    watches = NULL;
+    watchessize = watchesdata = 0;
+    closesock(watchsk);
+    putsock(watchsk);
+    watchsk = NULL;
+    watchfd = -1;
+}
+
+static int watchupdate(struct configvar *var, void *uudata)
+{
+    if(var->val.num)
+    {
+	startwatching();
+	scanshares();
+    } else {
+	stopwatching();
+    }
+    return(0);
+}
+#endif
+
 static void rescancb(int cancelled, void *uudata)
 {
     scantimer = NULL;
@@ -996,12 +3782,308 @@ static void rescancb(int cancelled, void *uudata)
     }
 }
 
+static char *snapfilename(void)
+{
+    wchar_t *name;
+    
+    name = confgetstr("cli", "sharesnapshot");
+    if(!*name)
+	return(NULL);
+    return(findfile(icswcstombs(name, NULL, NULL), NULL, 1));
+}
+
+static int writesnapfile(char *name)
+{
+    char *tmpname;
+    FILE *stream;
+    struct hcfilehead head;
+    struct snaprec rec;
+    struct sharecache *node;
+    unsigned int depth;
+    int ret;
+    
+    tmpname = sprintf2("%s.%i", name, (int)getpid());
+    if((stream = fopen(tmpname, "w")) == NULL)
+    {
+	flog(LOG_WARNING, "could not write share snapshot %s: %s", tmpname, strerror(errno));
+	free(tmpname);
+	return(-1);
+    }
+    memset(&head, 0, sizeof(head));
+    memcpy(head.magic, SNAPMAGIC, 8);
+    head.version = SNAPVERSION;
+    head.recsize = sizeof(rec);
+    fwrite(&head, sizeof(head), 1, stream);
+    depth = 1;
+    node = scchild(shareroot);
+    while(node != NULL)
+    {
+	memset(&rec, 0, sizeof(rec));
+	rec.dev = node->dev;
+	rec.inode = node->inode;
+	rec.size = node->size;
+	rec.mtime = node->mtime;
+	if((rec.hastth = node->f.b.hastth) != 0)
+	    memcpy(rec.tth, node->hashtth, 24);
+	rec.type = node->f.b.type;
+	rec.depth = depth;
+	rec.namelen = strlen(scname(node));
+	if((depth == 1) && (node->dir != 0) && (scdir(node)->path != NULL))
+	    rec.pathlen = strlen(scdir(node)->path);
+	fwrite(&rec, sizeof(rec), 1, stream);
+	fwrite(scname(node), 1, rec.namelen, stream);
+	if(rec.pathlen > 0)
+	    fwrite(scdir(node)->path, 1, rec.pathlen, stream);
+	head.count++;
+	if(node->child != 0)
+	{
+	    node = scchild(node);
+	    depth++;
+	    continue;
+	}
+	while((node != shareroot) && (node->next == 0))
+	{
+	    node = scparent(node);
+	    depth--;
+	}
+	node = (node == shareroot)?NULL:scnext(node);
+    }
+    ret = -1;
+    if(!fseek(stream, 0, SEEK_SET) && (fwrite(&head, sizeof(head), 1, stream) == 1) &&
+       (fflush(stream) == 0) && !ferror(stream) && !fsync(fileno(stream)) && !fclose(stream))
+    {
+	stream = NULL;
+	if(rename(tmpname, name))
+	    flog(LOG_WARNING, "could not rename %s to %s: %s", tmpname, name, strerror(errno));
+	else
+	    ret = 0;
+    } else {
+	flog(LOG_WARNING, "could not write share snapshot %s: %s", tmpname, strerror(errno));
+    }
+    if(stream != NULL)
+	fclose(stream);
+    if(ret)
+	unlink(tmpname);
+    free(tmpname);
+    return(ret);
+}
+
+static void snapdone(pid_t pid, int status, void *uudata)
+{
+    snapwriter = 0;
+    if(status)
+    {
+	flog(LOG_WARNING, "writing the share snapshot failed with status %i", status);
+	scdirty = 1;
+    }
+}
+
+/*
+ * Saves the share tree to the snapshot, if it has changed since it
+ * was last saved. Unless wait is set, the snapshot is written by a
+ * child process, in the same way as the hash cache.
+ */
+static void writesnapshot(int wait)
+{
+    char *name;
+    pid_t pid;
+    
+    if(snapwritetimer != NULL)
+	canceltimer(snapwritetimer);
+    if(!scdirty || ((name = snapfilename()) == NULL))
+	return;
+    if(!wait && (snapwriter != 0))
+    {
+	free(name);
+	return;
+    }
+    scdirty = 0;
+    if(wait)
+    {
+	if(writesnapfile(name))
+	    scdirty = 1;
+    } else if((pid = fork()) < 0) {
+	flog(LOG_WARNING, "could not fork(!) to write the share snapshot: %s", strerror(errno));
+	if(writesnapfile(name))
+	    scdirty = 1;
+    } else if(pid == 0) {
+	_exit(writesnapfile(name)?1:0);
+    } else {
+	snapwriter = pid;
+	childcallback(pid, snapdone, NULL);
+    }
+    free(name);
+}
+
+static void snaptimercb(int cancelled, void *uudata)
+{
+    snapwritetimer = NULL;
+    if(!cancelled)
+	writesnapshot(0);
+}
+
+static struct sharepoint *snapshare(char *name, char *path)
+{
+    struct sharepoint *share;
+    char *buf;
+    size_t len;
+    int match;
+    
+    for(share = shares; share != NULL; share = share->next)
+    {
+	if((buf = wcstoutf8(share->name)) == NULL)
+	    continue;
+	match = !strcmp(buf, name);
+	free(buf);
+	if(!match)
+	    continue;
+	len = strlen(share->path);
+	if((len > 0) && (share->path[len - 1] == '/'))
+	    len--;
+	if((strlen(path) == len) && !strncmp(share->path, path, len))
+	    return(share);
+    }
+    return(NULL);
+}
+
+/*
+ * Loads the share tree from the snapshot, so that it can be served
+ * until the shares have been rescanned. Shares that are no longer
+ * configured, or that have been moved, are left out. Returns zero if
+ * a snapshot was loaded.
+ */
+static int readsnapshot(void)
+{
+    char *name, *buf, *path;
+    wchar_t *wcs;
+    FILE *stream;
+    struct hcfilehead head;
+    struct snaprec rec;
+    struct sharecache *node, **stack;
+    size_t bufsize, pathsize, stacksize, stackdata;
+    unsigned long long i;
+    unsigned int skip;
+    int err;
+    
+    if((name = snapfilename()) == NULL)
+	return(-1);
+    if((stream = fopen(name, "r")) == NULL)
+    {
+	if(errno != ENOENT)
+	    flog(LOG_WARNING, "could not open share snapshot %s: %s", name, strerror(errno));
+	free(name);
+	return(-1);
+    }
+    if((fread(&head, sizeof(head), 1, stream) != 1) || memcmp(head.magic, SNAPMAGIC, 8) || (head.version != SNAPVERSION) || (head.recsize != sizeof(rec)))
+    {
+	flog(LOG_WARNING, "share snapshot %s is of an unsupported version or truncated, ignoring it", name);
+	fclose(stream);
+	free(name);
+	return(-1);
+    }
+    buf = path = NULL;
+    bufsize = pathsize = 0;
+    stack = NULL;
+    stacksize = 0;
+    sizebuf2(stack, 1, 1);
+    stack[0] = shareroot;
+    stackdata = 1;
+    skip = 0;
+    err = 0;
+    for(i = 0; i < head.count; i++)
+    {
+	if(fread(&rec, sizeof(rec), 1, stream) != 1)
+	{
+	    err = 1;
+	    break;
+	}
+	if((rec.namelen >= (1 << SCNAMEBITS)) || (rec.pathlen >= (1 << SCNAMEBITS)) || (rec.depth < 1) || ((rec.type != FILE_REG) && (rec.type != FILE_DIR)))
+	{
+	    err = 1;
+	    break;
+	}
+	sizebuf2(buf, rec.namelen + 1, 1);
+	sizebuf2(path, rec.pathlen + 1, 1);
+	if((fread(buf, 1, rec.namelen, stream) != rec.namelen) || (fread(path, 1, rec.pathlen, stream) != rec.pathlen))
+	{
+	    err = 1;
+	    break;
+	}
+	buf[rec.namelen] = 0;
+	path[rec.pathlen] = 0;
+	/* Everything else in the daemon trusts the names in the tree
+	 * to be valid UTF-8, as the scanner makes sure of. */
+	if((strlen(buf) != rec.namelen) || ((wcs = utf8towcs(buf)) == NULL))
+	{
+	    err = 1;
+	    break;
+	}
+	free(wcs);
+	if(skip && (rec.depth > skip))
+	    continue;
+	skip = 0;
+	if(rec.depth > stackdata)
+	{
+	    err = 1;
+	    break;
+	}
+	stackdata = rec.depth;
+	if((rec.depth == 1) && ((snapshare(buf, path) == NULL) || (findcache8(shareroot, buf) != NULL)))
+	{
+	    skip = 1;
+	    continue;
+	}
+	if((node = newcache(buf)) == NULL)
+	{
+	    skip = rec.depth;
+	    continue;
+	}
+	if(rec.depth == 1)
+	    getscdir(node)->path = sstrdup(path);
+	node->dev = rec.dev;
+	node->inode = rec.inode;
+	node->mtime = rec.mtime;
+	node->f.b.type = rec.type;
+	if(rec.type == FILE_REG)
+	{
+	    sharesize += (node->size = rec.size);
+	    sharedfiles++;
+	}
+	attachcache(stack[rec.depth - 1], node);
+	if(rec.hastth)
+	    setnodetth(node, rec.tth);
+	if(rec.type == FILE_DIR)
+	{
+	    sizebuf2(stack, rec.depth + 1, 1);
+	    stack[rec.depth] = node;
+	    stackdata = rec.depth + 1;
+	}
+    }
+    if(err)
+    {
+	flog(LOG_WARNING, "share snapshot %s is damaged, ignoring it", name);
+	while((node = scchild(shareroot)) != NULL)
+	    freecache(node);
+    } else if(shareroot->child != 0) {
+	flog(LOG_INFO, "sharing %lli bytes from the snapshot until the shares have been rescanned", sharesize);
+	scdirty = 0;
+    }
+    fclose(stream);
+    free(stack);
+    free(path);
+    free(buf);
+    free(name);
+    return((shareroot->child == 0)?-1:0);
+}
+
 void scanshares(void)
 {
     struct sharepoint *cur;
     struct sharecache *node;
     struct stat sb;
+    char *name, *path;
     
+    hashcursor = 0;
     for(cur = shares; cur != NULL; cur = cur->next)
     {
 	if((node = findcache(shareroot, cur->name)) == NULL)
@@ -1016,11 +4098,18 @@ void scanshares(void)
 		flog(LOG_WARNING, "%s is not a directory; won't share it", cur->path);
 		continue;
 	    }
-	    node = newcache();
-	    node->name = swcsdup(cur->name);
-	    node->path = sstrdup(cur->path);
-	    if(node->path[strlen(node->path) - 1] == '/')
-		node->path[strlen(node->path) - 1] = 0;
+	    if((name = wcstoutf8(cur->name)) == NULL)
+	    {
+		flog(LOG_WARNING, "share name \"%ls\" cannot be converted to UTF-8", cur->name);
+		continue;
+	    }
+	    node = newcache(name);
+	    free(name);
+	    if(node == NULL)
+		continue;
+	    getscdir(node)->path = path = sstrdup(cur->path);
+	    if(path[strlen(path) - 1] == '/')
+		path[strlen(path) - 1] = 0;
 	    node->f.b.type = FILE_DIR;
 	    attachcache(shareroot, node);
 	}
@@ -1041,8 +4130,7 @@ static void preinit(int hup)
 	for(cur = shares; cur != NULL; cur = cur->next)
 	    cur->delete = 1;
     } else {
-	shareroot = newcache();
-	shareroot->name = swcsdup(L"");
+	shareroot = newcache("");
 	shareroot->f.b.type = FILE_DIR;
     }
 }
@@ -1067,31 +4155,63 @@ static int init(int hup)
 	if(cur->delete)
 	    freesharepoint(cur);
     }
+#ifdef HAVE_INOTIFY
+    startwatching();
+#endif
+    if(!hup)
+	fromsnapshot = !readsnapshot();
     scanshares();
     if(!hup)
     {
-	while(doscan(100));
+	/* The scanning threads would not survive daemonizing either,
+	 * so they are only used for the initial scan here, and
+	 * started again by run(). If the shares were loaded from the
+	 * snapshot, they are instead rescanned from the main loop. */
+	if(!fromsnapshot)
+	{
+	    startscanners();
+	    while(doscan(100) || waitscans());
+	    stopscanners();
+	}
 	CBREG(confgetvar("cli", "rescandelay"), conf_update, rsdelayupdate, NULL, NULL);
+#ifdef HAVE_INOTIFY
+	CBREG(confgetvar("cli", "watchshares"), conf_update, watchupdate, NULL, NULL);
+#endif
     }
     return(0);
 }
 
 static int run(void)
 {
-    if(hashjob == -1)
+    if(numhashers == 0)
     {
-	hashjob = 0;
+	starthashers();
+	startscanners();
 	checkhashes();
+	/* No scan has finished to announce the shares yet. */
+	if(fromsnapshot)
+	    GCBCHAINDOCB(sharechangecb, sharesize);
     }
+    if(scdirty && (snapwritetimer == NULL) && (snapwriter == 0))
+	snapwritetimer = timercallback(ntime() + confgetint("cli", "snapshotdelay"), (void (*)(int, void *))snaptimercb, NULL);
     return(doscan(10));
 }
 
 static void terminate(void)
 {
-    if(hashjob != 0)
-	kill(hashjob, SIGHUP);
+    stopscanners();
+    stophashers();
+    /* Everything is in the journal, so leave compaction for the next
+     * startup. */
+    flushjournal();
+    closejournal();
     if(hashwritetimer != NULL)
-	writehashcache(1);
+	canceltimer(hashwritetimer);
+    closetthl();
+    writesnapshot(1);
+#ifdef HAVE_INOTIFY
+    stopwatching();
+#endif
     while(shares != NULL)
 	freesharepoint(shares);
     freecache(shareroot);
@@ -29,6 +29,8 @@
 
 #define HASHHASHSIZE 12
 
+struct sockfile;
+
 struct sharepoint
 {
     struct sharepoint *prev, *next;
@@ -46,23 +48,40 @@ struct hash
 
 struct hashcache
 {
-    struct hashcache *next, *prev;
     dev_t dev;
     ino_t inode;
     time_t mtime;
     char tth[24];
+    off_t tthloff;
+    size_t tthlcount;
+    int used;
 };
 
+/*
+ * Share tree nodes are allocated from an arena of fixed-size chunks,
+ * and refer to one another by their 32-bit index in it, zero meaning
+ * none; scnode() maps an index to its node. Names are kept once each,
+ * in UTF-8, in an arena of their own, and scname() gives the name of
+ * a node. Pointers to nodes stay valid for as long as the nodes do,
+ * but pointers to names only until the main loop next runs.
+ */
+#define SCCHUNKBITS 12
+#define SCNAMEBITS 16
+
 struct sharecache
 {
-    struct sharecache *next, *prev, *child, *parent;
-    char *path;
-    wchar_t *name;
-    off_t size;
-    time_t mtime;
-    dev_t dev;
-    ino_t inode;
-    char hashtth[24];
+    unsigned int next, prev, child, parent;
+    unsigned int tthnext;
+    /* Directories with many children index them by name, in a hash
+     * table linked through the children's cinext indices. */
+    unsigned int cinext;
+    unsigned int idx, name;
+    /* All the nodes with the same name are linked together, for
+     * findnamed() and nextnamed(). */
+    unsigned int namenext, nameprev;
+    /* What only directories need is kept in a record of its own, so
+     * that files need not carry it; this is its index, or zero. */
+    unsigned int dir;
     union
     {
 	struct
@@ -73,9 +92,20 @@ struct sharecache
 	} b;
 	int w;
     } f;
-    CBCHAIN(share_delete, struct sharecache *);
+    off_t size;
+    time_t mtime;
+    dev_t dev;
+    ino_t inode;
+    char hashtth[24];
 };
 
+#define scnode(i) ((i)?(scchunks[(i) >> SCCHUNKBITS] + ((i) & ((1 << SCCHUNKBITS) - 1))):NULL)
+#define scnext(n) scnode((n)->next)
+#define scprev(n) scnode((n)->prev)
+#define scchild(n) scnode((n)->child)
+#define scparent(n) scnode((n)->parent)
+#define scname(n) (scnames[(n)->name >> SCNAMEBITS] + ((n)->name & ((1 << SCNAMEBITS) - 1)))
+
 void clientpreinit(void);
 int clientinit(void);
 int doscan(int quantum);
@@ -84,6 +114,13 @@ struct sharecache *findcache(struct sharecache *parent, wchar_t *name);
 void queuescan(struct sharecache *node);
 char *getfspath(struct sharecache *node);
 struct sharecache *nextscnode(struct sharecache *node);
+wchar_t *scwname(struct sharecache *node);
+void getsharestats(size_t *nodes, size_t *treemem, size_t *names, size_t *namemem, size_t *indexmem);
+struct sharecache *findtth(char *tth);
+struct sharecache *nexttth(struct sharecache *node);
+int findnames(wchar_t *str, unsigned int **names, size_t *num);
+struct sharecache *findnamed(unsigned int name);
+struct sharecache *nextnamed(struct sharecache *node);
 struct hash *newhash(wchar_t *algo, size_t len, char *hash);
 void freehash(struct hash *hash);
 struct hash *duphash(struct hash *hash);
@@ -91,10 +128,15 @@ struct hash *parsehash(wchar_t *text);
 wchar_t *unparsehash(struct hash *hash);
 int hashcmp(struct hash *h1, struct hash *h2);
 void scanshares(void);
+double gethashrate(void);
+struct sockfile *gettthl(struct sharecache *node, off_t *off, size_t *len);
 
 extern struct sharecache *shareroot;
+extern struct sharecache **scchunks;
+extern char **scnames;
 extern int sharedfiles;
 extern unsigned long long sharesize;
+extern int numhashjobs;
 EGCBCHAIN(sharechangecb, unsigned long long);
 
 #endif
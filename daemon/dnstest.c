@@ -0,0 +1,377 @@
+/*
+ *  Dolda Connect - Modular multiuser Direct Connect-style client
+ *  Copyright (C) 2007 Fredrik Tolf <fredrik@dolda2000.com>
+ *  
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *  
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *  
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+/*
+ * Tests the resolver in net.c against a stub DNS server, which runs
+ * in a child process and answers from a fixed table.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <wchar.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "utils.h"
+#include "log.h"
+#include "conf.h"
+#include "module.h"
+#include "net.h"
+#include "sysevents.h"
+
+struct module *modchain = NULL;
+struct evhist evstats[EVS_NUM];
+static struct timer **timers = NULL;
+static size_t timerssize = 0, timersdata = 0;
+
+static struct {
+    char *name;
+    int type;
+    char *addr;
+} records[] = {
+    {"host4.test", 1, "192.0.2.1"},
+    {"host4.test", 28, NULL},
+    {"host6.test", 1, NULL},
+    {"host6.test", 28, "2001:db8::6"},
+    {"both.test", 1, "192.0.2.2"},
+    {"both.test", 28, "2001:db8::2"},
+    {"short.example.test", 1, "192.0.2.3"},
+    {"short.example.test", 28, NULL},
+    {NULL, 0, NULL}
+};
+
+struct result {
+    int done;
+    char addr[INET6_ADDRSTRLEN];
+    int port;
+};
+
+static int fails = 0;
+
+/* The daemon's main loop is not linked in, so the timers that the
+ * resolver uses are kept here. */
+struct timer *timercallback(double at, void (*func)(int, void *), void *data)
+{
+    struct timer *new;
+    
+    new = smalloc(sizeof(*new));
+    new->at = at;
+    new->func = func;
+    new->data = data;
+    new->idx = timersdata;
+    addtobuf(timers, new);
+    return(new);
+}
+
+static void unlinktimer(struct timer *timer)
+{
+    timers[timer->idx] = timers[--timersdata];
+    timers[timer->idx]->idx = timer->idx;
+}
+
+void canceltimer(struct timer *timer)
+{
+    unlinktimer(timer);
+    timer->func(1, timer->data);
+    free(timer);
+}
+
+void evhistadd(struct evhist *hist, double dur)
+{
+}
+
+static void runtimers(void)
+{
+    struct timer *timer;
+    size_t i;
+    double now;
+    
+    now = ntime();
+    for(i = 0; i < timersdata; ) {
+	if(timers[i]->at <= now) {
+	    timer = timers[i];
+	    unlinktimer(timer);
+	    timer->func(0, timer->data);
+	    free(timer);
+	    i = 0;
+	} else {
+	    i++;
+	}
+    }
+}
+
+static void stubreply(int fd, unsigned char *msg, size_t len, struct sockaddr *from, socklen_t fromlen)
+{
+    static int tcqueries = 0;
+    unsigned char rep[512];
+    char name[256];
+    size_t pos, np, ll, rlen;
+    int i, type, known;
+    unsigned char addr[16];
+    
+    if(len < 12)
+	return;
+    pos = 12;
+    np = 0;
+    while((pos < len) && (msg[pos] != 0)) {
+	ll = msg[pos++];
+	if((pos + ll > len) || (np + ll + 2 > sizeof(name)))
+	    return;
+	if(np > 0)
+	    name[np++] = '.';
+	memcpy(name + np, msg + pos, ll);
+	np += ll;
+	pos += ll;
+    }
+    name[np] = 0;
+    if(++pos + 4 > len)
+	return;
+    type = (msg[pos] << 8) | msg[pos + 1];
+    pos += 4;
+    memcpy(rep, msg, pos);
+    rep[2] = 0x81; /* QR, RD */
+    rep[3] = 0x80; /* RA */
+    memset(rep + 6, 0, 6);
+    rlen = pos;
+    if(!strncmp(name, "tc.", 3)) {
+	/* Truncated, as if the answers had not fit */
+	tcqueries++;
+	rep[2] |= 0x02;
+    } else if(!strncmp(name, "tccount", 7) && (type == 1)) {
+	/* Tells how many truncated replies have been sent so far */
+	memcpy(addr, "\x7f\x00\x00", 3);
+	addr[3] = tcqueries;
+	ll = 4;
+	goto answer;
+    } else {
+	known = 0;
+	for(i = 0; records[i].name != NULL; i++) {
+	    if(strcmp(records[i].name, name))
+		continue;
+	    known = 1;
+	    if((records[i].type != type) || (records[i].addr == NULL))
+		continue;
+	    ll = (type == 1)?4:16;
+	    inet_pton((type == 1)?AF_INET:AF_INET6, records[i].addr, addr);
+	    goto answer;
+	}
+	/* A known name without the asked-for type has no data, but
+	 * anything else does not exist. */
+	if(!known)
+	    rep[3] |= 3;
+    }
+    sendto(fd, rep, rlen, 0, from, fromlen);
+    return;
+    
+answer:
+    rep[7] = 1; /* ANCOUNT */
+    rep[rlen++] = 0xc0;
+    rep[rlen++] = 12;
+    rep[rlen++] = type >> 8;
+    rep[rlen++] = type & 0xff;
+    rep[rlen++] = 0;
+    rep[rlen++] = 1;
+    memcpy(rep + rlen, "\x00\x00\x00\x3c", 4);
+    rlen += 4;
+    rep[rlen++] = 0;
+    rep[rlen++] = ll;
+    memcpy(rep + rlen, addr, ll);
+    rlen += ll;
+    sendto(fd, rep, rlen, 0, from, fromlen);
+}
+
+static void stubserve(int fd)
+{
+    unsigned char msg[512];
+    struct sockaddr_storage from;
+    socklen_t fromlen;
+    ssize_t ret;
+    
+    while(1) {
+	fromlen = sizeof(from);
+	if((ret = recvfrom(fd, msg, sizeof(msg), 0, (struct sockaddr *)&from, &fromlen)) < 0) {
+	    if(errno == EINTR)
+		continue;
+	    exit(1);
+	}
+	stubreply(fd, msg, ret, (struct sockaddr *)&from, fromlen);
+    }
+}
+
+static void resolved(struct sockaddr *addr, int addrlen, void *data)
+{
+    struct result *res;
+    
+    res = data;
+    res->done = 1;
+    if(addr == NULL)
+	return;
+    if(addr->sa_family == AF_INET) {
+	inet_ntop(AF_INET, &((struct sockaddr_in *)addr)->sin_addr, res->addr, sizeof(res->addr));
+	res->port = ntohs(((struct sockaddr_in *)addr)->sin_port);
+#ifdef HAVE_IPV6
+    } else if(addr->sa_family == AF_INET6) {
+	inet_ntop(AF_INET6, &((struct sockaddr_in6 *)addr)->sin6_addr, res->addr, sizeof(res->addr));
+	res->port = ntohs(((struct sockaddr_in6 *)addr)->sin6_port);
+#endif
+    }
+}
+
+static void resolve(char *name, struct result *res)
+{
+    double deadline;
+    
+    memset(res, 0, sizeof(*res));
+    if(netresolve(name, resolved, res) < 0) {
+	fprintf(stderr, "dnstest: %s: %s\n", name, strerror(errno));
+	fails++;
+	return;
+    }
+    deadline = ntime() + 10;
+    while(!res->done && (ntime() < deadline)) {
+	pollsocks(100);
+	runtimers();
+    }
+    if(!res->done) {
+	fprintf(stderr, "dnstest: %s: timed out\n", name);
+	fails++;
+    }
+}
+
+static void check(char *name, char *expect, int port)
+{
+    struct result res;
+    
+    resolve(name, &res);
+    if(!res.done)
+	return;
+    if(expect == NULL) {
+	if(res.addr[0]) {
+	    fprintf(stderr, "dnstest: %s: resolved to %s, expected failure\n", name, res.addr);
+	    fails++;
+	}
+    } else if(strcmp(res.addr, expect) || ((port >= 0) && (res.port != port))) {
+	fprintf(stderr, "dnstest: %s: resolved to \"%s\" port %i, expected %s port %i\n", name, res.addr, res.port, expect, port);
+	fails++;
+    }
+}
+
+static int tccount(char *name)
+{
+    struct result res;
+    
+    resolve(name, &res);
+    if(!res.done || strncmp(res.addr, "127.0.0.", 8))
+	return(-1);
+    return(atoi(res.addr + 8));
+}
+
+int main(int argc, char **argv)
+{
+    struct module *mod;
+    struct sockaddr_in name;
+    socklen_t namelen;
+    FILE *conf;
+    pid_t stub;
+    int fd, n1, n2;
+    
+    logtostderr = 1;
+    for(mod = modchain; mod != NULL; mod = mod->next) {
+	confregmod(&mod->conf);
+	if(mod->preinit)
+	    mod->preinit(0);
+    }
+    memset(&name, 0, sizeof(name));
+    name.sin_family = AF_INET;
+    name.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    namelen = sizeof(name);
+    if(((fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0) || bind(fd, (struct sockaddr *)&name, sizeof(name)) || getsockname(fd, (struct sockaddr *)&name, &namelen)) {
+	perror("dnstest: stub server socket");
+	return(1);
+    }
+    if((stub = fork()) < 0) {
+	perror("dnstest: fork");
+	return(1);
+    }
+    if(stub == 0)
+	stubserve(fd);
+    close(fd);
+    if((conf = tmpfile()) == NULL) {
+	perror("dnstest: tmpfile");
+	return(1);
+    }
+    /* readconfig() reads wide characters, and a stream cannot be
+     * switched between wide and byte orientation. */
+    fwprintf(conf, L"set net.dnsserver 127.0.0.1:%i\n", ntohs(name.sin_port));
+    fwprintf(conf, L"set net.dnssearch example.test\n");
+    fwprintf(conf, L"set net.dnstimeout 1\n");
+    rewind(conf);
+    readconfig(conf);
+    fclose(conf);
+    for(mod = modchain; mod != NULL; mod = mod->next) {
+	if(mod->init && mod->init(0)) {
+	    fprintf(stderr, "dnstest: could not initialize %s\n", mod->name);
+	    return(1);
+	}
+    }
+    
+    check("host4.test:411", "192.0.2.1", 411);
+    check("HOST4.Test", "192.0.2.1", -1);
+    /* An absolute name must match the reply to it, which lacks the
+     * trailing dot. */
+    check("host4.test.:411", "192.0.2.1", 411);
+#ifdef HAVE_IPV6
+    check("host6.test", "2001:db8::6", -1);
+#else
+    check("host6.test", NULL, -1);
+#endif
+    check("both.test", "192.0.2.2", -1);
+    check("nx.test", NULL, -1);
+    check("nx.test", NULL, -1);
+    /* Search domains apply only to relative names */
+    check("short", "192.0.2.3", -1);
+    check("short.", NULL, -1);
+    /* A truncated reply is a failure, and is not cached. */
+    check("tc.test", NULL, -1);
+    n1 = tccount("tccount1.test");
+    check("tc.test", NULL, -1);
+    n2 = tccount("tccount2.test");
+    if((n1 <= 0) || (n2 != n1 * 2)) {
+	fprintf(stderr, "dnstest: %i and then %i truncated replies, expected a retry after the first and no caching\n", n1, n2);
+	fails++;
+    }
+    
+    kill(stub, SIGTERM);
+    waitpid(stub, NULL, 0);
+    if(fails) {
+	fprintf(stderr, "dnstest: %i failures\n", fails);
+	return(1);
+    }
+    return(0);
+}
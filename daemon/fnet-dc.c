@@ -1070,21 +1070,24 @@ static void cmd_forcemove(struct socket *sk, struct fnetnode *fn, char *cmd, cha
 static char *getdcpath(struct sharecache *node, size_t *retlen, char *charset)
 {
     char *buf, *buf2;
+    wchar_t *wname;
     size_t len, len2;
     
-    if(node->parent == NULL)
+    if(node->parent == 0)
 	return(NULL);
-    if(node->parent == shareroot)
+    wname = scwname(node);
+    buf2 = icwcstombs(wname, charset);
+    free(wname);
+    if(buf2 == NULL)
+	return(NULL);
+    if(scparent(node) == shareroot)
     {
-	if((buf = icwcstombs(node->name, charset)) == NULL)
-	    return(NULL);
+	buf = buf2;
 	if(retlen != NULL)
 	    *retlen = strlen(buf);
 	return(buf);
     } else {
-	if((buf2 = icwcstombs(node->name, charset)) == NULL)
-	    return(NULL);
-	if((buf = getdcpath(node->parent, &len, charset)) == NULL)
+	if((buf = getdcpath(scparent(node), &len, charset)) == NULL)
 	{
 	    free(buf2);
 	    return(NULL);
@@ -1101,11 +1104,231 @@ static char *getdcpath(struct sharecache *node, size_t *retlen, char *charset)
     }
 }
 
+static int sendsr(struct dchub *hub, struct socket *dsk, struct sharecache *node, char *prefix, char *infix, char *postfix)
+{
+    char *buf, *buf2;
+    
+    /* Use DCCHARSET in $Get paths until further researched... */
+    if((buf = getdcpath(node, NULL, DCCHARSET)) == NULL)
+	return(-1);
+    if(node->f.b.hastth)
+    {
+	buf2 = base32encode(node->hashtth, 24);
+	qstrf(dsk, "%s%s\005%ji%sTTH:%.39s%s", prefix, buf, (intmax_t)node->size, infix, buf2, postfix);
+	free(buf2);
+    } else {
+	qstrf(dsk, "%s%s\005%ji%s%s%s", prefix, buf, (intmax_t)node->size, infix, hub->nativename, postfix);
+    }
+    free(buf);
+    return(0);
+}
+
+/*
+ * Checks whether all the given terms are found in the name of a node
+ * or of any of the directories it is in.
+ */
+static int pathmatches(struct sharecache *node, wchar_t **terms, int termnum)
+{
+    int i;
+    struct sharecache *n;
+    wchar_t *lname;
+    
+    for(i = 0; i < termnum; i++)
+    {
+	for(n = node; n != shareroot; n = scparent(n))
+	{
+	    lname = wcslower(scwname(n));
+	    if(wcsstr(lname, terms[i]))
+	    {
+		free(lname);
+		break;
+	    }
+	    free(lname);
+	}
+	if(n == shareroot)
+	    return(0);
+    }
+    return(1);
+}
+
+struct dcsearch
+{
+    struct dchub *hub;
+    struct socket *dsk;
+    char *prefix, *infix, *postfix;
+    int minsize, maxsize;
+    int termnum, matches;
+    wchar_t **terms;
+    /* For each term, the sorted names containing it, or NULL for
+     * terms too short to be looked up in the name index. */
+    unsigned int *names[32];
+    size_t numnames[32];
+};
+
+static int hasname(unsigned int *names, size_t num, unsigned int name)
+{
+    size_t lo, hi, mid;
+    
+    lo = 0;
+    hi = num;
+    while(lo < hi)
+    {
+	mid = (lo + hi) / 2;
+	if(names[mid] == name)
+	    return(1);
+	if(names[mid] < name)
+	    lo = mid + 1;
+	else
+	    hi = mid;
+    }
+    return(0);
+}
+
+/* The lower-cased name of the node is only made for terms that are
+ * not in the name index, and is then kept in *lname. */
+static int termmatches(struct dcsearch *s, int term, struct sharecache *node, wchar_t **lname)
+{
+    if(s->names[term] != NULL)
+	return(hasname(s->names[term], s->numnames[term], node->name));
+    if(*lname == NULL)
+	*lname = wcslower(scwname(node));
+    return(wcsstr(*lname, s->terms[term]) != NULL);
+}
+
+static int sizeskipped(struct dcsearch *s, struct sharecache *node)
+{
+    if(node->f.b.type != FILE_REG)
+	return(0);
+    if((s->minsize >= 0) && (node->size < s->minsize))
+	return(1);
+    if((s->maxsize >= 0) && (node->size > s->maxsize))
+	return(1);
+    return(0);
+}
+
+/*
+ * Walks the tree under top, sending results for the nodes that
+ * satisfy all terms, without descending below them. tersat holds the
+ * level at which each term was satisfied, or -1 if it is not, and
+ * the terms satisfied by top or above it should be at level
+ * zero. Returns non-zero once enough results have been sent.
+ */
+static int searchtree(struct dcsearch *s, struct sharecache *top, int *tersat, int satisfied)
+{
+    int i, level, skipcheck;
+    struct sharecache *node;
+    wchar_t *lname;
+    
+    if((node = scchild(top)) == NULL)
+	return(0);
+    level = 1;
+    while(1)
+    {
+	if(!(skipcheck = sizeskipped(s, node)))
+	{
+	    lname = NULL;
+	    for(i = 0; i < s->termnum; i++)
+	    {
+		if(tersat[i] >= 0)
+		    continue;
+		if(termmatches(s, i, node, &lname))
+		{
+		    tersat[i] = level;
+		    satisfied++;
+		} else if(node->child == 0) {
+		    break;
+		}
+	    }
+	    if(lname != NULL)
+		free(lname);
+	}
+	if(!skipcheck && (satisfied == s->termnum))
+	{
+	    if(!sendsr(s->hub, s->dsk, node, s->prefix, s->infix, s->postfix) && (++s->matches >= 20))
+		return(1);
+	}
+	if((!skipcheck && (satisfied == s->termnum)) || (node->child == 0))
+	{
+	    while(node->next == 0)
+	    {
+		if((node = scparent(node)) == top)
+		    return(0);
+		level--;
+	    }
+	    for(i = 0; i < s->termnum; i++)
+	    {
+		if(tersat[i] >= level)
+		{
+		    tersat[i] = -1;
+		    satisfied--;
+		}
+	    }
+	    node = scnext(node);
+	} else {
+	    node = scchild(node);
+	    level++;
+	}
+    }
+}
+
+/*
+ * Every result must be at or below a node whose name contains the
+ * given term, so only the trees under those need to be walked. Of
+ * nested such nodes, only the uppermost is searched from, with the
+ * terms satisfied above it taken into account, which yields the same
+ * results as walking the whole share tree.
+ */
+static void searchnamed(struct dcsearch *s, int term)
+{
+    size_t i;
+    int o, satisfied, tersat[32];
+    struct sharecache *node, *n;
+    wchar_t *lname;
+    
+    for(i = 0; i < s->numnames[term]; i++)
+    {
+	for(node = findnamed(s->names[term][i]); node != NULL; node = nextnamed(node))
+	{
+	    if(sizeskipped(s, node))
+		continue;
+	    for(o = 0; o < s->termnum; o++)
+		tersat[o] = -1;
+	    satisfied = 0;
+	    for(n = node; (n != NULL) && (n != shareroot); n = scparent(n))
+	    {
+		if((n != node) && hasname(s->names[term], s->numnames[term], n->name))
+		    break;
+		lname = NULL;
+		for(o = 0; o < s->termnum; o++)
+		{
+		    if((tersat[o] < 0) && termmatches(s, o, n, &lname))
+		    {
+			tersat[o] = 0;
+			satisfied++;
+		    }
+		}
+		if(lname != NULL)
+		    free(lname);
+	    }
+	    if(n != shareroot)
+		continue;
+	    if(satisfied == s->termnum)
+	    {
+		if(!sendsr(s->hub, s->dsk, node, s->prefix, s->infix, s->postfix) && (++s->matches >= 20))
+		    return;
+	    } else if(searchtree(s, node, tersat, satisfied)) {
+		return;
+	    }
+	}
+    }
+}
+
 /*
  * This is the main share searching function for Direct Connect
- * peers. Feel free to optimize it if you feel the need for it. I
- * haven't ever seen it take any noticable CPU time anyway, so I
- * haven't felt that need.
+ * peers. Terms of three characters or more are looked up in the name
+ * index, and only the trees under the nodes matching the rarest of
+ * them are walked. Only if all terms are shorter than that is the
+ * whole share tree walked.
  *
  * It may feel dubious to just return the directory when all terms are
  * satisfied rather than all the files in it, but it really benefits
@@ -1118,17 +1341,18 @@ static void cmd_search(struct socket *sk, struct fnetnode *fn, char *cmd, char *
     int i, done;
     struct dchub *hub;
     char *p, *p2;
-    char *prefix, *infix, *postfix, *buf, *buf2;
+    char *prefix, *infix, *postfix, *buf;
     struct socket *dsk;
     struct sockaddr_in addr;
     struct sharecache *node;
     int minsize, maxsize;
     int dotth;
     size_t buflen;
-    int termnum, satisfied, matches, skipcheck, proper;
-    int level, tersat[32];
-    wchar_t *terms[32], *lname;
+    int termnum, matches, proper, best;
+    int tersat[32];
+    wchar_t *terms[32];
     char hashtth[24];
+    struct dcsearch s;
     
     hub = fn->data;
     if((p = strchr(args, ' ')) == NULL)
@@ -1136,6 +1360,7 @@ static void cmd_search(struct socket *sk, struct fnetnode *fn, char *cmd, char *
     *(p++) = 0;
     
     memset(terms, 0, sizeof(terms));
+    memset(&s, 0, sizeof(s));
     prefix = infix = postfix = NULL;
     dsk = NULL;
     dotth = 0;
@@ -1230,90 +1455,58 @@ static void cmd_search(struct socket *sk, struct fnetnode *fn, char *cmd, char *
 	}
 	p2++;
     }
-    if(!proper)
+    if(!proper && !dotth)
 	goto out;
     
-    node = shareroot->child;
-    level = 0;
-    for(i = 0; i < termnum; i++)
-	tersat[i] = -1;
-    satisfied = 0;
-    matches = 0;
-    while(1)
+    if(dotth)
     {
-	skipcheck = 0;
-	if(node->f.b.type == FILE_REG)
+	/* TTH searches are answered from the TTH index, rather than
+	 * by walking the share tree. */
+	matches = 0;
+	for(node = findtth(hashtth); node != NULL; node = nexttth(node))
 	{
 	    if((minsize >= 0) && (node->size < minsize))
-		skipcheck = 1;
+		continue;
 	    if((maxsize >= 0) && (node->size > maxsize))
-		skipcheck = 1;
-	}
-	if(!skipcheck && dotth)
-	{
-	    if((node->f.b.type != FILE_REG) || (node->f.b.hastth && memcmp(hashtth, node->hashtth, 24)))
-		skipcheck = 1;
-	}
-	if(!skipcheck)
-	{
-	    lname = wcslower(swcsdup(node->name));
-	    for(i = 0; i < termnum; i++)
-	    {
-		if(tersat[i] >= 0)
-		    continue;
-		if(wcsstr(lname, terms[i]))
-		{
-		    tersat[i] = level;
-		    satisfied++;
-		} else if(node->child == NULL) {
-		    break;
-		}
-	    }
-	    free(lname);
-	}
-	if(!skipcheck && (satisfied == termnum))
-	{
-	    /* Use DCCHARSET in $Get paths until further researched... */
-	    if((buf = getdcpath(node, NULL, DCCHARSET)) != NULL)
-	    {
-		if(node->f.b.hastth)
-		{
-		    buf2 = base32encode(node->hashtth, 24);
-		    qstrf(dsk, "%s%s\005%ji%sTTH:%.39s%s", prefix, buf, (intmax_t)node->size, infix, buf2, postfix);
-		    free(buf2);
-		} else {
-		    qstrf(dsk, "%s%s\005%ji%s%s%s", prefix, buf, (intmax_t)node->size, infix, hub->nativename, postfix);
-		}
-		free(buf);
-		if(++matches >= 20)
-		    break;
-	    }
-	}
-	if((!skipcheck && (satisfied == termnum)) || (node->child == NULL))
-	{
-	    while(node->next == NULL)
-	    {
-		if((node = node->parent) == shareroot)
-		    break;
-		level--;
-	    }
-	    if(node == shareroot)
+		continue;
+	    if(!pathmatches(node, terms, termnum))
+		continue;
+	    if(!sendsr(hub, dsk, node, prefix, infix, postfix) && (++matches >= 20))
 		break;
-	    for(i = 0; i < termnum; i++)
-	    {
-		if(tersat[i] >= level)
-		{
-		    tersat[i] = -1;
-		    satisfied--;
-		}
-	    }
-	    node = node->next;
-	} else {
-	    node = node->child;
-	    level++;
 	}
+	goto done;
+    }
+    
+    s.hub = hub;
+    s.dsk = dsk;
+    s.prefix = prefix;
+    s.infix = infix;
+    s.postfix = postfix;
+    s.minsize = minsize;
+    s.maxsize = maxsize;
+    s.terms = terms;
+    s.termnum = termnum;
+    best = -1;
+    for(i = 0; i < termnum; i++)
+    {
+	if(findnames(terms[i], &s.names[i], &s.numnames[i]) < 0)
+	    continue;
+	/* Nothing can match a term that no name contains. */
+	if(s.numnames[i] == 0)
+	    goto done;
+	if((best < 0) || (s.numnames[i] < s.numnames[best]))
+	    best = i;
+    }
+    if(best >= 0)
+    {
+	searchnamed(&s, best);
+    } else {
+	for(i = 0; i < termnum; i++)
+	    tersat[i] = -1;
+	searchtree(&s, shareroot, tersat, 0);
     }
 
+ done:
     hubhandleaction(sk, fn, cmd, args);
     
  out:
@@ -1327,6 +1520,11 @@ static void cmd_search(struct socket *sk, struct fnetnode *fn, char *cmd, char *
 	free(postfix);
     for(i = 0; (i < 32) && (terms[i] != NULL); i++)
 	free(terms[i]);
+    for(i = 0; i < 32; i++)
+    {
+	if(s.names[i] != NULL)
+	    free(s.names[i]);
+    }
 }
 
 static void cmd_connecttome(struct socket *sk, struct fnetnode *fn, char *cmd, char *args)
@@ -1839,11 +2037,7 @@ static struct sharecache *findbytth(char *tth32)
 	free(buf);
 	return(NULL);
     }
-    for(node = shareroot->child; node != NULL; node = nextscnode(node))
-    {
-	if(node->f.b.hastth && !memcmp(node->hashtth, buf, 24))
-	    break;
-    }
+    node = findtth(buf);
     free(buf);
     return(node);
 }
@@ -1866,13 +2060,31 @@ static struct sharecache *resdcpath(char *path, char *charset, char sep)
     return(node);
 }
 
+/*
+ * Prepares the peer's transfer for uploading from fd. Uncompressed
+ * data is sent straight from the file by the network layer; otherwise
+ * it has to be read through a socket so it can be compressed.
+ */
+static void prepul(struct dcpeer *peer, int fd, off_t size, off_t start, off_t end)
+{
+    struct socket *lesk;
+    
+    if(peer->compress == CPRS_NONE)
+    {
+	transferprepulfile(peer->transfer, size, start, end, fd);
+    } else {
+	lesk = wrapsock(fd);
+	transferprepul(peer->transfer, size, start, end, lesk);
+	putsock(lesk);
+    }
+}
+
 static void cmd_get(struct socket *sk, struct dcpeer *peer, char *cmd, char *args)
 {
     off_t offset;
     char *p, *buf;
     wchar_t *buf2;
     struct sharecache *node;
-    struct socket *lesk;
     int fd;
     struct stat sb;
     
@@ -1929,7 +2141,7 @@ static void cmd_get(struct socket *sk, struct dcpeer *peer, char *cmd, char *arg
     if(fstat(fd, &sb) < 0)
     {
 	close(fd);
-	flog(LOG_WARNING, "could not stat file %ls: %s", node->name, strerror(errno));
+	flog(LOG_WARNING, "could not stat file %s: %s", scname(node), strerror(errno));
 	qstrf(sk, "$Error|");
 	peer->close = 1;
 	return;
@@ -1949,9 +2161,7 @@ static void cmd_get(struct socket *sk, struct dcpeer *peer, char *cmd, char *arg
 	peer->close = 1;
 	return;
     }
-    lesk = wrapsock(fd);
-    transferprepul(peer->transfer, sb.st_size, offset, -1, lesk);
-    putsock(lesk);
+    prepul(peer, fd, sb.st_size, offset, -1);
     qstrf(sk, "$FileLength %ji|", (intmax_t)peer->transfer->size);
 }
 
@@ -1962,7 +2172,7 @@ static void cmd_send(struct socket *sk, struct dcpeer *peer, char *cmd, char *ar
 	peer->close = 1;
 	return;
     }
-    if(peer->transfer->localend == NULL)
+    if((peer->transfer->localend == NULL) && (peer->transfer->localfile == NULL))
     {
 	peer->close = 1;
 	return;
@@ -2008,7 +2218,6 @@ static void cmd_getblock(struct socket *sk, struct dcpeer *peer, char *cmd, char
     wchar_t *buf2;
     struct sharecache *node;
     struct stat sb;
-    struct socket *lesk;
     
     if(peer->transfer == NULL)
     {
@@ -2072,7 +2281,7 @@ static void cmd_getblock(struct socket *sk, struct dcpeer *peer, char *cmd, char
     if(fstat(fd, &sb) < 0)
     {
 	close(fd);
-	flog(LOG_WARNING, "could not stat file %ls: %s", node->name, strerror(errno));
+	flog(LOG_WARNING, "could not stat file %s: %s", scname(node), strerror(errno));
 	qstr(sk, "$Error|");
 	return;
     }
@@ -2091,9 +2300,7 @@ static void cmd_getblock(struct socket *sk, struct dcpeer *peer, char *cmd, char
     }
     if((numbytes < 0) || (start + numbytes > sb.st_size))
 	numbytes = sb.st_size - start;
-    lesk = wrapsock(fd);
-    transferprepul(peer->transfer, sb.st_size, start, start + numbytes, lesk);
-    putsock(lesk);
+    prepul(peer, fd, sb.st_size, start, start + numbytes);
     qstrf(sk, "$Sending %ji|", (intmax_t)numbytes);
     startul(peer);
 }
@@ -2105,9 +2312,11 @@ static void cmd_adcget(struct socket *sk, struct dcpeer *peer, char *cmd, char *
     off_t start, numbytes;
     struct sharecache *node;
     struct stat sb;
-    struct socket *lesk;
     wchar_t *wbuf;
     int fd;
+    struct sockfile *tthl;
+    off_t tthloff;
+    size_t tthllen;
     
     if(peer->transfer == NULL)
     {
@@ -2175,7 +2384,7 @@ static void cmd_adcget(struct socket *sk, struct dcpeer *peer, char *cmd, char *
 	}
 	if(fstat(fd, &sb) < 0)
 	{
-	    flog(LOG_WARNING, "could not stat file %ls: %s", node->name, strerror(errno));
+	    flog(LOG_WARNING, "could not stat file %s: %s", scname(node), strerror(errno));
 	    qstr(sk, "$Error|");
 	    goto out;
 	}
@@ -2192,9 +2401,7 @@ static void cmd_adcget(struct socket *sk, struct dcpeer *peer, char *cmd, char *
 	}
 	if((numbytes < 0) || (start + numbytes > sb.st_size))
 	    numbytes = sb.st_size - start;
-	lesk = wrapsock(fd);
-	transferprepul(peer->transfer, sb.st_size, start, start + numbytes, lesk);
-	putsock(lesk);
+	prepul(peer, fd, sb.st_size, start, start + numbytes);
 	fd = -1;
 	qstr(sk, "$ADCSND");
 	sendadc(sk, "file");
@@ -2206,25 +2413,28 @@ static void cmd_adcget(struct socket *sk, struct dcpeer *peer, char *cmd, char *
 	qstr(sk, "|");
 	startul(peer);
     } else if(!strcmp(argv[0], "tthl")) {
-	/*
-	 * XXX: Implement full TTHL support.
-	 *
-	 * In the meantime, this is better than nothing, since it at
-	 * least allows fetching of the TTH root if it isn't already
-	 * known.
-	 */
 	if(node == NULL)
 	{
 	    qstr(sk, "$Error no TTHL data for virtual files|");
 	    goto out;
 	}
+	/* Files whose leaves are not stored, such as those that fit
+	 * in one leaf, are described by their root alone. */
+	if((tthl = gettthl(node, &tthloff, &tthllen)) == NULL)
+	    tthllen = 24;
 	qstr(sk, "$ADCSND");
 	sendadc(sk, "tthl");
 	sendadc(sk, argv[1]);
 	sendadc(sk, "0");
-	sendadc(sk, "24");
+	sendadcf(sk, "%zi", tthllen);
 	qstr(sk, "|");
-	sockqueue(sk, node->hashtth, 24);
+	if(tthl != NULL)
+	{
+	    sockqueuefile(sk, tthl, tthloff, tthllen);
+	    putsockfile(tthl);
+	} else {
+	    sockqueue(sk, node->hashtth, 24);
+	}
     } else {
 	qstr(sk, "$Error Namespace not implemented|");
 	goto out;
@@ -2705,12 +2915,12 @@ static void dctransgotdata(struct transfer *transfer, struct dcpeer *peer)
     {
 	if(sockqueueleft(peer->sk) > 0)
 	{
-	    if((buf = sockgetinbuf(peer->trpipe, &bufsize)) != NULL)
+	    if(peer->compress == CPRS_NONE)
 	    {
-		if(peer->compress == CPRS_NONE)
+		sockpassdata(peer->trpipe, peer->sk);
+	    } else if((buf = sockgetinbuf(peer->trpipe, &bufsize)) != NULL) {
+		if(peer->compress == CPRS_ZLIB)
 		{
-		    sockqueue(peer->sk, buf, bufsize);
-		} else if(peer->compress == CPRS_ZLIB) {
 		    cstr = peer->cprsdata;
 		    cstr->next_in = buf;
 		    cstr->avail_in = bufsize;
@@ -2805,8 +3015,7 @@ static void transread(struct socket *sk, struct dcpeer *peer)
 	    freedcpeer(peer);
 	    return;
 	}
-	sockqueue(peer->trpipe, buf, bufsize);
-	free(buf);
+	sockqueuebuf(peer->trpipe, buf, bufsize);
     }
     if(peer->transfer->curpos >= peer->transfer->size)
     {
@@ -3360,19 +3569,23 @@ static void updatehmlist(void)
     int i, lev, ic, ret;
     struct sharecache *node;
     char *buf, *buf2, numbuf[32];
+    wchar_t *wname;
     size_t bufsize, bufdata;
     int fd, ibuf;
     FILE *out;
     
     bufdata = 0;
     buf = smalloc(bufsize = 65536);
-    node = shareroot->child;
+    node = scchild(shareroot);
     lev = 0;
     while(1)
     {
 	ic = 0;
 	/* Use DCCHARSET in $Get paths until further researched... */
-	if((buf2 = icwcstombs(node->name, DCCHARSET)) != NULL)
+	wname = scwname(node);
+	buf2 = icwcstombs(wname, DCCHARSET);
+	free(wname);
+	if(buf2 != NULL)
 	{
 	    for(i = 0; i < lev; i++)
 		addtobuf(buf, 9);
@@ -3389,23 +3602,23 @@ static void updatehmlist(void)
 	} else {
 	    ic = 1;
 	}
-	if((node->child != NULL) && !ic)
+	if((node->child != 0) && !ic)
 	{
 	    lev++;
-	    node = node->child;
-	} else if(node->next != NULL) {
-	    node = node->next;
+	    node = scchild(node);
+	} else if(node->next != 0) {
+	    node = scnext(node);
 	} else {
-	    while(node->next == NULL)
+	    while(node->next == 0)
 	    {
 		lev--;
-		node = node->parent;
+		node = scparent(node);
 		if(node == shareroot)
 		    break;
 	    }
 	    if(node == shareroot)
 		break;
-	    node = node->next;
+	    node = scnext(node);
 	}
     }
     if(hmlistname != NULL)
@@ -3509,6 +3722,7 @@ static void updatexmllist(void)
     FILE *fs;
     char cidbuf[14], *namebuf;
     char *hashbuf;
+    wchar_t *wname;
     struct sharecache *node;
     
     if(xmllistname != NULL)
@@ -3542,18 +3756,21 @@ static void updatexmllist(void)
     else
 	fprintf(fs, "<FileListing Version=\"1\" CID=\"%s\" Base=\"/\" Generator=\"%s\">\r\n", cidbuf, "DoldaConnect" VERSION);
     
-    node = shareroot->child;
+    node = scchild(shareroot);
     lev = 0;
     while(1)
     {
-	if((namebuf = icswcstombs(escapexml(node->name), "UTF-8", NULL)) != NULL)
+	wname = scwname(node);
+	namebuf = icswcstombs(escapexml(wname), "UTF-8", NULL);
+	free(wname);
+	if(namebuf != NULL)
 	{
 	    for(i = 0; i < lev; i++)
 		fputc('\t', fs);
-	    if(node->child != NULL)
+	    if(node->child != 0)
 	    {
 		fprintf(fs, "<Directory Name=\"%s\">\r\n", namebuf);
-		node = node->child;
+		node = scchild(node);
 		lev++;
 		continue;
 	    } else {
@@ -3566,9 +3783,9 @@ static void updatexmllist(void)
 		}
 		fprintf(fs, "/>\r\n");
 	    }
-	    while(node->next == NULL)
+	    while(node->next == 0)
 	    {
-		node = node->parent;
+		node = scparent(node);
 		if(node == shareroot)
 		{
 		    break;
@@ -3581,7 +3798,7 @@ static void updatexmllist(void)
 	    }
 	    if(node == shareroot)
 		break;
-	    node = node->next;
+	    node = scnext(node);
 	}
     }
     
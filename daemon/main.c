@@ -49,12 +49,73 @@
 #endif
 
 struct module *modchain = NULL;
-static struct timer *timers = NULL;
+/* Pending timers are kept in a binary min-heap ordered by expiry
+ * time, so that the first one to expire is always timers[0]. */
+static struct timer **timers = NULL;
+static size_t timerssize = 0, timersdata = 0;
 static struct child *children = NULL;
+struct evhist evstats[EVS_NUM];
+char *evstatnames[EVS_NUM] = {
+    [EVS_READCB] = "readcb",
+    [EVS_WRITECB] = "writecb",
+    [EVS_CONNCB] = "conncb",
+    [EVS_ERRCB] = "errcb",
+    [EVS_ACCEPTCB] = "acceptcb",
+    [EVS_TIMER] = "timer",
+    [EVS_POLL] = "poll",
+    [EVS_LAG] = "lag",
+};
 volatile int running;
 volatile int reinit;
 static volatile int childrendone = 0;
 
+static void timerup(size_t i)
+{
+    struct timer *timer;
+    size_t p;
+    
+    timer = timers[i];
+    while(i > 0) {
+	p = (i - 1) / 2;
+	if(timers[p]->at <= timer->at)
+	    break;
+	(timers[i] = timers[p])->idx = i;
+	i = p;
+    }
+    (timers[i] = timer)->idx = i;
+}
+
+static void timerdown(size_t i)
+{
+    struct timer *timer;
+    size_t c;
+    
+    timer = timers[i];
+    while((c = (i * 2) + 1) < timersdata) {
+	if((c + 1 < timersdata) && (timers[c + 1]->at < timers[c]->at))
+	    c++;
+	if(timer->at <= timers[c]->at)
+	    break;
+	(timers[i] = timers[c])->idx = i;
+	i = c;
+    }
+    (timers[i] = timer)->idx = i;
+}
+
+static void unlinktimer(struct timer *timer)
+{
+    struct timer *last;
+    size_t i;
+    
+    i = timer->idx;
+    if(i < --timersdata) {
+	last = timers[timersdata];
+	(timers[i] = last)->idx = i;
+	timerdown(i);
+	timerup(last->idx);
+    }
+}
+
 struct timer *timercallback(double at, void (*func)(int, void *), void *data)
 {
     struct timer *new;
@@ -63,26 +124,34 @@ struct timer *timercallback(double at, void (*func)(int, void *), void *data)
     new->at = at;
     new->func = func;
     new->data = data;
-    new->next = timers;
-    new->prev = NULL;
-    if(timers != NULL)
-	timers->prev = new;
-    timers = new;
+    addtobuf(timers, new);
+    timerup(timersdata - 1);
     return(new);
 }
 
 void canceltimer(struct timer *timer)
 {
-    if(timer->next != NULL)
-	timer->next->prev = timer->prev;
-    if(timer->prev != NULL)
-	timer->prev->next = timer->next;
-    if(timer == timers)
-	timers = timer->next;
+    unlinktimer(timer);
     timer->func(1, timer->data);
     free(timer);
 }
 
+void evhistadd(struct evhist *hist, double dur)
+{
+    int i;
+    double us;
+    
+    if(dur < 0)
+	dur = 0;
+    hist->count++;
+    hist->total += dur;
+    if(dur > hist->max)
+	hist->max = dur;
+    us = dur * 1000000.0;
+    for(i = 0; (i < EVHISTBUCKETS - 1) && (us >= (double)(1 << i)); i++);
+    hist->buckets[i]++;
+}
+
 void childcallback(pid_t pid, void (*func)(pid_t, int, void *), void *data)
 {
     struct child *new;
@@ -530,19 +599,23 @@ int main(int argc, char **argv)
 	delay = 1000; /* -1; */
 	for(mod = modchain; mod != NULL; mod = mod->next)
 	{
-	    if(mod->run && mod->run())
-		delay = 0;
+	    if(mod->run)
+	    {
+		now = ntime();
+		if(mod->run())
+		    delay = 0;
+		evhistadd(&mod->runstat, ntime() - now);
+	    }
 	}
 	if(!running)
 	    delay = 0;
-	if(delay != 0)
+	if((delay != 0) && (timersdata > 0))
 	{
 	    now = ntime();
-	    for(timer = timers; timer != NULL; timer = timer->next)
-	    {
-		if((delay == -1) || ((int)((timer->at - now) * 1000.0) < delay))
-		    delay = (int)((timer->at - now) * 1000.0);
-	    }
+	    if((delay == -1) || ((int)((timers[0]->at - now) * 1000.0) < delay))
+		delay = (int)((timers[0]->at - now) * 1000.0);
+	    if(delay < 0)
+		delay = 0;
 	}
 	/* Of course, there's a race condition here that should be
 	 * solved with pselect, but it doesn't matter a lot. */
@@ -550,23 +623,15 @@ int main(int argc, char **argv)
 	    delay = 0;
 	pollsocks(delay);
 	now = ntime();
-	do
+	while((timersdata > 0) && (now >= timers[0]->at))
 	{
-	    for(timer = timers; timer != NULL; timer = timer->next)
-	    {
-		if(now < timer->at)
-		    continue;
-		if(timer->prev != NULL)
-		    timer->prev->next = timer->next;
-		if(timer->next != NULL)
-		    timer->next->prev = timer->prev;
-		if(timer == timers)
-		    timers = timer->next;
-		timer->func(0, timer->data);
-		free(timer);
-		break;
-	    }
-	} while(timer != NULL);
+	    timer = timers[0];
+	    unlinktimer(timer);
+	    /* The loop lag is how late timers fire. */
+	    evhistadd(&evstats[EVS_LAG], now - timer->at);
+	    evtimed(EVS_TIMER, timer->func(0, timer->data));
+	    free(timer);
+	}
 	if(childrendone)
 	{
 	    childrendone = 0;
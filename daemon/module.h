@@ -22,6 +22,7 @@
 #include <stdio.h>
 
 #include "conf.h"
+#include "sysevents.h"
 
 struct module
 {
@@ -43,6 +44,8 @@ struct module
     /* Called when the daemon is shutting down. */
     void (*terminate)(void);
     struct configmod conf;
+    /* Time spent in run, maintained by the main loop. */
+    struct evhist runstat;
 };
 
 #define MODULE(mod) \
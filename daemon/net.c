@@ -26,6 +26,10 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/ioctl.h>
+#include <sys/uio.h>
+#ifdef HAVE_SYS_SENDFILE_H
+#include <sys/sendfile.h>
+#endif
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <sys/select.h>
@@ -39,6 +43,9 @@
 #endif
 #include <errno.h>
 #include <net/if.h>
+#ifdef HAVE_EPOLL
+#include <sys/epoll.h>
+#endif
 
 #include "conf.h"
 #include "net.h"
@@ -88,6 +95,37 @@ static struct configvar myvars[] =
      * defined as the 6 uppermost bits of the TOS field, the lower two
      * being left for ECN). This may only work on Linux. */
     {CONF_VAR_BOOL, "dscp-tos", {.num = 0}},
+    /** If enabled, and if support for it was compiled in, the Linux
+     * epoll interface will be used to wait for network events instead
+     * of select(2). epoll does not need to rescan every connection on
+     * each iteration of the main loop, and is not limited to
+     * FD_SETSIZE file descriptors. This setting is only read at
+     * startup. */
+    {CONF_VAR_BOOL, "epoll", {.num = 1}},
+    /** The DNS server to send host name queries to, optionally
+     * followed by a colon and a port number (IPv6 addresses must then
+     * be enclosed in brackets). If empty, the servers listed in
+     * /etc/resolv.conf are used. */
+    {CONF_VAR_STRING, "dnsserver", {.str = L""}},
+    /** The domains, separated by spaces, to try appending to host
+     * names with fewer dots than the ndots option of
+     * /etc/resolv.conf (1 by default). If empty, the search or domain
+     * line of /etc/resolv.conf is used. A host name ending with a dot
+     * is never extended. */
+    {CONF_VAR_STRING, "dnssearch", {.str = L""}},
+    /** The number of seconds to wait for a DNS server to reply before
+     * retrying. Each server is tried twice before a lookup fails. */
+    {CONF_VAR_INT, "dnstimeout", {.num = 3}},
+    /** The maximum number of seconds to remember that a host name
+     * does not exist. */
+    {CONF_VAR_INT, "dnsnegttl", {.num = 60}},
+    /** The length of the queue of connections that have not yet been
+     * accepted on listening sockets. The system may impose a lower
+     * limit. Changes only apply to sockets created afterwards. */
+    {CONF_VAR_INT, "backlog", {.num = 128}},
+    /** The maximum number of connections accepted from a listening
+     * socket before other events are processed. */
+    {CONF_VAR_INT, "acceptbudget", {.num = 32}},
     {CONF_VAR_END}
 };
 
@@ -95,9 +133,35 @@ static struct configvar myvars[] =
 #define UFD_PIPE 1
 #define UFD_LISTEN 2
 
-struct scons {
-    struct scons *n, *p;
-    struct socket *s;
+#define UFDEV_READ 1
+#define UFDEV_WRITE 2
+#define UFDEV_ERR 4
+
+#define POLL_SELECT 0
+#define POLL_EPOLL 1
+
+/* The maximum number of events fetched by a single epoll_wait() */
+#define EPOLLBATCH 256
+
+/* The smallest allocation made for a stream buffer segment */
+#define SEGMINSIZE 4096
+/* The maximum number of segments passed to a single writev() */
+#define FLUSHIOV 64
+/* The maximum number of datagrams received or sent per wakeup */
+#define DGRAMBATCH 16
+/* The number of free datagram buffers kept for reuse */
+#define DGPOOLMAX 256
+/* The number of free ufds kept for reuse */
+#define UFDPOOLMAX 64
+
+#define BATCH_CONN 0
+#define BATCH_READ 1
+#define BATCH_WRITE 2
+
+/* Sockets are linked into the batches through their bnext pointers,
+ * so that scheduling a callback needs no allocation. */
+struct batch {
+    struct socket *f, *l;
 };
 
 struct ufd {
@@ -106,6 +170,17 @@ struct ufd {
     int type;
     int ignread;
     struct socket *sk;
+    /* Dirty ufds have had their socket state changed since the last
+     * time pollsocks() looked at them, and need to have their
+     * interest set and liveness reevaluated. Only used with epoll. */
+    struct ufd *dnext, *dprev;
+    int dirty;
+    /* The events currently registered with epoll, or, for fds that
+     * epoll refuses (such as regular files), whether the ufd is on
+     * the fileufds list. */
+    int pollev;
+    struct ufd *fnext, *fprev;
+    int noepoll;
     union {
 	struct {
 	    int family;
@@ -125,9 +200,23 @@ struct ufd {
 };
 
 static int getlocalname(int fd, struct sockaddr **namebuf, socklen_t *lenbuf);
+static void skdirty(struct socket *sk);
+static struct ufd *getskufd(struct socket *sk);
 
 static struct ufd *ufds = NULL;
-static struct scons *rbatch, *wbatch, *cbatch;
+static struct batch batches[3];
+static int pollmode = -1;
+static struct ufd *dirtyufds = NULL;
+#ifdef HAVE_EPOLL
+static int epfd = -1;
+static struct epoll_event epevs[EPOLLBATCH];
+static int epcur = 0, epcnt = 0;
+static struct ufd *fileufds = NULL, *nextfileufd = NULL;
+#endif
+static struct dgrambuf *dgpool = NULL;
+static int dgpoolsize = 0;
+static struct ufd *ufdpool = NULL;
+static int ufdpoolsize = 0;
 int numsocks = 0;
 
 /* XXX: Get autoconf for all this... */
@@ -236,6 +325,7 @@ static void sksetstate(struct socket *sk, int state)
 {
     sk->state = state;
     sk->back->state = state;
+    skdirty(sk);
 }
 
 struct socket *netsockpipe(void)
@@ -247,15 +337,66 @@ struct socket *netsockpipe(void)
     return(sk);
 }
 
+static void ufddirty(struct ufd *ufd)
+{
+    if(ufd->dirty || (pollmode == POLL_SELECT))
+	return;
+    ufd->dirty = 1;
+    ufd->dprev = NULL;
+    ufd->dnext = dirtyufds;
+    if(dirtyufds != NULL)
+	dirtyufds->dprev = ufd;
+    dirtyufds = ufd;
+}
+
+static void ufdundirty(struct ufd *ufd)
+{
+    if(!ufd->dirty)
+	return;
+    if(ufd->dnext != NULL)
+	ufd->dnext->dprev = ufd->dprev;
+    if(ufd->dprev != NULL)
+	ufd->dprev->dnext = ufd->dnext;
+    if(ufd == dirtyufds)
+	dirtyufds = ufd->dnext;
+    ufd->dirty = 0;
+}
+
+/*
+ * Marks the ufds on either side of a socket as needing their poll
+ * interest reevaluated. Anything that changes the amount of data
+ * buffered in a socket, its state or its refcount must call this.
+ */
+static void skdirty(struct socket *sk)
+{
+    if(sk->ufd != NULL)
+	ufddirty(sk->ufd);
+    if((sk->back != NULL) && (sk->back->ufd != NULL))
+	ufddirty(sk->back->ufd);
+}
+
 static void closeufd(struct ufd *ufd)
 {
+#ifdef HAVE_EPOLL
+    /* The registration must be removed explicitly, since the fd may
+     * have been dup()ed, in which case close() would not remove it. */
+    if((epfd >= 0) && !ufd->noepoll && (ufd->pollev != 0)) {
+	epoll_ctl(epfd, EPOLL_CTL_DEL, ufd->fd, NULL);
+	ufd->pollev = 0;
+    }
+#endif
     if(ufd->fd != -1)
 	close(ufd->fd);
     ufd->fd = -1;
+    ufddirty(ufd);
 }
 
 static void freeufd(struct ufd *ufd)
 {
+#ifdef HAVE_EPOLL
+    int i;
+#endif
+    
     if(ufd->next != NULL)
 	ufd->next->prev = ufd->prev;
     if(ufd->prev != NULL)
@@ -263,20 +404,52 @@ static void freeufd(struct ufd *ufd)
     if(ufd == ufds)
 	ufds = ufd->next;
     closeufd(ufd);
-    if(ufd->sk != NULL)
+    ufdundirty(ufd);
+#ifdef HAVE_EPOLL
+    if(ufd->noepoll) {
+	if(ufd == nextfileufd)
+	    nextfileufd = ufd->fnext;
+	if(ufd->fnext != NULL)
+	    ufd->fnext->fprev = ufd->fprev;
+	if(ufd->fprev != NULL)
+	    ufd->fprev->fnext = ufd->fnext;
+	if(ufd == fileufds)
+	    fileufds = ufd->fnext;
+    }
+    /* Don't let pollsocks() dispatch events to a freed ufd. */
+    for(i = epcur + 1; i < epcnt; i++) {
+	if(epevs[i].data.ptr == ufd)
+	    epevs[i].data.ptr = NULL;
+    }
+#endif
+    if(ufd->sk != NULL) {
+	ufd->sk->ufd = NULL;
 	putsock(ufd->sk);
+    }
     if(ufd->type == UFD_SOCK) {
 	if(ufd->d.s.remote != NULL)
 	    free(ufd->d.s.remote);
     }
-    free(ufd);
+    if(ufdpoolsize < UFDPOOLMAX) {
+	ufd->next = ufdpool;
+	ufdpool = ufd;
+	ufdpoolsize++;
+    } else {
+	free(ufd);
+    }
 }
 
 static struct ufd *mkufd(int fd, int type, struct socket *sk)
 {
     struct ufd *ufd;
     
-    ufd = memset(smalloc(sizeof(*ufd)), 0, sizeof(*ufd));
+    if((ufd = ufdpool) != NULL) {
+	ufdpool = ufd->next;
+	ufdpoolsize--;
+    } else {
+	ufd = smalloc(sizeof(*ufd));
+    }
+    memset(ufd, 0, sizeof(*ufd));
     ufd->fd = fd;
     ufd->type = type;
     if(sk != NULL) {
@@ -291,6 +464,7 @@ static struct ufd *mkufd(int fd, int type, struct socket *sk)
     if(ufds)
 	ufds->prev = ufd;
     ufds = ufd;
+    ufddirty(ufd);
     return(ufd);
 }
 
@@ -392,6 +566,223 @@ void socksetdebug(struct socket *sk, int level, char *nm, ...)
     sockdebug(1, sk, "enabled debugging");
 }
 
+static struct sockbufseg *newseg(size_t size)
+{
+    struct sockbufseg *seg;
+    
+    if(size < SEGMINSIZE)
+	size = SEGMINSIZE;
+    seg = smalloc(sizeof(*seg));
+    seg->next = NULL;
+    seg->buf = smalloc(seg->size = size);
+    seg->off = seg->len = 0;
+    seg->file = NULL;
+    seg->foff = 0;
+    return(seg);
+}
+
+static void freeseg(struct sockbufseg *seg)
+{
+    if(seg->file != NULL)
+	putsockfile(seg->file);
+    if(seg->buf != NULL)
+	free(seg->buf);
+    free(seg);
+}
+
+struct sockfile *newsockfile(int fd)
+{
+    struct sockfile *file;
+    
+    file = smalloc(sizeof(*file));
+    file->fd = fd;
+    file->refcount = 1;
+    return(file);
+}
+
+void getsockfile(struct sockfile *file)
+{
+    file->refcount++;
+}
+
+void putsockfile(struct sockfile *file)
+{
+    if(--file->refcount)
+	return;
+    close(file->fd);
+    free(file);
+}
+
+/*
+ * Turns a file segment into an ordinary one by reading its data into
+ * memory.
+ */
+static int segload(struct sockbufseg *seg)
+{
+    char *buf;
+    size_t got;
+    ssize_t ret;
+    
+    buf = smalloc(seg->len);
+    for(got = 0; got < seg->len; got += ret) {
+	if((ret = pread(seg->file->fd, buf + got, seg->len - got, seg->foff + got)) <= 0) {
+	    if(ret == 0)
+		errno = EIO;
+	    free(buf);
+	    return(-1);
+	}
+    }
+    putsockfile(seg->file);
+    seg->file = NULL;
+    seg->buf = buf;
+    seg->off = 0;
+    seg->size = seg->len;
+    return(0);
+}
+
+/*
+ * Reads up to max bytes from the file segment at the front of a
+ * stream socket's buffer into a new ordinary segment in front of it.
+ */
+static int segloadfront(struct socket *sk, size_t max)
+{
+    struct sockbufseg *seg, *nseg;
+    ssize_t ret;
+    
+    seg = sk->buf.s.f;
+    if(max > seg->len)
+	max = seg->len;
+    nseg = newseg(max);
+    if((ret = pread(seg->file->fd, nseg->buf, max, seg->foff)) <= 0) {
+	if(ret == 0)
+	    errno = EIO;
+	freeseg(nseg);
+	return(-1);
+    }
+    nseg->len = ret;
+    seg->foff += ret;
+    if((seg->len -= ret) == 0) {
+	nseg->next = seg->next;
+	if(sk->buf.s.l == seg)
+	    sk->buf.s.l = nseg;
+	freeseg(seg);
+    } else {
+	nseg->next = seg;
+    }
+    sk->buf.s.f = nseg;
+    return(0);
+}
+
+/*
+ * Reads all file data queued in a stream socket into memory. Data
+ * that cannot be read is dropped.
+ */
+static void loadsegs(struct socket *sk)
+{
+    struct sockbufseg *seg, **prev;
+    
+    sk->buf.s.l = NULL;
+    for(prev = &sk->buf.s.f; (seg = *prev) != NULL; ) {
+	if((seg->file != NULL) && segload(seg)) {
+	    flog(LOG_WARNING, "could not read queued file data: %s", strerror(errno));
+	    sk->buf.s.datasize -= seg->len;
+	    *prev = seg->next;
+	    freeseg(seg);
+	    continue;
+	}
+	sk->buf.s.l = seg;
+	prev = &seg->next;
+    }
+}
+
+/*
+ * Extends the last segment of a stream socket's buffer with len
+ * bytes of file data, if it ends right where that data begins.
+ */
+static int segmerge(struct socket *sk, struct sockfile *file, off_t off, size_t len)
+{
+    struct sockbufseg *seg;
+    
+    if(((seg = sk->buf.s.l) == NULL) || (seg->file != file) || (seg->foff + seg->len != off))
+	return(0);
+    seg->len += len;
+    sk->buf.s.datasize += len;
+    return(1);
+}
+
+static void seglink(struct socket *sk, struct sockbufseg *seg)
+{
+    seg->next = NULL;
+    if(sk->buf.s.l == NULL)
+	sk->buf.s.f = seg;
+    else
+	sk->buf.s.l->next = seg;
+    sk->buf.s.l = seg;
+    sk->buf.s.datasize += seg->len;
+}
+
+static void freesegs(struct socket *sk)
+{
+    struct sockbufseg *seg;
+    
+    while((seg = sk->buf.s.f) != NULL) {
+	sk->buf.s.f = seg->next;
+	freeseg(seg);
+    }
+    sk->buf.s.l = NULL;
+    sk->buf.s.datasize = 0;
+}
+
+/*
+ * Appends data to the end of a stream socket's buffer, filling up
+ * whatever space is left in the last segment before allocating a new
+ * one, so that nothing already queued ever needs to be moved.
+ */
+static void segappend(struct socket *sk, void *data, size_t size)
+{
+    struct sockbufseg *seg;
+    size_t room;
+    
+    if(((seg = sk->buf.s.l) != NULL) && (seg->file == NULL)) {
+	room = seg->size - seg->off - seg->len;
+	if(room > size)
+	    room = size;
+	memcpy(seg->buf + seg->off + seg->len, data, room);
+	seg->len += room;
+	sk->buf.s.datasize += room;
+	data = ((char *)data) + room;
+	size -= room;
+    }
+    if(size == 0)
+	return;
+    seg = newseg(size);
+    memcpy(seg->buf, data, seg->len = size);
+    seglink(sk, seg);
+}
+
+/* Discards size bytes from the front of a stream socket's buffer. */
+static void segconsume(struct socket *sk, size_t size)
+{
+    struct sockbufseg *seg;
+    
+    while((size > 0) && ((seg = sk->buf.s.f) != NULL)) {
+	if(size < seg->len) {
+	    if(seg->file != NULL)
+		seg->foff += size;
+	    else
+		seg->off += size;
+	    seg->len -= size;
+	    sk->buf.s.datasize -= size;
+	    return;
+	}
+	size -= seg->len;
+	sk->buf.s.datasize -= seg->len;
+	if((sk->buf.s.f = seg->next) == NULL)
+	    sk->buf.s.l = NULL;
+	freeseg(seg);
+    }
+}
+
 static void freesock(struct socket *sk)
 {
     struct dgrambuf *buf;
@@ -403,8 +794,7 @@ static void freesock(struct socket *sk)
 	    freedgbuf(buf);
 	}
     } else {
-	if(sk->buf.s.buf != NULL)
-	    free(sk->buf.s.buf);
+	freesegs(sk);
     }
     if(sk->dbgnm != NULL)
 	free(sk->dbgnm);
@@ -420,6 +810,7 @@ void putsock(struct socket *sk)
 	flog(LOG_CRIT, "BUG: socket refcount < 0");
 	abort();
     }
+    skdirty(sk);
     if((sk->refcount == 0) && (sk->back->refcount == 0)) {
 	back = sk->back;
 	freesock(sk);
@@ -435,35 +826,74 @@ void quitsock(struct socket *sk)
     putsock(sk);
 }
 
-static void linksock(struct scons **list, struct socket *sk)
+static void linksock(int batch, struct socket *sk)
 {
-    struct scons *sc;
+    struct batch *b;
     
-    for(sc = *list; sc != NULL; sc = sc->n) {
-	if(sc->s == sk)
-	    return;
-    }
-    sc = smalloc(sizeof(*sc));
-    getsock(sc->s = sk);
-    sc->n = *list;
-    sc->p = NULL;
-    if(*list)
-	(*list)->p = sc;
-    *list = sc;
+    skdirty(sk);
+    if(sk->batches & (1 << batch))
+	return;
+    sk->batches |= 1 << batch;
+    getsock(sk);
+    sk->bnext[batch] = NULL;
+    b = &batches[batch];
+    if(b->l == NULL)
+	b->f = sk;
+    else
+	b->l->bnext[batch] = sk;
+    b->l = sk;
+}
+
+/*
+ * Detaches the given batch, so that sockets linked into it while it
+ * is being run are saved for the next run. Each socket must be passed
+ * to nextbatched() in turn.
+ */
+static struct socket *takebatch(int batch)
+{
+    struct socket *sk;
+    
+    sk = batches[batch].f;
+    batches[batch].f = batches[batch].l = NULL;
+    return(sk);
+}
+
+static struct socket *nextbatched(int batch, struct socket *sk)
+{
+    struct socket *next;
+    
+    next = sk->bnext[batch];
+    sk->bnext[batch] = NULL;
+    sk->batches &= ~(1 << batch);
+    return(next);
 }
 
 void sockpushdata(struct socket *sk, void *buf, size_t size)
 {
+    struct sockbufseg *seg;
+    
     if(size == 0)
 	return;
     if(sk->dgram) {
 	/* XXX */
     } else {
-	sizebuf(&sk->buf.s.buf, &sk->buf.s.bufsize, sk->buf.s.datasize + size, 1, 1);
-	memmove(sk->buf.s.buf + size, sk->buf.s.buf, sk->buf.s.datasize);
-	memcpy(sk->buf.s.buf, buf, size);
-	sk->buf.s.datasize += size;
-	linksock(&rbatch, sk);
+	if((seg = sk->buf.s.f) == NULL) {
+	    segappend(sk, buf, size);
+	} else {
+	    if((seg->file != NULL) || (seg->off < size)) {
+		/* Put the data at the end of the new segment, so that
+		 * further pushes can use the space before it. */
+		seg = newseg(size);
+		seg->off = seg->size;
+		seg->next = sk->buf.s.f;
+		sk->buf.s.f = seg;
+	    }
+	    seg->off -= size;
+	    seg->len += size;
+	    memcpy(seg->buf + seg->off, buf, size);
+	    sk->buf.s.datasize += size;
+	}
+	linksock(BATCH_READ, sk);
     }
 }
 
@@ -471,17 +901,41 @@ void sockpushdata(struct socket *sk, void *buf, size_t size)
 void sockread(struct socket *sk)
 {
     if((sockgetdatalen(sk) == 0) && (sk->eos == 1))
-	linksock(&rbatch, sk);
-    linksock(&wbatch, sk->back);
+	linksock(BATCH_READ, sk);
+    linksock(BATCH_WRITE, sk->back);
+}
+
+struct dgrambuf *newdgbuf(void)
+{
+    struct dgrambuf *dg;
+    
+    if((dg = dgpool) != NULL) {
+	dgpool = dg->next;
+	dgpoolsize--;
+    } else {
+	dg = smalloc(sizeof(*dg));
+    }
+    dg->next = NULL;
+    dg->addr = NULL;
+    dg->addrlen = 0;
+    dg->data = NULL;
+    dg->size = 0;
+    return(dg);
 }
 
 void freedgbuf(struct dgrambuf *dg)
 {
     if(dg->data != NULL)
 	free(dg->data);
-    if(dg->addr != NULL)
+    if((dg->addr != NULL) && (dg->addr != (struct sockaddr *)&dg->addrbuf))
 	free(dg->addr);
-    free(dg);
+    if(dgpoolsize < DGPOOLMAX) {
+	dg->next = dgpool;
+	dgpool = dg;
+	dgpoolsize++;
+    } else {
+	free(dg);
+    }
 }
 
 struct dgrambuf *sockgetdgbuf(struct socket *sk)
@@ -502,24 +956,44 @@ void *sockgetinbuf(struct socket *sk, size_t *size)
 {
     void *buf;
     struct dgrambuf *dbuf;
+    struct sockbufseg *seg;
+    size_t len;
     
     if(sk->dgram) {
 	dbuf = sockgetdgbuf(sk);
 	buf = dbuf->data;
 	*size = dbuf->size;
-	free(dbuf->addr);
-	free(dbuf);
+	dbuf->data = NULL;
+	freedgbuf(dbuf);
     } else {
-	if((sk->buf.s.buf == NULL) || (sk->buf.s.datasize == 0))
+	loadsegs(sk);
+	if((sk->buf.s.f == NULL) || (sk->buf.s.datasize == 0))
 	{
 	    *size = 0;
 	    sockdebug(2, sk, "read 0 bytes", *size);
 	    return(NULL);
 	}
-	buf = sk->buf.s.buf;
-	*size = sk->buf.s.datasize;
-	sk->buf.s.buf = NULL;
-	sk->buf.s.bufsize = sk->buf.s.datasize = 0;
+	/* Hand out the first segment's buffer, extended with the
+	 * contents of the rest, if any. */
+	seg = sk->buf.s.f;
+	sk->buf.s.f = seg->next;
+	if(seg->off > 0)
+	    memmove(seg->buf, seg->buf + seg->off, seg->len);
+	buf = seg->buf;
+	len = seg->len;
+	free(seg);
+	if(sk->buf.s.f != NULL) {
+	    buf = srealloc(buf, sk->buf.s.datasize);
+	    while((seg = sk->buf.s.f) != NULL) {
+		memcpy(((char *)buf) + len, seg->buf + seg->off, seg->len);
+		len += seg->len;
+		sk->buf.s.f = seg->next;
+		freeseg(seg);
+	    }
+	}
+	*size = len;
+	sk->buf.s.l = NULL;
+	sk->buf.s.datasize = 0;
 	sockread(sk);
     }
     sockdebug(2, sk, "read %zi bytes", *size);
@@ -529,8 +1003,7 @@ void *sockgetinbuf(struct socket *sk, size_t *size)
 void sockqueue(struct socket *sk, void *data, size_t size)
 {
     struct dgrambuf *new;
-    struct sockaddr *remote;
-    socklen_t remotelen;
+    struct ufd *ufd;
     
     sockdebug(2, sk, "queued %zi bytes", size);
     if(size == 0)
@@ -538,13 +1011,11 @@ void sockqueue(struct socket *sk, void *data, size_t size)
     if(sk->state == SOCK_STL)
 	return;
     if(sk->dgram) {
-	if(sockpeeraddr(sk, &remote, &remotelen))
+	if(((ufd = getskufd(sk)) == NULL) || (ufd->type != UFD_SOCK) || (ufd->d.s.remote == NULL))
 	    return;
-	new = smalloc(sizeof(*new));
-	new->next = NULL;
+	new = newdgbuf();
 	memcpy(new->data = smalloc(size), data, new->size = size);
-	new->addr = remote;
-	new->addrlen = remotelen;
+	memcpy(new->addr = (struct sockaddr *)&new->addrbuf, ufd->d.s.remote, new->addrlen = ufd->d.s.remotelen);
 	if(sk->back->buf.d.l == NULL)
 	{
 	    sk->back->buf.d.l = sk->back->buf.d.f = new;
@@ -553,11 +1024,102 @@ void sockqueue(struct socket *sk, void *data, size_t size)
 	    sk->back->buf.d.l = new;
 	}
     } else {
-	sizebuf(&(sk->back->buf.s.buf), &(sk->back->buf.s.bufsize), sk->back->buf.s.datasize + size, 1, 1);
-	memcpy(sk->back->buf.s.buf + sk->back->buf.s.datasize, data, size);
-	sk->back->buf.s.datasize += size;
+	segappend(sk->back, data, size);
+    }
+    linksock(BATCH_READ, sk->back);
+}
+
+/*
+ * Like sockqueue, but takes over buf, which must have been allocated
+ * with malloc, instead of copying it. Small buffers are still copied,
+ * so that they can be coalesced.
+ */
+void sockqueuebuf(struct socket *sk, void *buf, size_t size)
+{
+    struct sockbufseg *seg;
+    
+    if(sk->dgram || (size < SEGMINSIZE) || (sk->state == SOCK_STL)) {
+	sockqueue(sk, buf, size);
+	free(buf);
+	return;
+    }
+    sockdebug(2, sk, "queued %zi bytes", size);
+    seg = smalloc(sizeof(*seg));
+    seg->buf = buf;
+    seg->off = 0;
+    seg->len = seg->size = size;
+    seg->file = NULL;
+    seg->foff = 0;
+    seglink(sk->back, seg);
+    linksock(BATCH_READ, sk->back);
+}
+
+/*
+ * Queues len bytes of a file, starting at off, without reading them
+ * into memory. When the data is flushed to a file descriptor, it is
+ * sent with sendfile(2) where possible.
+ */
+void sockqueuefile(struct socket *sk, struct sockfile *file, off_t off, size_t len)
+{
+    struct sockbufseg *seg;
+    
+    sockdebug(2, sk, "queued %zi bytes from file", len);
+    if(len == 0)
+	return;
+    if(sk->state == SOCK_STL)
+	return;
+    if(sk->dgram) {
+	flog(LOG_ERR, "BUG: sockqueuefile called on dgram socket");
+	return;
+    }
+    if(!segmerge(sk->back, file, off, len)) {
+	seg = smalloc(sizeof(*seg));
+	seg->buf = NULL;
+	seg->off = seg->size = 0;
+	getsockfile(seg->file = file);
+	seg->foff = off;
+	seg->len = len;
+	seglink(sk->back, seg);
+    }
+    linksock(BATCH_READ, sk->back);
+}
+
+/*
+ * Moves all data that can be read from one socket to the output
+ * queue of another. For stream sockets, this is done without copying
+ * the data.
+ */
+void sockpassdata(struct socket *from, struct socket *to)
+{
+    struct sockbufseg *seg;
+    void *buf;
+    size_t size;
+    
+    if(from->dgram || to->dgram) {
+	if((buf = sockgetinbuf(from, &size)) != NULL) {
+	    sockqueue(to, buf, size);
+	    free(buf);
+	}
+	return;
+    }
+    if(from->buf.s.f == NULL)
+	return;
+    sockdebug(2, from, "passed %zi bytes", from->buf.s.datasize);
+    if(to->state == SOCK_STL) {
+	freesegs(from);
+    } else {
+	while((seg = from->buf.s.f) != NULL) {
+	    from->buf.s.f = seg->next;
+	    if((seg->file != NULL) && segmerge(to->back, seg->file, seg->foff, seg->len))
+		freeseg(seg);
+	    else
+		seglink(to->back, seg);
+	}
+	from->buf.s.l = NULL;
+	from->buf.s.datasize = 0;
+	linksock(BATCH_READ, to->back);
     }
-    linksock(&rbatch, sk->back);
+    sockread(from);
 }
 
 void sockqueuedg(struct socket *sk, struct dgrambuf *dg)
@@ -579,14 +1141,14 @@ void sockqueuedg(struct socket *sk, struct dgrambuf *dg)
 	sk->back->buf.d.l->next = dg;
 	sk->back->buf.d.l = dg;
     }
-    linksock(&rbatch, sk->back);
+    linksock(BATCH_READ, sk->back);
 }
 
 void sockerror(struct socket *sk, int en)
 {
     sksetstate(sk, SOCK_STL);
     if(sk->back->errcb != NULL)
-	sk->back->errcb(sk->back, en, sk->back->data);
+	evtimed(EVS_ERRCB, sk->back->errcb(sk->back, en, sk->back->data));
 }
 
 static void recvcmsg(struct ufd *ufd, struct msghdr *msg)
@@ -633,11 +1195,120 @@ static int ufddgram(struct ufd *ufd)
     return(dgram);
 }
 
+#ifdef HAVE_MMSG
+/*
+ * Receives as many datagrams as are pending, up to DGRAMBATCH, with a
+ * single recvmmsg() call. The packets are received into static
+ * buffers and copied into exactly sized ones, since most datagrams
+ * are far smaller than the largest possible one.
+ */
+static void sockrecvmmsg(struct ufd *ufd)
+{
+    static char *bufs[DGRAMBATCH];
+    static char cbufs[DGRAMBATCH][256];
+    struct mmsghdr msgs[DGRAMBATCH];
+    struct iovec iov[DGRAMBATCH];
+    struct dgrambuf *dbufs[DGRAMBATCH];
+    int i, ret;
+    
+    memset(msgs, 0, sizeof(msgs));
+    for(i = 0; i < DGRAMBATCH; i++) {
+	if(bufs[i] == NULL)
+	    bufs[i] = smalloc(65536);
+	dbufs[i] = newdgbuf();
+	iov[i].iov_base = bufs[i];
+	iov[i].iov_len = 65536;
+	msgs[i].msg_hdr.msg_iov = &iov[i];
+	msgs[i].msg_hdr.msg_iovlen = 1;
+	msgs[i].msg_hdr.msg_name = &dbufs[i]->addrbuf;
+	msgs[i].msg_hdr.msg_namelen = sizeof(dbufs[i]->addrbuf);
+	msgs[i].msg_hdr.msg_control = cbufs[i];
+	msgs[i].msg_hdr.msg_controllen = sizeof(cbufs[i]);
+    }
+    ret = recvmmsg(ufd->fd, msgs, DGRAMBATCH, MSG_DONTWAIT, NULL);
+    if(ret < 0)
+    {
+	for(i = 0; i < DGRAMBATCH; i++)
+	    freedgbuf(dbufs[i]);
+	if((errno == EINTR) || (errno == EAGAIN))
+	    return;
+	closeufd(ufd);
+	sockerror(ufd->sk, errno);
+	return;
+    }
+    for(i = 0; i < ret; i++) {
+	if(msgs[i].msg_hdr.msg_flags & MSG_CTRUNC)
+	    flog(LOG_DEBUG, "ancillary data was truncated");
+	else
+	    recvcmsg(ufd, &msgs[i].msg_hdr);
+	/* See sockrecv() about empty packets. */
+	if(msgs[i].msg_len == 0)
+	{
+	    if((ufd->type != UFD_SOCK) || !((ufd->d.s.family == AF_INET) || (ufd->d.s.family == AF_INET6)))
+	    {
+		for(; i < DGRAMBATCH; i++)
+		    freedgbuf(dbufs[i]);
+		closesock(ufd->sk);
+		closeufd(ufd);
+		return;
+	    }
+	    freedgbuf(dbufs[i]);
+	    continue;
+	}
+	dbufs[i]->addr = (struct sockaddr *)&dbufs[i]->addrbuf;
+	dbufs[i]->addrlen = msgs[i].msg_hdr.msg_namelen;
+	memcpy(dbufs[i]->data = smalloc(msgs[i].msg_len), bufs[i], dbufs[i]->size = msgs[i].msg_len);
+	sockqueuedg(ufd->sk, dbufs[i]);
+    }
+    for(; i < DGRAMBATCH; i++)
+	freedgbuf(dbufs[i]);
+}
+
+/*
+ * Sends up to DGRAMBATCH queued datagrams with a single sendmmsg()
+ * call. As with sendto() before it, a datagram that cannot be sent
+ * for any other reason than a full send buffer is dropped.
+ */
+static void sockflushmmsg(struct ufd *ufd)
+{
+    struct mmsghdr msgs[DGRAMBATCH];
+    struct iovec iov[DGRAMBATCH];
+    struct dgrambuf *dbuf;
+    int n, ret;
+    
+    memset(msgs, 0, sizeof(msgs));
+    for(n = 0, dbuf = ufd->sk->buf.d.f; (n < DGRAMBATCH) && (dbuf != NULL); n++, dbuf = dbuf->next) {
+	iov[n].iov_base = dbuf->data;
+	iov[n].iov_len = dbuf->size;
+	msgs[n].msg_hdr.msg_iov = &iov[n];
+	msgs[n].msg_hdr.msg_iovlen = 1;
+	msgs[n].msg_hdr.msg_name = dbuf->addr;
+	msgs[n].msg_hdr.msg_namelen = dbuf->addrlen;
+    }
+    if(n == 0)
+	return;
+    if((ret = sendmmsg(ufd->fd, msgs, n, MSG_DONTWAIT | MSG_NOSIGNAL)) < 0) {
+	if((errno == EINTR) || (errno == EAGAIN))
+	    return;
+	ret = 1;
+    }
+    for(; ret > 0; ret--) {
+	dbuf = ufd->sk->buf.d.f;
+	if((ufd->sk->buf.d.f = dbuf->next) == NULL)
+	    ufd->sk->buf.d.l = NULL;
+	freedgbuf(dbuf);
+    }
+    sockread(ufd->sk);
+}
+#endif
+
 static void sockrecv(struct ufd *ufd)
 {
     int ret, inq;
     int dgram;
+#ifndef HAVE_MMSG
     struct dgrambuf *dbuf;
+#endif
     struct msghdr msg;
     char cbuf[65536];
     struct iovec bufvec;
@@ -651,6 +1322,9 @@ static void sockrecv(struct ufd *ufd)
     if((dgram = ufddgram(ufd)) < 0)
 	return;
     if(dgram) {
+#ifdef HAVE_MMSG
+	sockrecvmmsg(ufd);
+#else
 #if defined(HAVE_LINUX_SOCKIOS_H) && defined(SIOCINQ)
 	if(ioctl(ufd->fd, SIOCINQ, &inq))
 	{
@@ -662,9 +1336,10 @@ static void sockrecv(struct ufd *ufd)
 #else
 	inq = 65536;
 #endif
-	dbuf = smalloc(sizeof(*dbuf));
+	dbuf = newdgbuf();
 	dbuf->data = smalloc(inq);
-	dbuf->addr = smalloc(dbuf->addrlen = sizeof(struct sockaddr_storage));
+	dbuf->addr = (struct sockaddr *)&dbuf->addrbuf;
+	dbuf->addrlen = sizeof(dbuf->addrbuf);
 	msg.msg_name = dbuf->addr;
 	msg.msg_namelen = dbuf->addrlen;
 	bufvec.iov_base = dbuf->data;
@@ -698,10 +1373,9 @@ static void sockrecv(struct ufd *ufd)
 	    }
 	    return;
 	}
-	dbuf->addr = srealloc(dbuf->addr, dbuf->addrlen);
 	dbuf->data = srealloc(dbuf->data, dbuf->size = ret);
-	dbuf->next = NULL;
 	sockqueuedg(ufd->sk, dbuf);
+#endif
     } else {
 #if defined(HAVE_LINUX_SOCKIOS_H) && defined(SIOCINQ)
 	/* SIOCINQ is Linux-specific AFAIK, but I really have no idea
@@ -723,9 +1397,8 @@ static void sockrecv(struct ufd *ufd)
 #endif
 	if(inq > 65536)
 	    inq = 65536;
-	/* This part could be optimized by telling the kernel to read
-	 * directly into ufd->sk->back->buf, but that would be uglier
-	 * by not using the socket function interface. */
+	/* The buffer is handed over to the socket as it is, so that
+	 * the data need not be copied again. */
 	buf = smalloc(inq);
 	if(ufd->type == UFD_SOCK)
 	{
@@ -757,34 +1430,78 @@ static void sockrecv(struct ufd *ufd)
 	    closesock(ufd->sk);
 	    return;
 	}
-	sockqueue(ufd->sk, buf, ret);
-	free(buf);
+	if(ret < inq)
+	    buf = srealloc(buf, ret);
+	sockqueuebuf(ufd->sk, buf, ret);
     }
 }
 
 static int sockflush(struct ufd *ufd)
 {
-    int ret;
+    int ret, n;
+#ifndef HAVE_MMSG
     struct dgrambuf *dbuf;
+#endif
+    struct sockbufseg *seg;
+    struct iovec iov[FLUSHIOV];
+    struct msghdr msg;
     int dgram;
+#ifdef HAVE_SYS_SENDFILE_H
+    off_t off;
+#endif
     
     if((dgram = ufddgram(ufd)) < 0) {
 	errno = EBADFD;
 	return(-1);
     }
     if(dgram) {
+#ifdef HAVE_MMSG
+	sockflushmmsg(ufd);
+#else
 	dbuf = sockgetdgbuf(ufd->sk);
 	sendto(ufd->fd, dbuf->data, dbuf->size, MSG_DONTWAIT | MSG_NOSIGNAL, dbuf->addr, dbuf->addrlen);
 	freedgbuf(dbuf);
+#endif
     } else {
-	if(ufd->type == UFD_SOCK)
-	    ret = send(ufd->fd, ufd->sk->buf.s.buf, ufd->sk->buf.s.datasize, MSG_DONTWAIT | MSG_NOSIGNAL);
-	else
-	    ret = write(ufd->fd, ufd->sk->buf.s.buf, ufd->sk->buf.s.datasize);
+	if(((seg = ufd->sk->buf.s.f) != NULL) && (seg->file != NULL)) {
+#ifdef HAVE_SYS_SENDFILE_H
+	    off = seg->foff;
+	    if((ret = sendfile(ufd->fd, seg->file->fd, &off, seg->len)) > 0) {
+		segconsume(ufd->sk, ret);
+		sockread(ufd->sk);
+		return(0);
+	    }
+	    if(ret == 0) {
+		/* The file must have been truncated after its data was
+		 * queued, which leaves no way to send what was promised. */
+		errno = EIO;
+		return(-1);
+	    }
+	    if(errno == EAGAIN)
+		return(0);
+	    if((errno != EINVAL) && (errno != ENOSYS))
+		return(-1);
+#endif
+	    /* Fall back to ordinary writes for the file data. */
+	    if(segloadfront(ufd->sk, 65536))
+		return(-1);
+	}
+	for(n = 0, seg = ufd->sk->buf.s.f; (seg != NULL) && (seg->file == NULL) && (n < FLUSHIOV); seg = seg->next, n++) {
+	    iov[n].iov_base = seg->buf + seg->off;
+	    iov[n].iov_len = seg->len;
+	}
+	if(ufd->type == UFD_SOCK) {
+	    memset(&msg, 0, sizeof(msg));
+	    msg.msg_iov = iov;
+	    msg.msg_iovlen = n;
+	    ret = sendmsg(ufd->fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+	} else {
+	    ret = writev(ufd->fd, iov, n);
+	}
 	if(ret < 0)
 	    return(-1);
 	if(ret > 0) {
-	    memmove(ufd->sk->buf.s.buf, ((char *)ufd->sk->buf.s.buf) + ret, ufd->sk->buf.s.datasize -= ret);
+	    segconsume(ufd->sk, ret);
 	    sockread(ufd->sk);
 	}
     }
@@ -797,7 +1514,7 @@ void closesock(struct socket *sk)
     sksetstate(sk, SOCK_STL);
     if(sk->back->eos == 0)
 	sk->back->eos = 1;
-    linksock(&rbatch, sk->back);
+    linksock(BATCH_READ, sk->back);
 }
 
 size_t sockgetdatalen(struct socket *sk)
@@ -896,6 +1613,8 @@ struct lport *netcslistenlocal(int type, struct sockaddr *name, socklen_t namele
      */
     if((fd = socket(name->sa_family, type, 0)) < 0)
 	return(NULL);
+    /* Pending connections are accepted until accept() would block. */
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
     if(confgetint("net", "reuseaddr")) {
 	intbuf = 1;
 	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &intbuf, sizeof(intbuf));
@@ -909,7 +1628,7 @@ struct lport *netcslistenlocal(int type, struct sockaddr *name, socklen_t namele
 	freeufd(ufd);
 	return(NULL);
     }
-    if(listen(fd, 16) < 0)
+    if(listen(fd, confgetint("net", "backlog")) < 0)
     {
 	freeufd(ufd);
 	return(NULL);
@@ -977,6 +1696,8 @@ struct socket *netcsdgram(struct sockaddr *name, socklen_t namelen)
 	    return(NULL);
 	}
 	sksetstate(sk, SOCK_EST);
+	getsock(sk->back);
+	putsock(sk);
 	return(sk->back);
     }
     errno = EOPNOTSUPP;
@@ -1012,7 +1733,7 @@ struct socket *netcsconn(struct sockaddr *addr, socklen_t addrlen, void (*func)(
 	if(!connect(sk->ufd->fd, addr, addrlen))
 	{
 	    sksetstate(sk, SOCK_EST);
-	    linksock(&cbatch, sk->back);
+	    linksock(BATCH_CONN, sk->back);
 	    return(sk->back);
 	}
 	if(errno == EINPROGRESS)
@@ -1047,74 +1768,191 @@ static void acceptunix(struct ufd *ufd)
 
 static void runbatches(void)
 {
-    struct scons *sc, *nsc;
-
-    for(sc = cbatch, cbatch = NULL; sc; sc = nsc) {
-	nsc = sc->n;
-	if(sc->s->conncb != NULL)
-	    sc->s->conncb(sc->s, 0, sc->s->data);
-	putsock(sc->s);
-	free(sc);
-    }
-    for(sc = rbatch, rbatch = NULL; sc; sc = nsc) {
-	nsc = sc->n;
-	if(sc->s->readcb != NULL)
-	    sc->s->readcb(sc->s, sc->s->data);
-	if((sockgetdatalen(sc->s) == 0) && (sc->s->eos == 1)) {
-	    if(sc->s->errcb != NULL)
-		sc->s->errcb(sc->s, 0, sc->s->data);
-	    sc->s->eos = 2;
+    struct socket *sk, *nsk;
+
+    for(sk = takebatch(BATCH_CONN); sk; sk = nsk) {
+	nsk = nextbatched(BATCH_CONN, sk);
+	if(sk->conncb != NULL)
+	    evtimed(EVS_CONNCB, sk->conncb(sk, 0, sk->data));
+	putsock(sk);
+    }
+    for(sk = takebatch(BATCH_READ); sk; sk = nsk) {
+	nsk = nextbatched(BATCH_READ, sk);
+	if(sk->readcb != NULL)
+	    evtimed(EVS_READCB, sk->readcb(sk, sk->data));
+	if((sockgetdatalen(sk) == 0) && (sk->eos == 1)) {
+	    if(sk->errcb != NULL)
+		evtimed(EVS_ERRCB, sk->errcb(sk, 0, sk->data));
+	    sk->eos = 2;
 	}
-	putsock(sc->s);
-	free(sc);
+	putsock(sk);
     }
-    for(sc = wbatch, wbatch = NULL; sc; sc = nsc) {
-	nsc = sc->n;
-	if(sc->s->writecb != NULL)
-	    sc->s->writecb(sc->s, sc->s->data);
-	putsock(sc->s);
-	free(sc);
+    for(sk = takebatch(BATCH_WRITE); sk; sk = nsk) {
+	nsk = nextbatched(BATCH_WRITE, sk);
+	if(sk->writecb != NULL)
+	    evtimed(EVS_WRITECB, sk->writecb(sk, sk->data));
+	putsock(sk);
     }
 }
 
-static void cleansocks(void)
+static int batchespending(void)
+{
+    return((batches[BATCH_CONN].f != NULL) || (batches[BATCH_READ].f != NULL) || (batches[BATCH_WRITE].f != NULL));
+}
+
+/* Returns non-zero if the ufd was freed. */
+static int cleanufd(struct ufd *ufd)
 {
-    struct ufd *ufd, *next;
     int dead;
     
-    for(ufd = ufds; ufd != NULL; ufd = next) {
-	next = ufd->next;
-	if(ufd->sk) {
-	    dead = (ufd->fd < 0);
-	    if(ufd->sk->state == SOCK_STL)
-		dead = 1;
-	    if((ufd->sk->state == SOCK_EST) && (sockgetdatalen(ufd->sk) == 0))
-		dead = 1;
-	    if(!dead)
-		continue;
-	    if(ufd->sk->eos == 1) {
-		ufd->sk->eos = 2;
-		closeufd(ufd);
-		closesock(ufd->sk);
-	    }
-	    if((ufd->sk->refcount == 1) && (ufd->sk->back->refcount == 0)) {
-		freeufd(ufd);
-		continue;
-	    }
-	}
+    if(ufd->sk == NULL)
+	return(0);
+    dead = (ufd->fd < 0);
+    if(ufd->sk->state == SOCK_STL)
+	dead = 1;
+    if((ufd->sk->state == SOCK_EST) && (sockgetdatalen(ufd->sk) == 0))
+	dead = 1;
+    if(!dead)
+	return(0);
+    if(ufd->sk->eos == 1) {
+	ufd->sk->eos = 2;
+	closeufd(ufd);
+	closesock(ufd->sk);
     }
+    if((ufd->sk->refcount == 1) && (ufd->sk->back->refcount == 0)) {
+	freeufd(ufd);
+	return(1);
+    }
+    return(0);
 }
 
-int pollsocks(int timeout)
+static void cleansocks(void)
 {
-    int ret;
+    struct ufd *ufd, *next;
+    
+    for(ufd = ufds; ufd != NULL; ufd = next) {
+	next = ufd->next;
+	cleanufd(ufd);
+    }
+}
+
+static int ufdwants(struct ufd *ufd)
+{
+    int ev;
+    
+    if(ufd->fd < 0)
+	return(0);
+    ev = 0;
+    if(!ufd->ignread && ((ufd->sk == NULL) || (sockqueueleft(ufd->sk) > 0)))
+	ev |= UFDEV_READ;
+    if(ufd->sk != NULL) {
+	if(sockgetdatalen(ufd->sk) > 0)
+	    ev |= UFDEV_WRITE;
+	else if(ufd->sk->state == SOCK_SYN)
+	    ev |= UFDEV_WRITE;
+    }
+    return(ev);
+}
+
+static void ufdevent(struct ufd *ufd, int ev)
+{
+    int ret, i, budget;
     socklen_t retlen;
-    int newfd, maxfd;
-    fd_set rfds, wfds, efds;
-    struct ufd *ufd, *nufd;
+    int newfd;
+    struct ufd *nufd;
     struct socket *nsk;
     struct sockaddr_storage ss;
     socklen_t sslen;
+    
+    if(ufd->fd < 0)
+	return;
+    if(ufd->type == UFD_LISTEN) {
+	/* Accept as many pending connections as the budget allows,
+	 * so that a burst of connections does not have to wait for a
+	 * full main loop iteration each. */
+	budget = confgetint("net", "acceptbudget");
+	for(i = 0; (ev & UFDEV_READ) && (i < budget); i++) {
+	    sslen = sizeof(ss);
+#ifdef HAVE_ACCEPT4
+	    newfd = accept4(ufd->fd, (struct sockaddr *)&ss, &sslen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+	    if((newfd = accept(ufd->fd, (struct sockaddr *)&ss, &sslen)) >= 0) {
+		fcntl(newfd, F_SETFL, fcntl(newfd, F_GETFL) | O_NONBLOCK);
+		fcntl(newfd, F_SETFD, FD_CLOEXEC);
+	    }
+#endif
+	    if(newfd < 0) {
+		if((errno == EAGAIN) || (errno == EWOULDBLOCK))
+		    break;
+		/* The connection was reset before it could be
+		 * accepted, which does not concern the listener. */
+		if((errno == EINTR) || (errno == ECONNABORTED))
+		    continue;
+		if(ufd->d.l.lp->errcb != NULL)
+		    evtimed(EVS_ERRCB, ufd->d.l.lp->errcb(ufd->d.l.lp, errno, ufd->d.l.lp->data));
+		break;
+	    }
+	    nsk = sockpair(0);
+	    nufd = mkufd(newfd, UFD_SOCK, nsk);
+	    nufd->d.s.family = ufd->d.l.family;
+	    sksetstate(nsk, SOCK_EST);
+	    memcpy(nufd->d.s.remote = smalloc(sslen), &ss, sslen);
+	    nufd->d.s.remotelen = sslen;
+	    if(ss.ss_family == PF_UNIX)
+		acceptunix(nufd);
+	    if(ufd->d.l.lp->acceptcb != NULL)
+		evtimed(EVS_ACCEPTCB, ufd->d.l.lp->acceptcb(ufd->d.l.lp, nsk->back, ufd->d.l.lp->data));
+	    putsock(nsk);
+	}
+	if(ev & UFDEV_ERR) {
+	    retlen = sizeof(ret);
+	    getsockopt(ufd->fd, SOL_SOCKET, SO_ERROR, &ret, &retlen);
+	    if(ufd->d.l.lp->errcb != NULL)
+		evtimed(EVS_ERRCB, ufd->d.l.lp->errcb(ufd->d.l.lp, ret, ufd->d.l.lp->data));
+	    return;
+	}
+    } else {
+	if(ufd->sk->state == SOCK_SYN) {
+	    if(ev & UFDEV_ERR) {
+		retlen = sizeof(ret);
+		getsockopt(ufd->fd, SOL_SOCKET, SO_ERROR, &ret, &retlen);
+		if(ufd->sk->back->conncb != NULL)
+		    evtimed(EVS_CONNCB, ufd->sk->back->conncb(ufd->sk->back, ret, ufd->sk->back->data));
+		closeufd(ufd);
+		return;
+	    }
+	    if(ev & (UFDEV_READ | UFDEV_WRITE)) {
+		sksetstate(ufd->sk, SOCK_EST);
+		linksock(BATCH_CONN, ufd->sk->back);
+	    }
+	} else if(ufd->sk->state == SOCK_EST) {
+	    if(ev & UFDEV_ERR) {
+		retlen = sizeof(ret);
+		getsockopt(ufd->fd, SOL_SOCKET, SO_ERROR, &ret, &retlen);
+		sockerror(ufd->sk, ret);
+		closeufd(ufd);
+		return;
+	    }
+	    if(ev & UFDEV_READ)
+		sockrecv(ufd);
+	    if(ufd->fd == -1)
+		return;
+	    if(ev & UFDEV_WRITE) {
+		if(sockflush(ufd)) {
+		    sockerror(ufd->sk, errno);
+		    closeufd(ufd);
+		    return;
+		}
+	    }
+	}
+    }
+}
+
+static int selectsocks(int timeout)
+{
+    int ret, ev, maxfd;
+    fd_set rfds, wfds, efds;
+    struct ufd *ufd;
     struct timeval tv;
     
     cleansocks();
@@ -1124,23 +1962,20 @@ int pollsocks(int timeout)
     for(maxfd = 0, ufd = ufds; ufd != NULL; ufd = ufd->next) {
 	if(ufd->fd < 0)
 	    continue;
-	if(!ufd->ignread && ((ufd->sk == NULL) || (sockqueueleft(ufd->sk) > 0)))
+	ev = ufdwants(ufd);
+	if(ev & UFDEV_READ)
 	    FD_SET(ufd->fd, &rfds);
-	if(ufd->sk != NULL) {
-	    if(sockgetdatalen(ufd->sk) > 0)
-		FD_SET(ufd->fd, &wfds);
-	    else if(ufd->sk->state == SOCK_SYN)
-		FD_SET(ufd->fd, &wfds);
-	}
+	if(ev & UFDEV_WRITE)
+	    FD_SET(ufd->fd, &wfds);
 	FD_SET(ufd->fd, &efds);
 	if(ufd->fd > maxfd)
 	    maxfd = ufd->fd;
     }
-    if(rbatch || wbatch || cbatch)
+    if(batchespending())
 	timeout = 0;
     tv.tv_sec = timeout / 1000;
     tv.tv_usec = (timeout % 1000) * 1000;
-    ret = select(maxfd + 1, &rfds, &wfds, &efds, (timeout < 0)?NULL:&tv);
+    evtimed(EVS_POLL, ret = select(maxfd + 1, &rfds, &wfds, &efds, (timeout < 0)?NULL:&tv));
     if(ret < 0) {
 	if(errno != EINTR) {
 	    flog(LOG_CRIT, "pollsocks: select errored out: %s", strerror(errno));
@@ -1151,75 +1986,164 @@ int pollsocks(int timeout)
 	return(1);
     }
     for(ufd = ufds; ufd != NULL; ufd = ufd->next) {
-	if(ufd->sk < 0)
+	if(ufd->fd < 0)
 	    continue;
-	if(ufd->type == UFD_LISTEN) {
-	    if(FD_ISSET(ufd->fd, &rfds)) {
-		sslen = sizeof(ss);
-		if((newfd = accept(ufd->fd, (struct sockaddr *)&ss, &sslen)) < 0) {
-		    if(ufd->d.l.lp->errcb != NULL)
-			ufd->d.l.lp->errcb(ufd->d.l.lp, errno, ufd->d.l.lp->data);
-		}
-		nsk = sockpair(0);
-		nufd = mkufd(newfd, UFD_SOCK, nsk);
-		nufd->d.s.family = ufd->d.l.family;
-		sksetstate(nsk, SOCK_EST);
-		memcpy(nufd->d.s.remote = smalloc(sslen), &ss, sslen);
-		nufd->d.s.remotelen = sslen;
-		if(ss.ss_family == PF_UNIX)
-		    acceptunix(nufd);
-		if(ufd->d.l.lp->acceptcb != NULL)
-		    ufd->d.l.lp->acceptcb(ufd->d.l.lp, nsk->back, ufd->d.l.lp->data);
-		putsock(nsk);
-	    }
-	    if(FD_ISSET(ufd->fd, &efds)) {
-		retlen = sizeof(ret);
-		getsockopt(ufd->fd, SOL_SOCKET, SO_ERROR, &ret, &retlen);
-		if(ufd->d.l.lp->errcb != NULL)
-		    ufd->d.l.lp->errcb(ufd->d.l.lp, ret, ufd->d.l.lp->data);
-		continue;
-	    }
-	} else {
-	    if(ufd->sk->state == SOCK_SYN) {
-		if(FD_ISSET(ufd->fd, &efds)) {
-		    retlen = sizeof(ret);
-		    getsockopt(ufd->fd, SOL_SOCKET, SO_ERROR, &ret, &retlen);
-		    if(ufd->sk->back->conncb != NULL)
-			ufd->sk->back->conncb(ufd->sk->back, ret, ufd->sk->back->data);
-		    closeufd(ufd);
-		    continue;
-		}
-		if(FD_ISSET(ufd->fd, &rfds) || FD_ISSET(ufd->fd, &wfds)) {
-		    sksetstate(ufd->sk, SOCK_EST);
-		    linksock(&cbatch, ufd->sk->back);
-		}
-	    } else if(ufd->sk->state == SOCK_EST) {
-		if(FD_ISSET(ufd->fd, &efds)) {
-		    retlen = sizeof(ret);
-		    getsockopt(ufd->fd, SOL_SOCKET, SO_ERROR, &ret, &retlen);
-		    sockerror(ufd->sk, ret);
-		    closeufd(ufd);
-		    continue;
-		}
-		if(FD_ISSET(ufd->fd, &rfds))
-		    sockrecv(ufd);
-		if(ufd->fd == -1)
-		    continue;
-		if(FD_ISSET(ufd->fd, &wfds)) {
-		    if(sockflush(ufd)) {
-			sockerror(ufd->sk, errno);
-			closeufd(ufd);
-			continue;
-		    }
-		}
-	    }
-	}
+	ev = 0;
+	if(FD_ISSET(ufd->fd, &rfds))
+	    ev |= UFDEV_READ;
+	if(FD_ISSET(ufd->fd, &wfds))
+	    ev |= UFDEV_WRITE;
+	if(FD_ISSET(ufd->fd, &efds))
+	    ev |= UFDEV_ERR;
+	if(ev)
+	    ufdevent(ufd, ev);
     }
     runbatches();
     cleansocks();
     return(1);
 }
 
+#ifdef HAVE_EPOLL
+static void epollupdate(struct ufd *ufd)
+{
+    struct epoll_event ev;
+    int want, wants, op;
+    
+    if(ufd->noepoll || (ufd->fd < 0))
+	return;
+    wants = ufdwants(ufd);
+    want = 0;
+    if(wants & UFDEV_READ)
+	want |= EPOLLIN;
+    if(wants & UFDEV_WRITE)
+	want |= EPOLLOUT;
+    if(want != 0)
+	want |= EPOLLPRI;
+    if(want == ufd->pollev)
+	return;
+    /* Unwanted fds are removed entirely, rather than being left with
+     * an empty mask, since epoll always reports EPOLLHUP, which would
+     * otherwise make a hung-up socket with a full buffer spin. */
+    if(want == 0)
+	op = EPOLL_CTL_DEL;
+    else if(ufd->pollev == 0)
+	op = EPOLL_CTL_ADD;
+    else
+	op = EPOLL_CTL_MOD;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = want;
+    ev.data.ptr = ufd;
+    if(epoll_ctl(epfd, op, ufd->fd, &ev) < 0) {
+	if((op == EPOLL_CTL_ADD) && (errno == EPERM)) {
+	    /* Regular files cannot be polled, but, just as with
+	     * select(), they are always ready. */
+	    ufd->noepoll = 1;
+	    ufd->fprev = NULL;
+	    ufd->fnext = fileufds;
+	    if(fileufds != NULL)
+		fileufds->fprev = ufd;
+	    fileufds = ufd;
+	    return;
+	}
+	flog(LOG_ERR, "BUG: could not modify epoll registration of fd %i: %s", ufd->fd, strerror(errno));
+	return;
+    }
+    ufd->pollev = want;
+}
+
+static void flushdirty(void)
+{
+    struct ufd *ufd;
+    
+    while((ufd = dirtyufds) != NULL) {
+	ufdundirty(ufd);
+	if(cleanufd(ufd))
+	    continue;
+	epollupdate(ufd);
+    }
+}
+
+static int epollsocks(int timeout)
+{
+    int ret, ev;
+    struct ufd *ufd;
+    
+    flushdirty();
+    for(ufd = fileufds; ufd != NULL; ufd = ufd->fnext) {
+	if(ufdwants(ufd)) {
+	    timeout = 0;
+	    break;
+	}
+    }
+    if(batchespending())
+	timeout = 0;
+    evtimed(EVS_POLL, ret = epoll_wait(epfd, epevs, EPOLLBATCH, timeout));
+    if(ret < 0) {
+	if(errno != EINTR) {
+	    flog(LOG_CRIT, "pollsocks: epoll_wait errored out: %s", strerror(errno));
+	    sleep(1);
+	}
+	return(1);
+    }
+    for(epcur = 0, epcnt = ret; epcur < epcnt; epcur++) {
+	if((ufd = epevs[epcur].data.ptr) == NULL)
+	    continue;
+	ev = 0;
+	if(epevs[epcur].events & EPOLLIN)
+	    ev |= UFDEV_READ;
+	if(epevs[epcur].events & EPOLLOUT)
+	    ev |= UFDEV_WRITE;
+	/* Let a hangup be discovered by whatever operation is pending,
+	 * just as select() would have done. */
+	if(epevs[epcur].events & EPOLLHUP)
+	    ev |= ufdwants(ufd);
+	if(epevs[epcur].events & (EPOLLERR | EPOLLPRI))
+	    ev |= UFDEV_ERR;
+	ufdevent(ufd, ev);
+    }
+    epcur = epcnt = 0;
+    for(ufd = fileufds; ufd != NULL; ufd = nextfileufd) {
+	nextfileufd = ufd->fnext;
+	if((ev = ufdwants(ufd)) != 0)
+	    ufdevent(ufd, ev);
+    }
+    nextfileufd = NULL;
+    runbatches();
+    flushdirty();
+    return(1);
+}
+#endif
+
+static void initpoll(void)
+{
+    struct ufd *ufd;
+    
+    pollmode = POLL_SELECT;
+#ifdef HAVE_EPOLL
+    if(confgetint("net", "epoll")) {
+	if((epfd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+	    flog(LOG_WARNING, "could not create epoll instance, falling back to select: %s", strerror(errno));
+	else
+	    pollmode = POLL_EPOLL;
+    }
+#endif
+    if(pollmode == POLL_SELECT) {
+	while((ufd = dirtyufds) != NULL)
+	    ufdundirty(ufd);
+    }
+}
+
+int pollsocks(int timeout)
+{
+    if(pollmode < 0)
+	initpoll();
+#ifdef HAVE_EPOLL
+    if(pollmode == POLL_EPOLL)
+	return(epollsocks(timeout));
+#endif
+    return(selectsocks(timeout));
+}
+
 static struct ufd *getskufd(struct socket *sk)
 {
     while(1) {
@@ -1325,103 +2249,849 @@ int socksettos(struct socket *sk, int tos)
     return(1);
 }
 
-struct resolvedata
+/*
+ * The resolver. Host names are looked up by sending DNS queries over
+ * UDP from the main loop, instead of forking off a child to run
+ * gethostbyname() for every lookup. Both positive and negative
+ * answers are cached for as long as their TTLs allow, and
+ * simultaneous lookups of the same name share their queries.
+ */
+
+#define DNS_A 1
+#define DNS_CNAME 5
+#define DNS_SOA 6
+#define DNS_AAAA 28
+
+#define DNSF_A 1
+#define DNSF_AAAA 2
+
+/* The maximum number of cached names, not counting expired ones */
+#define DNSCACHEMAX 256
+
+struct dnsent
 {
-    int fd;
+    struct dnsent *next, *prev;
+    char *name;
+    int type;
+    double expire;
+    int naddrs;
+    unsigned char *addrs;
+};
+
+struct dnsquery
+{
+    struct dnsquery *next, *prev;
+    char *name;
+    int type;
+    unsigned short id;
+    int tries;
+    /* Every attempt is sent from a socket of its own, so that it
+     * gets a port of its own. */
+    struct socket *sk;
+    struct sockaddr_storage srv;
+    socklen_t srvlen;
+    struct timer *timer;
+};
+
+struct dnslookup
+{
+    struct dnslookup *next, *prev;
+    /* The names to try in turn, as given by the search domains, and
+     * the one currently being looked up. */
+    char **names;
+    int curname;
+    char *name;
+    int port;
+    int wait, found;
+    unsigned char a4[4], a6[16];
     void (*callback)(struct sockaddr *addr, int addrlen, void *data);
     void *data;
-    struct sockaddr_storage addr;
-    int addrlen;
 };
 
-static void resolvecb(pid_t pid, int status, struct resolvedata *data)
+static struct dnsent *dnscache = NULL;
+static int numdnsents = 0;
+static struct dnsquery *dnsqueries = NULL;
+static struct dnslookup *dnslookups = NULL;
+
+static int dnstypeflag(int type)
+{
+    return((type == DNS_A)?DNSF_A:DNSF_AAAA);
+}
+
+static int dnsaddrlen(int type)
+{
+    return((type == DNS_A)?4:16);
+}
+
+/*
+ * Parses an address of the form "host", "host:port" or
+ * "[host]:port" into a newly allocated host name and a port number,
+ * which is -1 if not given. Bare IPv6 literals are also recognized.
+ */
+static char *splithostport(char *addr, int *port)
+{
+    char *host, *p;
+    
+    *port = -1;
+    if(*addr == '[') {
+	if((p = strchr(addr, ']')) == NULL)
+	    return(NULL);
+	host = smalloc(p - addr);
+	memcpy(host, addr + 1, p - addr - 1);
+	host[p - addr - 1] = 0;
+	if(p[1] == ':')
+	    *port = atoi(p + 2);
+	return(host);
+    }
+    if(((p = strchr(addr, ':')) == NULL) || (strchr(p + 1, ':') != NULL))
+	return(sstrdup(addr));
+    host = smalloc(p - addr + 1);
+    memcpy(host, addr, p - addr);
+    host[p - addr] = 0;
+    *port = atoi(p + 1);
+    return(host);
+}
+
+static int parseaddr(char *host, int port, struct sockaddr_storage *addr, socklen_t *addrlen)
 {
-    static char buf[80];
-    int ret;
     struct sockaddr_in *ipv4;
+#ifdef HAVE_IPV6
+    struct sockaddr_in6 *ipv6;
+#endif
     
-    if(!status)
-    {
-	if((ret = read(data->fd, buf, sizeof(buf))) != 4)
-	{
-	    errno = ENOENT;
-	    data->callback(NULL, 0, data->data);
+    memset(addr, 0, sizeof(*addr));
+    ipv4 = (struct sockaddr_in *)addr;
+    if(inet_pton(AF_INET, host, &ipv4->sin_addr) > 0) {
+	ipv4->sin_family = AF_INET;
+	ipv4->sin_port = htons(port);
+	*addrlen = sizeof(*ipv4);
+	return(0);
+    }
+#ifdef HAVE_IPV6
+    ipv6 = (struct sockaddr_in6 *)addr;
+    if(inet_pton(AF_INET6, host, &ipv6->sin6_addr) > 0) {
+	ipv6->sin6_family = AF_INET6;
+	ipv6->sin6_port = htons(port);
+	*addrlen = sizeof(*ipv6);
+	return(0);
+    }
+#endif
+    return(-1);
+}
+
+/*
+ * Looks a name up in /etc/hosts, which would otherwise be bypassed
+ * by querying DNS servers directly. IPv4 addresses are preferred.
+ */
+static int hostslookup(char *name, int port, struct sockaddr_storage *addr, socklen_t *addrlen)
+{
+    FILE *fp;
+    char line[1024], *p, *p2, *tok;
+    struct sockaddr_storage buf;
+    socklen_t buflen;
+    int found;
+    
+    if((fp = fopen("/etc/hosts", "r")) == NULL)
+	return(-1);
+    found = 0;
+    while(fgets(line, sizeof(line), fp) != NULL) {
+	if((p = strchr(line, '#')) != NULL)
+	    *p = 0;
+	if((tok = strtok_r(line, " \t\r\n", &p2)) == NULL)
+	    continue;
+	if(parseaddr(tok, port, &buf, &buflen))
+	    continue;
+	while((tok = strtok_r(NULL, " \t\r\n", &p2)) != NULL) {
+	    if(!strcasecmp(tok, name))
+		break;
+	}
+	if(tok == NULL)
+	    continue;
+	if(!found || (buf.ss_family == AF_INET)) {
+	    memcpy(addr, &buf, *addrlen = buflen);
+	    found = 1;
+	}
+	if(buf.ss_family == AF_INET)
+	    break;
+    }
+    fclose(fp);
+    return(found?0:-1);
+}
+
+/*
+ * Fetches the list of DNS servers to use, either from net.dnsserver
+ * or from /etc/resolv.conf.
+ */
+static int getdnsservers(struct sockaddr_storage *servers, socklen_t *lens, int max)
+{
+    FILE *fp;
+    char line[1024], *p, *p2, *tok, *host;
+    int n, port;
+    
+    if((p = icswcstombs(confgetstr("net", "dnsserver"), NULL, NULL)) == NULL) {
+	flog(LOG_ERR, "could not convert net.dnsserver into local charset: %s", strerror(errno));
+	return(0);
+    }
+    if(*p) {
+	n = 0;
+	if((host = splithostport(p, &port)) != NULL) {
+	    if(!parseaddr(host, (port < 0)?53:port, &servers[0], &lens[0]))
+		n = 1;
+	    else
+		flog(LOG_WARNING, "net.dnsserver is not a valid address: %s", p);
+	    free(host);
+	}
+	return(n);
+    }
+    if((fp = fopen("/etc/resolv.conf", "r")) == NULL)
+	return(0);
+    n = 0;
+    while((n < max) && (fgets(line, sizeof(line), fp) != NULL)) {
+	if(((tok = strtok_r(line, " \t\r\n", &p2)) == NULL) || strcmp(tok, "nameserver"))
+	    continue;
+	if((tok = strtok_r(NULL, " \t\r\n", &p2)) == NULL)
+	    continue;
+	/* Strip any IPv6 zone index */
+	if((p = strchr(tok, '%')) != NULL)
+	    *p = 0;
+	if(!parseaddr(tok, 53, &servers[n], &lens[n]))
+	    n++;
+    }
+    fclose(fp);
+    return(n);
+}
+
+/*
+ * Fetches the domains to search, either from net.dnssearch or from
+ * /etc/resolv.conf, along with the ndots option from the latter.
+ */
+static char **getdnssearch(int *ndots)
+{
+    FILE *fp;
+    char line[1024], *p, *p2, *tok, *conf;
+    char **search;
+    size_t searchsize, searchdata, len, i;
+    int fromconf;
+    
+    *ndots = 1;
+    search = NULL;
+    searchsize = searchdata = 0;
+    if((p = icswcstombs(confgetstr("net", "dnssearch"), NULL, NULL)) == NULL) {
+	flog(LOG_ERR, "could not convert net.dnssearch into local charset: %s", strerror(errno));
+	p = "";
+    }
+    conf = sstrdup(p);
+    fromconf = (*conf != 0);
+    for(tok = strtok_r(conf, " \t", &p2); tok != NULL; tok = strtok_r(NULL, " \t", &p2))
+	addtobuf(search, sstrdup(tok));
+    free(conf);
+    if((fp = fopen("/etc/resolv.conf", "r")) != NULL) {
+	while(fgets(line, sizeof(line), fp) != NULL) {
+	    if((tok = strtok_r(line, " \t\r\n", &p2)) == NULL)
+		continue;
+	    if(!strcmp(tok, "options")) {
+		while((tok = strtok_r(NULL, " \t\r\n", &p2)) != NULL) {
+		    if(!strncmp(tok, "ndots:", 6)) {
+			if((*ndots = atoi(tok + 6)) > 15)
+			    *ndots = 15;
+			else if(*ndots < 0)
+			    *ndots = 0;
+		    }
+		}
+	    } else if(!fromconf && (!strcmp(tok, "search") || !strcmp(tok, "domain"))) {
+		/* The last of these lines is the one that counts. */
+		while(searchdata > 0)
+		    free(search[--searchdata]);
+		while((tok = strtok_r(NULL, " \t\r\n", &p2)) != NULL)
+		    addtobuf(search, sstrdup(tok));
+	    }
+	}
+	fclose(fp);
+    }
+    /* Trailing dots are dropped, and the root domain with them. */
+    for(i = 0; i < searchdata; ) {
+	p = search[i];
+	if(((len = strlen(p)) > 0) && (p[len - 1] == '.'))
+	    p[--len] = 0;
+	if(len == 0) {
+	    free(p);
+	    memmove(search + i, search + i + 1, sizeof(*search) * (--searchdata - i));
 	} else {
-	    ipv4 = (struct sockaddr_in *)&data->addr;
-	    memcpy(&ipv4->sin_addr, buf, 4);
-	    data->callback((struct sockaddr *)ipv4, sizeof(*ipv4), data->data);
+	    i++;
 	}
+    }
+    addtobuf(search, NULL);
+    return(search);
+}
+
+/*
+ * Returns the names to look up in turn for a host name, like the
+ * system resolver would: a name with at least ndots dots is tried as
+ * it is before the search domains are appended to it, and a name
+ * with fewer is tried as it is last. An absolute name, which had a
+ * trailing dot, is only tried as it is.
+ */
+static char **dnsnames(char *name, int absolute)
+{
+    char **names, **search, *p;
+    size_t namessize, namesdata;
+    int i, dots, ndots;
+    
+    names = NULL;
+    namessize = namesdata = 0;
+    if(absolute) {
+	addtobuf(names, sstrdup(name));
+	addtobuf(names, NULL);
+	return(names);
+    }
+    search = getdnssearch(&ndots);
+    for(dots = 0, p = name; *p; p++) {
+	if(*p == '.')
+	    dots++;
+    }
+    if(dots >= ndots)
+	addtobuf(names, sstrdup(name));
+    for(i = 0; search[i] != NULL; i++)
+	addtobuf(names, sprintf2("%s.%s", name, search[i]));
+    if(dots < ndots)
+	addtobuf(names, sstrdup(name));
+    addtobuf(names, NULL);
+    freeparr(search);
+    return(names);
+}
+
+static struct dnsent *finddnsent(char *name, int type)
+{
+    struct dnsent *ent;
+    
+    for(ent = dnscache; ent != NULL; ent = ent->next) {
+	if((ent->type == type) && !strcasecmp(ent->name, name))
+	    return((ent->expire > ntime())?ent:NULL);
+    }
+    return(NULL);
+}
+
+static void freednsent(struct dnsent *ent)
+{
+    if(ent->next != NULL)
+	ent->next->prev = ent->prev;
+    if(ent->prev != NULL)
+	ent->prev->next = ent->next;
+    if(ent == dnscache)
+	dnscache = ent->next;
+    numdnsents--;
+    free(ent->name);
+    if(ent->addrs != NULL)
+	free(ent->addrs);
+    free(ent);
+}
+
+static void cachedns(char *name, int type, unsigned char *addrs, int naddrs, unsigned int ttl)
+{
+    struct dnsent *ent, *next, *last;
+    double now;
+    
+    now = ntime();
+    last = NULL;
+    for(ent = dnscache; ent != NULL; ent = next) {
+	next = ent->next;
+	if((ent->expire <= now) || ((ent->type == type) && !strcasecmp(ent->name, name)))
+	    freednsent(ent);
+	else
+	    last = ent;
+    }
+    if(ttl == 0)
+	return;
+    if((numdnsents >= DNSCACHEMAX) && (last != NULL))
+	freednsent(last);
+    ent = smalloc(sizeof(*ent));
+    ent->name = sstrdup(name);
+    ent->type = type;
+    ent->expire = now + ttl;
+    ent->naddrs = naddrs;
+    ent->addrs = NULL;
+    if(naddrs > 0)
+	memcpy(ent->addrs = smalloc(naddrs * dnsaddrlen(type)), addrs, naddrs * dnsaddrlen(type));
+    ent->prev = NULL;
+    ent->next = dnscache;
+    if(dnscache != NULL)
+	dnscache->prev = ent;
+    dnscache = ent;
+    numdnsents++;
+}
+
+static void lookupresult(struct dnslookup *lu, int type, unsigned char *addr)
+{
+    lu->wait &= ~dnstypeflag(type);
+    if(addr == NULL)
+	return;
+    lu->found |= dnstypeflag(type);
+    if(type == DNS_A)
+	memcpy(lu->a4, addr, 4);
+    else
+	memcpy(lu->a6, addr, 16);
+}
+
+/* IPv4 addresses are preferred, since IPv6 connectivity is far from
+ * universal and only one address is passed on. */
+static void lookupdone(struct dnslookup *lu)
+{
+    struct sockaddr_in ipv4;
+#ifdef HAVE_IPV6
+    struct sockaddr_in6 ipv6;
+#endif
+    
+    if(lu->found & DNSF_A) {
+	memset(&ipv4, 0, sizeof(ipv4));
+	ipv4.sin_family = AF_INET;
+	ipv4.sin_port = htons(lu->port);
+	memcpy(&ipv4.sin_addr, lu->a4, 4);
+	lu->callback((struct sockaddr *)&ipv4, sizeof(ipv4), lu->data);
+#ifdef HAVE_IPV6
+    } else if(lu->found & DNSF_AAAA) {
+	memset(&ipv6, 0, sizeof(ipv6));
+	ipv6.sin6_family = AF_INET6;
+	ipv6.sin6_port = htons(lu->port);
+	memcpy(&ipv6.sin6_addr, lu->a6, 16);
+	lu->callback((struct sockaddr *)&ipv6, sizeof(ipv6), lu->data);
+#endif
     } else {
 	errno = ENOENT;
-	data->callback(NULL, 0, data->data);
+	lu->callback(NULL, 0, lu->data);
     }
-    close(data->fd);
-    free(data);
+    freeparr(lu->names);
+    free(lu);
 }
 
-int netresolve(char *addr, void (*callback)(struct sockaddr *addr, int addrlen, void *data), void *data)
+static int startdnsquery(char *name, int type);
+
+/*
+ * Looks up the next of a lookup's names, until an address has been
+ * found or there are no more names to try, and then passes on the
+ * result. Returns non-zero if the lookup is left waiting for replies.
+ */
+static int lookupnext(struct dnslookup *lu)
 {
     int i;
+    struct dnsent *ent;
+    int types[2] = {DNS_A, DNS_AAAA};
+    
+    while(!lu->found && ((lu->name = lu->names[lu->curname]) != NULL)) {
+	lu->curname++;
+#ifdef HAVE_IPV6
+	lu->wait = DNSF_A | DNSF_AAAA;
+#else
+	lu->wait = DNSF_A;
+#endif
+	for(i = 0; i < 2; i++) {
+	    if(!(lu->wait & dnstypeflag(types[i])))
+		continue;
+	    if((ent = finddnsent(lu->name, types[i])) != NULL)
+		lookupresult(lu, types[i], (ent->naddrs > 0)?ent->addrs:NULL);
+	    else if(startdnsquery(lu->name, types[i]))
+		lookupresult(lu, types[i], NULL);
+	}
+	if(lu->wait != 0) {
+	    lu->prev = NULL;
+	    lu->next = dnslookups;
+	    if(dnslookups != NULL)
+		dnslookups->prev = lu;
+	    dnslookups = lu;
+	    return(1);
+	}
+    }
+    lookupdone(lu);
+    return(0);
+}
+
+static void dnsclosesk(struct dnsquery *q)
+{
+    if(q->sk == NULL)
+	return;
+    q->sk->readcb = NULL;
+    q->sk->data = NULL;
+    putsock(q->sk);
+    q->sk = NULL;
+}
+
+/*
+ * Finishes a query, passing the resulting address, if any, on to all
+ * lookups waiting for it.
+ */
+static void dnsqdone(struct dnsquery *q, unsigned char *addr)
+{
+    struct dnslookup *lu, *next, *done;
+    
+    dnsclosesk(q);
+    if(q->next != NULL)
+	q->next->prev = q->prev;
+    if(q->prev != NULL)
+	q->prev->next = q->next;
+    if(q == dnsqueries)
+	dnsqueries = q->next;
+    if(q->timer != NULL)
+	canceltimer(q->timer);
+    /* The callbacks are called only once the list has been
+     * traversed, since they may well start new lookups. */
+    done = NULL;
+    for(lu = dnslookups; lu != NULL; lu = next) {
+	next = lu->next;
+	if(!(lu->wait & dnstypeflag(q->type)) || strcasecmp(lu->name, q->name))
+	    continue;
+	lookupresult(lu, q->type, addr);
+	if(lu->wait == 0) {
+	    if(lu->next != NULL)
+		lu->next->prev = lu->prev;
+	    if(lu->prev != NULL)
+		lu->prev->next = lu->next;
+	    if(lu == dnslookups)
+		dnslookups = lu->next;
+	    lu->next = done;
+	    done = lu;
+	}
+    }
+    free(q->name);
+    free(q);
+    for(lu = done; lu != NULL; lu = next) {
+	next = lu->next;
+	lookupnext(lu);
+    }
+}
+
+static size_t mkdnsquery(unsigned char *buf, size_t bufsize, unsigned short id, char *name, int type)
+{
+    size_t pos, ll;
     char *p;
-    int port;
-    int pfd[2];
-    pid_t child;
-    struct resolvedata *rdata;
-    struct sockaddr_in ipv4;
-    struct hostent *he;
-    sigset_t sigset;
     
-    /* IPv4 */
-    port = -1;
-    if((p = strchr(addr, ':')) != NULL)
-    {
-	*p = 0;
-	port = atoi(p + 1);
+    memset(buf, 0, 12);
+    buf[0] = id >> 8;
+    buf[1] = id & 0xff;
+    buf[2] = 0x01; /* RD */
+    buf[5] = 1; /* QDCOUNT */
+    pos = 12;
+    while(*name) {
+	if((p = strchr(name, '.')) == NULL)
+	    p = name + strlen(name);
+	if(((ll = p - name) == 0) || (ll > 63) || (pos + ll + 6 > bufsize))
+	    return(0);
+	buf[pos++] = ll;
+	memcpy(buf + pos, name, ll);
+	pos += ll;
+	name = (*p)?(p + 1):p;
     }
-    ipv4.sin_family = AF_INET;
-    ipv4.sin_port = htons(port);
-    if(inet_aton(addr, &ipv4.sin_addr))
-    {
-	callback((struct sockaddr *)&ipv4, sizeof(ipv4), data);
-    } else {
-	sigemptyset(&sigset);
-	sigaddset(&sigset, SIGCHLD);
-	sigprocmask(SIG_BLOCK, &sigset, NULL);
-	if((pipe(pfd) < 0) || ((child = fork()) < 0))
-	{
-	    sigprocmask(SIG_UNBLOCK, &sigset, NULL);
+    buf[pos++] = 0;
+    buf[pos++] = type >> 8;
+    buf[pos++] = type & 0xff;
+    buf[pos++] = 0;
+    buf[pos++] = 1; /* IN */
+    return(pos);
+}
+
+/*
+ * Reads a possibly compressed name from a DNS message into buf (or
+ * just skips it if buf is NULL), and advances *pos past it.
+ */
+static int getdnsname(unsigned char *msg, size_t len, size_t *pos, char *buf, size_t bufsize)
+{
+    size_t p, bp, ll;
+    int jumps, jumped;
+    
+    p = *pos;
+    bp = 0;
+    jumps = jumped = 0;
+    while(1) {
+	if(p >= len)
 	    return(-1);
+	ll = msg[p];
+	if((ll & 0xc0) == 0xc0) {
+	    if((p + 1 >= len) || (++jumps > 32))
+		return(-1);
+	    if(!jumped)
+		*pos = p + 2;
+	    jumped = 1;
+	    p = ((ll & 0x3f) << 8) | msg[p + 1];
+	    continue;
 	}
-	if(child == 0)
-	{
-	    sigprocmask(SIG_UNBLOCK, &sigset, NULL);
-	    for(i = 3; i < FD_SETSIZE; i++)
-	    {
-		if(i != pfd[1])
-		    close(i);
+	if(ll & 0xc0)
+	    return(-1);
+	p++;
+	if(ll == 0)
+	    break;
+	if(p + ll > len)
+	    return(-1);
+	if(buf != NULL) {
+	    if(bp + ll + 2 > bufsize)
+		return(-1);
+	    if(bp > 0)
+		buf[bp++] = '.';
+	    memcpy(buf + bp, msg + p, ll);
+	    bp += ll;
+	}
+	p += ll;
+    }
+    if(!jumped)
+	*pos = p;
+    if(buf != NULL)
+	buf[bp] = 0;
+    return(0);
+}
+
+static unsigned int getdnsint(unsigned char *p, int len)
+{
+    unsigned int ret;
+    
+    for(ret = 0; len > 0; len--)
+	ret = (ret << 8) | *(p++);
+    return(ret);
+}
+
+static int senddnsquery(struct dnsquery *q);
+
+static void dnstimeout(int cancelled, struct dnsquery *q)
+{
+    if(cancelled)
+	return;
+    q->timer = NULL;
+    if(senddnsquery(q))
+	dnsqdone(q, NULL);
+}
+
+static void dnsreply(struct dnsquery *q, unsigned char *msg, size_t len, struct sockaddr *from)
+{
+    char name[256];
+    size_t pos, rp;
+    int i, an, ns, rcode, type, class, rdlen, naddrs;
+    unsigned int ttl, minttl, negttl;
+    unsigned char *addrs;
+    
+    if((len < 12) || !(msg[2] & 0x80))
+	return;
+    if((q->id != getdnsint(msg, 2)) || !addreq(from, (struct sockaddr *)&q->srv))
+	return;
+    /* Make sure that the reply is to the question actually asked */
+    pos = 12;
+    if((getdnsint(msg + 4, 2) != 1) || getdnsname(msg, len, &pos, name, sizeof(name)) || (pos + 4 > len))
+	return;
+    if(strcasecmp(name, q->name) || (getdnsint(msg + pos, 2) != q->type))
+	return;
+    pos += 4;
+    rcode = msg[3] & 0x0f;
+    /* A truncated reply may lack the answers, and without TCP
+     * support, it can only be treated as a failure. */
+    if((msg[2] & 0x02) || ((rcode != 0) && (rcode != 3))) {
+	/* Let another server have a go at it. */
+	if(q->timer != NULL)
+	    canceltimer(q->timer);
+	q->timer = NULL;
+	if(senddnsquery(q))
+	    dnsqdone(q, NULL);
+	return;
+    }
+    an = getdnsint(msg + 6, 2);
+    ns = getdnsint(msg + 8, 2);
+    addrs = NULL;
+    naddrs = 0;
+    minttl = ~0;
+    negttl = confgetint("net", "dnsnegttl");
+    for(i = 0; i < an + ns; i++) {
+	if(getdnsname(msg, len, &pos, NULL, 0) || (pos + 10 > len))
+	    break;
+	type = getdnsint(msg + pos, 2);
+	class = getdnsint(msg + pos + 2, 2);
+	ttl = getdnsint(msg + pos + 4, 4);
+	rdlen = getdnsint(msg + pos + 8, 2);
+	pos += 10;
+	if(pos + rdlen > len)
+	    break;
+	if(class == 1) {
+	    if(i < an) {
+		if((type == q->type) && (rdlen == dnsaddrlen(type))) {
+		    addrs = srealloc(addrs, (naddrs + 1) * rdlen);
+		    memcpy(addrs + (naddrs++ * rdlen), msg + pos, rdlen);
+		    if(ttl < minttl)
+			minttl = ttl;
+		} else if(type == DNS_CNAME) {
+		    if(ttl < minttl)
+			minttl = ttl;
+		}
+	    } else if(type == DNS_SOA) {
+		/* RFC 2308: The negative TTL is the minimum of the SOA
+		 * record's TTL and its MINIMUM field. */
+		if(ttl < negttl)
+		    negttl = ttl;
+		rp = pos;
+		if(!getdnsname(msg, len, &rp, NULL, 0) && !getdnsname(msg, len, &rp, NULL, 0) && (rp + 20 <= len)) {
+		    if(getdnsint(msg + rp + 16, 4) < negttl)
+			negttl = getdnsint(msg + rp + 16, 4);
+		}
 	    }
-	    signal(SIGALRM, SIG_DFL);
-	    alarm(30);
-	    if((he = gethostbyname(addr)) == NULL)
-		exit(1);
-	    write(pfd[1], he->h_addr_list[0], 4);
-	    exit(0);
-	} else {
-	    close(pfd[1]);
-	    fcntl(pfd[0], F_SETFL, fcntl(pfd[0], F_GETFL) | O_NONBLOCK);
-	    rdata = smalloc(sizeof(*rdata));
-	    rdata->fd = pfd[0];
-	    rdata->callback = callback;
-	    rdata->data = data;
-	    memcpy(&rdata->addr, &ipv4, rdata->addrlen = sizeof(ipv4));
-	    childcallback(child, (void (*)(pid_t, int, void *))resolvecb, rdata);
-	    sigprocmask(SIG_UNBLOCK, &sigset, NULL);
-	    return(1);
 	}
+	pos += rdlen;
+    }
+    if(naddrs > 0) {
+	cachedns(q->name, q->type, addrs, naddrs, minttl);
+	dnsqdone(q, addrs);
+    } else {
+	cachedns(q->name, q->type, NULL, 0, negttl);
+	dnsqdone(q, NULL);
+    }
+    if(addrs != NULL)
+	free(addrs);
+}
+
+static void dnsread(struct socket *sk, void *uudata)
+{
+    struct dgrambuf *dg;
+    
+    /* The query may well be finished, or sent again from another
+     * socket, by any reply. */
+    getsock(sk);
+    while((sk->data != NULL) && ((dg = sockgetdgbuf(sk)) != NULL)) {
+	dnsreply(sk->data, dg->data, dg->size, dg->addr);
+	freedgbuf(dg);
+    }
+    putsock(sk);
+}
+
+/*
+ * Creates a socket bound to a port chosen by the kernel, which should
+ * be random, so that forged replies must guess it as well as the
+ * query ID.
+ */
+static struct socket *dnssock(int family)
+{
+    struct sockaddr_storage name;
+    socklen_t namelen;
+    struct socket *sk;
+    
+    memset(&name, 0, sizeof(name));
+    name.ss_family = family;
+    if(family == AF_INET) {
+	namelen = sizeof(struct sockaddr_in);
+#ifdef HAVE_IPV6
+    } else if(family == AF_INET6) {
+	namelen = sizeof(struct sockaddr_in6);
+#endif
+    } else {
+	errno = EAFNOSUPPORT;
+	return(NULL);
+    }
+    if((sk = netcsdgram((struct sockaddr *)&name, namelen)) == NULL)
+	return(NULL);
+    sk->readcb = dnsread;
+    return(sk);
+}
+
+static unsigned short dnsid(void)
+{
+    static int fd = -1;
+    unsigned short id;
+    
+    if((fd < 0) && ((fd = open("/dev/urandom", O_RDONLY)) >= 0))
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+    if((fd < 0) || (read(fd, &id, sizeof(id)) != sizeof(id))) {
+	flog(LOG_WARNING, "could not read random data from /dev/urandom for a DNS query ID: %s", strerror(errno));
+	id = rand() & 0xffff;
+    }
+    return(id);
+}
+
+/*
+ * Sends a query to the next server in turn, and returns non-zero if
+ * all servers have been tried (twice) already.
+ */
+static int senddnsquery(struct dnsquery *q)
+{
+    struct sockaddr_storage servers[8];
+    socklen_t lens[8];
+    int n;
+    unsigned char buf[512];
+    size_t len;
+    struct dgrambuf *dg;
+    
+    dnsclosesk(q);
+    while(1) {
+	if(((n = getdnsservers(servers, lens, 8)) == 0) || (q->tries >= n * 2))
+	    return(-1);
+	memcpy(&q->srv, &servers[q->tries % n], q->srvlen = lens[q->tries % n]);
+	q->tries++;
+	q->id = dnsid();
+	if((len = mkdnsquery(buf, sizeof(buf), q->id, q->name, q->type)) == 0)
+	    return(-1);
+	if((q->sk = dnssock(q->srv.ss_family)) == NULL) {
+	    flog(LOG_WARNING, "could not create DNS socket: %s", strerror(errno));
+	    continue;
+	}
+	break;
+    }
+    q->sk->data = q;
+    dg = newdgbuf();
+    memcpy(dg->data = smalloc(len), buf, dg->size = len);
+    memcpy(dg->addr = (struct sockaddr *)&dg->addrbuf, &q->srv, dg->addrlen = q->srvlen);
+    sockqueuedg(q->sk, dg);
+    q->timer = timercallback(ntime() + confgetint("net", "dnstimeout"), (void (*)(int, void *))dnstimeout, q);
+    return(0);
+}
+
+static int startdnsquery(char *name, int type)
+{
+    struct dnsquery *q;
+    
+    for(q = dnsqueries; q != NULL; q = q->next) {
+	if((q->type == type) && !strcasecmp(q->name, name))
+	    return(0);
     }
+    q = smalloc(sizeof(*q));
+    memset(q, 0, sizeof(*q));
+    q->name = sstrdup(name);
+    q->type = type;
+    if(senddnsquery(q)) {
+	free(q->name);
+	free(q);
+	return(-1);
+    }
+    q->next = dnsqueries;
+    if(dnsqueries != NULL)
+	dnsqueries->prev = q;
+    dnsqueries = q;
     return(0);
 }
 
+int netresolve(char *addr, void (*callback)(struct sockaddr *addr, int addrlen, void *data), void *data)
+{
+    int port, absolute;
+    char *host;
+    size_t len;
+    struct sockaddr_storage buf;
+    socklen_t buflen;
+    struct dnslookup *lu;
+    
+    if((host = splithostport(addr, &port)) == NULL) {
+	errno = EINVAL;
+	return(-1);
+    }
+    /* The trailing dot of an absolute name is not part of it as far
+     * as queries, replies and the cache are concerned. */
+    absolute = 0;
+    if(((len = strlen(host)) > 1) && (host[len - 1] == '.')) {
+	host[len - 1] = 0;
+	absolute = 1;
+    }
+    if(!parseaddr(host, port, &buf, &buflen) || !hostslookup(host, port, &buf, &buflen)) {
+	free(host);
+	callback((struct sockaddr *)&buf, buflen, data);
+	return(0);
+    }
+    lu = smalloc(sizeof(*lu));
+    memset(lu, 0, sizeof(*lu));
+    lu->names = dnsnames(host, absolute);
+    free(host);
+    lu->port = port;
+    lu->callback = callback;
+    lu->data = data;
+    return(lookupnext(lu));
+}
+
 static int getlocalname(int fd, struct sockaddr **namebuf, socklen_t *lenbuf)
 {
     socklen_t len;
@@ -37,6 +37,29 @@ struct dgrambuf
     socklen_t addrlen;
     void *data;
     size_t size;
+    /* addr points here unless it has been allocated separately */
+    struct sockaddr_storage addrbuf;
+};
+
+/* A reference counted file descriptor that file data can be queued
+ * from. */
+struct sockfile
+{
+    int fd;
+    int refcount;
+};
+
+/* A segment of a stream socket's buffer. The data lives in
+ * buf[off..off + len), and buf is size bytes large, unless file is
+ * set, in which case the data is len bytes of that file, starting at
+ * foff. */
+struct sockbufseg
+{
+    struct sockbufseg *next;
+    char *buf;
+    size_t off, len, size;
+    struct sockfile *file;
+    off_t foff;
 };
 
 struct socket
@@ -55,8 +78,7 @@ struct socket
 	} d;
 	struct
 	{
-	    void *buf;
-	    size_t bufsize;
+	    struct sockbufseg *f, *l;
 	    size_t datasize;
 	} s;
     } buf;
@@ -68,6 +90,9 @@ struct socket
     void *data;
     char *dbgnm;
     int dbglvl;
+    /* Callback batch membership, maintained by net.c */
+    int batches;
+    struct socket *bnext[3];
 };
 
 struct lport {
@@ -85,8 +110,10 @@ struct lport *netcslistenlocal(int type, struct sockaddr *name, socklen_t namele
 struct lport *netcstcplisten(int port, int local, void (*func)(struct lport *, struct socket *, void *), void *data);
 struct socket *netcsconn(struct sockaddr *addr, socklen_t addrlen, void (*func)(struct socket *, int, void *), void *data);
 int pollsocks(int timeout);
+struct dgrambuf *newdgbuf(void);
 void freedgbuf(struct dgrambuf *dg);
 void sockqueue(struct socket *sk, void *data, size_t size);
+void sockqueuebuf(struct socket *sk, void *buf, size_t size);
 void sockerror(struct socket *sk, int en);
 /* size_t sockqueuesize(struct socket *sk); */
 size_t socktqueuesize(struct socket *sk);
@@ -115,5 +142,10 @@ int sockfamily(struct socket *sk);
 void quitsock(struct socket *sk);
 void socksetdebug(struct socket *sk, int level, char *nm, ...);
 void sockread(struct socket *sk);
+struct sockfile *newsockfile(int fd);
+void getsockfile(struct sockfile *file);
+void putsockfile(struct sockfile *file);
+void sockqueuefile(struct socket *sk, struct sockfile *file, off_t off, size_t len);
+void sockpassdata(struct socket *from, struct socket *to);
 
 #endif
@@ -26,14 +26,43 @@
 #define FD_PIPE 0
 #define FD_FILE 1
 
+#define EVS_READCB 0
+#define EVS_WRITECB 1
+#define EVS_CONNCB 2
+#define EVS_ERRCB 3
+#define EVS_ACCEPTCB 4
+#define EVS_TIMER 5
+#define EVS_POLL 6
+#define EVS_LAG 7
+#define EVS_NUM 8
+
+/* The number of buckets in an event histogram. Bucket i counts
+ * events that took less than 2^i microseconds, except for the last
+ * one, which counts all slower events. */
+#define EVHISTBUCKETS 24
+
+/* Runs stmt, and records the time it took in evstats[type]. */
+#define evtimed(type, stmt) do { \
+    double __evstart = ntime(); \
+    stmt; \
+    evhistadd(&evstats[type], ntime() - __evstart); \
+} while(0)
+
 struct timer
 {
-    struct timer *next, *prev;
+    size_t idx; /* Position in the timer heap */
     double at;
     void (*func)(int cancelled, void *data);
     void *data;
 };
 
+struct evhist
+{
+    unsigned long count;
+    double total, max;
+    unsigned long buckets[EVHISTBUCKETS];
+};
+
 struct child
 {
     struct child *next, *prev;
@@ -45,6 +74,10 @@ struct child
 void childcallback(pid_t pid, void (*func)(pid_t, int, void *), void *data);
 struct timer *timercallback(double at, void (*func)(int, void *), void *data);
 void canceltimer(struct timer *timer);
+void evhistadd(struct evhist *hist, double dur);
 pid_t forksess(uid_t user, struct authhandle *auth, void (*ccbfunc)(pid_t, int, void *), void *data, ...);
 
+extern struct evhist evstats[EVS_NUM];
+extern char *evstatnames[EVS_NUM];
+
 #endif
@@ -90,6 +90,8 @@ void freetransfer(struct transfer *transfer)
 	transfer->localend->errcb = NULL;
 	putsock(transfer->localend);
     }
+    if(transfer->localfile != NULL)
+	putsockfile(transfer->localfile);
     if(transfer->filterout != NULL)
     {
 	transfer->filterout->readcb = NULL;
@@ -136,8 +138,7 @@ static void localread(struct socket *sk, struct transfer *transfer)
 	buf = sockgetinbuf(sk, &blen);
 	if((transfer->endpos >= 0) && (transfer->localpos + blen > transfer->endpos))
 	    blen = transfer->endpos - transfer->localpos;
-	sockqueue(transfer->datapipe, buf, blen);
-	free(buf);
+	sockqueuebuf(transfer->datapipe, buf, blen);
 	time(&transfer->activity);
 	transfer->localpos += blen;
 	bytesupload += blen;
@@ -150,6 +151,41 @@ static void localread(struct socket *sk, struct transfer *transfer)
     }
 }
 
+/*
+ * The counterpart of localread() for uploads served straight from a
+ * file, which is queued by reference so that the network layer can
+ * send it without copying it through userspace.
+ */
+static void fileread(struct transfer *transfer)
+{
+    ssize_t left;
+    off_t end, blen, curpos;
+    
+    end = (transfer->endpos >= 0)?transfer->endpos:transfer->size;
+    if((transfer->datapipe != NULL) && (transfer->datapipe->state != SOCK_STL))
+    {
+	if((transfer->localpos < end) && ((left = sockqueueleft(transfer->datapipe)) > 0))
+	{
+	    blen = end - transfer->localpos;
+	    if(blen > left)
+		blen = left;
+	    sockqueuefile(transfer->datapipe, transfer->localfile, transfer->localpos, blen);
+	    time(&transfer->activity);
+	    transfer->localpos += blen;
+	    bytesupload += blen;
+	}
+	if(transfer->localpos >= end)
+	    closesock(transfer->datapipe);
+    }
+    if((curpos = transfer->localpos - socktqueuesize(transfer->datapipe)) < 0)
+	curpos = 0;
+    if(curpos != transfer->curpos)
+    {
+	transfer->curpos = curpos;
+	CBCHAINDOCB(transfer, trans_p, transfer);
+    }
+}
+
 static void dataread(struct socket *sk, struct transfer *transfer)
 {
     void *buf;
@@ -159,8 +195,7 @@ static void dataread(struct socket *sk, struct transfer *transfer)
 	buf = sockgetinbuf(sk, &blen);
 	if((transfer->endpos >= 0) && (transfer->curpos + blen > transfer->endpos))
 	    blen = transfer->endpos - transfer->curpos;
-	sockqueue(transfer->localend, buf, blen);
-	free(buf);
+	sockqueuebuf(transfer->localend, buf, blen);
 	transfer->curpos += blen;
 	bytesdownload += blen;
 	CBCHAINDOCB(transfer, trans_p, transfer);
@@ -177,6 +212,8 @@ static void datawrite(struct socket *sk, struct transfer *transfer)
 {
     if(transfer->localend != NULL)
 	localread(transfer->localend, transfer);
+    else if(transfer->localfile != NULL)
+	fileread(transfer);
 }
 
 static void localerr(struct socket *sk, int errno, struct transfer *transfer)
@@ -314,9 +351,38 @@ void transferprepul(struct transfer *transfer, off_t size, off_t start, off_t en
     transfersetsize(transfer, size);
     transfer->curpos = transfer->localpos = start;
     transfer->endpos = end;
+    if(transfer->localfile != NULL)
+    {
+	putsockfile(transfer->localfile);
+	transfer->localfile = NULL;
+    }
     transfersetlocalend(transfer, lesk);
 }
 
+/*
+ * Like transferprepul, but takes over an open file descriptor
+ * instead of a socket, so that the data can be sent from the file
+ * without passing through userspace. This can only be used when the
+ * data is to be sent unmodified.
+ */
+void transferprepulfile(struct transfer *transfer, off_t size, off_t start, off_t end, int fd)
+{
+    transfersetsize(transfer, size);
+    transfer->curpos = transfer->localpos = start;
+    transfer->endpos = end;
+    if(transfer->localend != NULL)
+    {
+	transfer->localend->readcb = NULL;
+	transfer->localend->writecb = NULL;
+	transfer->localend->errcb = NULL;
+	putsock(transfer->localend);
+	transfer->localend = NULL;
+    }
+    if(transfer->localfile != NULL)
+	putsockfile(transfer->localfile);
+    transfer->localfile = newsockfile(fd);
+}
+
 void transferstartdl(struct transfer *transfer, struct socket *sk)
 {
     transfersetstate(transfer, TRNS_MAIN);
@@ -329,6 +395,8 @@ void transferstartul(struct transfer *transfer, struct socket *sk)
     socksettos(sk, confgetint("transfer", "ultos"));
     if(transfer->localend != NULL)
 	localread(transfer->localend, transfer);
+    else if(transfer->localfile != NULL)
+	fileread(transfer);
 }
 
 void transfersetlocalend(struct transfer *transfer, struct socket *sk)
@@ -65,6 +65,7 @@ struct transfer
     off_t size, curpos, endpos, localpos;
     struct fnetnode *fn;
     struct socket *localend, *datapipe;
+    struct sockfile *localfile;
     struct wcspair *args;
     pid_t filter;
     struct authhandle *auth;
@@ -100,6 +101,7 @@ void resettransfer(struct transfer *transfer);
 void transfersetlocalend(struct transfer *transfer, struct socket *sk);
 int forkfilter(struct transfer *transfer);
 void transferprepul(struct transfer *transfer, off_t size, off_t start, off_t end, struct socket *lesk);
+void transferprepulfile(struct transfer *transfer, off_t size, off_t start, off_t end, int fd);
 void transferstartul(struct transfer *transfer, struct socket *sk);
 void transfersethash(struct transfer *transfer, struct hash *hash);
 struct transfer *finddownload(wchar_t *peerid);
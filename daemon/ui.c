@@ -1261,7 +1261,7 @@ static void cmd_hashstatus(struct socket *sk, struct uidata *data, int argc, wch
     int total, hashed;
     
     total = hashed = 0;
-    for(node = shareroot->child; node != NULL; node = nextscnode(node))
+    for(node = scchild(shareroot); node != NULL; node = nextscnode(node))
     {
 	if(node->f.b.type == FILE_REG)
 	{
@@ -1273,6 +1273,19 @@ static void cmd_hashstatus(struct socket *sk, struct uidata *data, int argc, wch
     sq(sk, 0, L"200", L"%i", total, L"tth", L"%i", hashed, NULL);
 }
 
+static void cmd_hashqueue(struct socket *sk, struct uidata *data, int argc, wchar_t **argv)
+{
+    sq(sk, 0, L"200", L"%i", numhashjobs, L"%ll", (long long)gethashrate(), NULL);
+}
+
+static void cmd_sharestats(struct socket *sk, struct uidata *data, int argc, wchar_t **argv)
+{
+    size_t nodes, treemem, names, namemem, indexmem;
+    
+    getsharestats(&nodes, &treemem, &names, &namemem, &indexmem);
+    sq(sk, 0, L"200", L"nodes", L"%ll", (long long)nodes, L"tree", L"%ll", (long long)treemem, L"names", L"%ll", (long long)names, L"namemem", L"%ll", (long long)namemem, L"index", L"%ll", (long long)indexmem, NULL);
+}
+
 static void cmd_transstatus(struct socket *sk, struct uidata *data, int argc, wchar_t **argv)
 {
     havepriv(PERM_TRANS);
@@ -1351,6 +1364,41 @@ static void cmd_uptime(struct socket *sk, struct uidata *data, int argc, wchar_t
     sq(sk, 0, L"200", L"%i", time(NULL) - starttime, NULL);
 }
 
+static void sqevhist(struct socket *sk, int cont, char *name, struct evhist *hist)
+{
+    int i;
+    
+    sq(sk, 2 | cont, L"200", L"%s", name, L"%ll", (long long)hist->count, L"%f", hist->total, L"%f", hist->max, NULL);
+    for(i = 0; i < EVHISTBUCKETS; i++)
+	sq(sk, 2, L"%ll", (long long)hist->buckets[i], NULL);
+    sq(sk, 0, NULL);
+}
+
+static void cmd_evstats(struct socket *sk, struct uidata *data, int argc, wchar_t **argv)
+{
+    extern struct module *modchain;
+    int i;
+    struct module *mod, *last;
+    char *name;
+    
+    last = NULL;
+    for(mod = modchain; mod != NULL; mod = mod->next)
+    {
+	if(mod->run != NULL)
+	    last = mod;
+    }
+    for(i = 0; i < EVS_NUM; i++)
+	sqevhist(sk, (i < EVS_NUM - 1) || (last != NULL), evstatnames[i], &evstats[i]);
+    for(mod = modchain; mod != NULL; mod = mod->next)
+    {
+	if(mod->run == NULL)
+	    continue;
+	name = sprintf2("run:%s", mod->name);
+	sqevhist(sk, mod != last, name, &mod->runstat);
+	free(name);
+    }
+}
+
 static void cmd_hup(struct socket *sk, struct uidata *data, int argc, wchar_t **argv)
 {
     extern volatile int reinit;
@@ -1397,10 +1445,13 @@ static struct command commands[] =
     {L"filtercmd", cmd_filtercmd},
     {L"lstrarg", cmd_lstrarg},
     {L"hashstatus", cmd_hashstatus},
+    {L"hashqueue", cmd_hashqueue},
+    {L"sharestats", cmd_sharestats},
     {L"transstatus", cmd_transstatus},
     {L"register", cmd_register},
     {L"sendmsg", cmd_sendmsg},
     {L"uptime", cmd_uptime},
+    {L"evstats", cmd_evstats},
     {L"hup", cmd_hup},
     {NULL, NULL}
 };
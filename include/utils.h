@@ -89,6 +89,8 @@ wchar_t *icmbstowcs(char *mbs, char *charset);
 wchar_t *icsmbstowcs(char *mbs, char *charset, wchar_t *def);
 char *icwcstombs(wchar_t *wcs, char *charset);
 char *icswcstombs(wchar_t *wcs, char *charset, char *def);
+wchar_t *utf8towcs(char *mbs);
+char *wcstoutf8(wchar_t *wcs);
 wchar_t *wcstolower(wchar_t *wcs);
 wchar_t ucptowc(int ucp);
 void _sizebuf(void **buf, size_t *bufsize, size_t reqsize, size_t elsize, int algo);